@@ -293,9 +293,159 @@ static ssize_t iscsi_open_state_show(struct kobject *kobj,
 static struct kobj_attribute iscsi_open_state_attr =
 	__ATTR(open_state, S_IRUGO, iscsi_open_state_show, NULL);
 
+static ssize_t iscsi_tx_batch_size_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos;
+
+	TRACE_ENTRY();
+
+	pos = sprintf(buf, "%d\n%s\n", iscsi_tx_batch_size,
+		(iscsi_tx_batch_size == ISCSI_DEF_TX_BATCH_SIZE)
+			? "" : SCST_SYSFS_KEY_MARK);
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t iscsi_tx_batch_size_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	unsigned long val;
+
+	TRACE_ENTRY();
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+	res = kstrtoul(buf, 0, &val);
+#else
+	res = strict_strtoul(buf, 0, &val);
+#endif
+	if (res != 0) {
+		PRINT_ERROR("strict_strtoul() for %s failed: %d ", buf, res);
+		goto out;
+	}
+
+	if ((val < 1) || (val > ISCSI_MAX_TX_BATCH_SIZE)) {
+		PRINT_ERROR("Illegal TX batch size %lu (allowed 1 - %d)", val,
+			ISCSI_MAX_TX_BATCH_SIZE);
+		res = -EINVAL;
+		goto out;
+	}
+
+	iscsi_tx_batch_size = val;
+	PRINT_INFO("Changed TX batch size to %d", iscsi_tx_batch_size);
+
+	res = count;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute iscsi_tx_batch_size_attr =
+	__ATTR(tx_batch_size, S_IRUGO | S_IWUSR, iscsi_tx_batch_size_show,
+		iscsi_tx_batch_size_store);
+
+static ssize_t iscsi_conn_cpu_affinity_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos;
+
+	TRACE_ENTRY();
+
+	pos = sprintf(buf, "%d\n%s\n", iscsi_conn_cpu_affinity,
+		(iscsi_conn_cpu_affinity == 0) ? "" : SCST_SYSFS_KEY_MARK);
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t iscsi_conn_cpu_affinity_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res = count;
+
+	TRACE_ENTRY();
+
+	switch (buf[0]) {
+	case '0':
+		iscsi_conn_cpu_affinity = 0;
+		break;
+	case '1':
+		iscsi_conn_cpu_affinity = 1;
+		break;
+	default:
+		PRINT_ERROR("%s: Requested action not understood: %s",
+		       __func__, buf);
+		res = -EINVAL;
+		goto out;
+	}
+
+	PRINT_INFO("Connections CPU affinity %s",
+		iscsi_conn_cpu_affinity ? "enabled" : "disabled");
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute iscsi_conn_cpu_affinity_attr =
+	__ATTR(conn_cpu_affinity, S_IRUGO | S_IWUSR,
+		iscsi_conn_cpu_affinity_show, iscsi_conn_cpu_affinity_store);
+
+static ssize_t iscsi_early_r2t_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos;
+
+	TRACE_ENTRY();
+
+	pos = sprintf(buf, "%d\n%s\n", iscsi_early_r2t,
+		(iscsi_early_r2t == 0) ? "" : SCST_SYSFS_KEY_MARK);
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t iscsi_early_r2t_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res = count;
+
+	TRACE_ENTRY();
+
+	switch (buf[0]) {
+	case '0':
+		iscsi_early_r2t = 0;
+		break;
+	case '1':
+		iscsi_early_r2t = 1;
+		break;
+	default:
+		PRINT_ERROR("%s: Requested action not understood: %s",
+		       __func__, buf);
+		res = -EINVAL;
+		goto out;
+	}
+
+	PRINT_INFO("Early R2T %s", iscsi_early_r2t ? "enabled" : "disabled");
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute iscsi_early_r2t_attr =
+	__ATTR(early_r2t, S_IRUGO | S_IWUSR, iscsi_early_r2t_show,
+		iscsi_early_r2t_store);
+
 const struct attribute *iscsi_attrs[] = {
 	&iscsi_version_attr.attr,
 	&iscsi_open_state_attr.attr,
+	&iscsi_tx_batch_size_attr.attr,
+	&iscsi_conn_cpu_affinity_attr.attr,
+	&iscsi_early_r2t_attr.attr,
 	NULL,
 };
 
@@ -22,6 +22,12 @@
 #include "iscsi.h"
 #include "digest.h"
 
+/*
+ * If set, each new connection is served by the read and write threads
+ * bound to the CPU receiving the connection's packets.
+ */
+int iscsi_conn_cpu_affinity;
+
 static int print_conn_state(char *p, size_t size, struct iscsi_conn *conn)
 {
 	int pos = 0;
@@ -235,6 +241,214 @@ static ssize_t iscsi_conn_state_show(struct kobject *kobj,
 static struct kobj_attribute iscsi_conn_state_attr =
 	__ATTR(state, S_IRUGO, iscsi_conn_state_show, NULL);
 
+static ssize_t iscsi_conn_digest_time_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos;
+	struct iscsi_conn *conn;
+
+	TRACE_ENTRY();
+
+	conn = container_of(kobj, struct iscsi_conn, conn_kobj);
+
+	pos = sprintf(buf, "RX %lu us\nTX %lu us\n",
+		(unsigned long)atomic_long_read(&conn->rx_digest_time_ns) / 1000,
+		(unsigned long)atomic_long_read(&conn->tx_digest_time_ns) / 1000);
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t iscsi_conn_digest_time_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct iscsi_conn *conn;
+
+	TRACE_ENTRY();
+
+	conn = container_of(kobj, struct iscsi_conn, conn_kobj);
+
+	atomic_long_set(&conn->rx_digest_time_ns, 0);
+	atomic_long_set(&conn->tx_digest_time_ns, 0);
+
+	TRACE_EXIT_RES(count);
+	return count;
+}
+
+static struct kobj_attribute iscsi_conn_digest_time_attr =
+	__ATTR(digest_time, S_IRUGO | S_IWUSR, iscsi_conn_digest_time_show,
+		iscsi_conn_digest_time_store);
+
+static ssize_t iscsi_conn_itt_lookup_depth_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos;
+	struct iscsi_conn *conn;
+	unsigned long lookups, depth, avg;
+
+	TRACE_ENTRY();
+
+	conn = container_of(kobj, struct iscsi_conn, conn_kobj);
+
+	spin_lock_bh(&conn->cmd_list_lock);
+	lookups = conn->itt_lookups;
+	depth = conn->itt_lookup_depth;
+	spin_unlock_bh(&conn->cmd_list_lock);
+
+	/* In hundredths */
+	avg = (lookups != 0) ? (depth * 100) / lookups : 0;
+
+	pos = sprintf(buf, "%lu.%02lu\n", avg / 100, avg % 100);
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t iscsi_conn_itt_lookup_depth_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct iscsi_conn *conn;
+
+	TRACE_ENTRY();
+
+	conn = container_of(kobj, struct iscsi_conn, conn_kobj);
+
+	spin_lock_bh(&conn->cmd_list_lock);
+	conn->itt_lookups = 0;
+	conn->itt_lookup_depth = 0;
+	spin_unlock_bh(&conn->cmd_list_lock);
+
+	TRACE_EXIT_RES(count);
+	return count;
+}
+
+static struct kobj_attribute iscsi_conn_itt_lookup_depth_attr =
+	__ATTR(itt_lookup_depth, S_IRUGO | S_IWUSR,
+		iscsi_conn_itt_lookup_depth_show,
+		iscsi_conn_itt_lookup_depth_store);
+
+static ssize_t iscsi_conn_pdus_per_send_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos;
+	struct iscsi_conn *conn;
+	unsigned long batches, pdus, avg;
+
+	TRACE_ENTRY();
+
+	conn = container_of(kobj, struct iscsi_conn, conn_kobj);
+
+	/* Updated by the write thread without locks, so it's approximate */
+	batches = conn->tx_batches;
+	pdus = conn->tx_batch_pdus;
+
+	/* In hundredths */
+	avg = (batches != 0) ? (pdus * 100) / batches : 0;
+
+	pos = sprintf(buf, "%lu.%02lu\n", avg / 100, avg % 100);
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static struct kobj_attribute iscsi_conn_pdus_per_send_attr =
+	__ATTR(pdus_per_send, S_IRUGO, iscsi_conn_pdus_per_send_show, NULL);
+
+static ssize_t iscsi_conn_io_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos;
+	struct iscsi_conn *conn;
+
+	TRACE_ENTRY();
+
+	conn = container_of(kobj, struct iscsi_conn, conn_kobj);
+
+	pos = sprintf(buf, "RX bytes %llu\nTX bytes %llu\n"
+		"SCSI commands %llu\n",
+		(unsigned long long)conn->rx_bytes,
+		(unsigned long long)conn->tx_bytes,
+		(unsigned long long)conn->rx_scsi_cmds);
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static struct kobj_attribute iscsi_conn_io_stats_attr =
+	__ATTR(io_stats, S_IRUGO, iscsi_conn_io_stats_show, NULL);
+
+static ssize_t iscsi_conn_r2t_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos;
+	struct iscsi_conn *conn;
+	u64 waits, wait_us;
+
+	TRACE_ENTRY();
+
+	conn = container_of(kobj, struct iscsi_conn, conn_kobj);
+
+	/* Updated by the read thread without locks, so it's approximate */
+	waits = conn->data_out_waits;
+	wait_us = conn->data_out_wait_ns;
+	do_div(wait_us, 1000);
+
+	pos = sprintf(buf, "R2T sent %llu\nOutstanding R2T %d\n"
+		"Max outstanding R2T %u\nData-Out waits %llu\n"
+		"Data-Out wait time %llu us\n",
+		(unsigned long long)conn->r2t_sent,
+		atomic_read(&conn->r2t_outstanding),
+		conn->max_r2t_outstanding, (unsigned long long)waits,
+		(unsigned long long)wait_us);
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t iscsi_conn_r2t_stats_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct iscsi_conn *conn;
+
+	TRACE_ENTRY();
+
+	conn = container_of(kobj, struct iscsi_conn, conn_kobj);
+
+	conn->r2t_sent = 0;
+	conn->max_r2t_outstanding = 0;
+	conn->data_out_waits = 0;
+	conn->data_out_wait_ns = 0;
+
+	TRACE_EXIT_RES(count);
+	return count;
+}
+
+static struct kobj_attribute iscsi_conn_r2t_stats_attr =
+	__ATTR(r2t_stats, S_IRUGO | S_IWUSR, iscsi_conn_r2t_stats_show,
+		iscsi_conn_r2t_stats_store);
+
+static ssize_t iscsi_conn_cpu_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos;
+	struct iscsi_conn *conn;
+
+	TRACE_ENTRY();
+
+	conn = container_of(kobj, struct iscsi_conn, conn_kobj);
+
+	if (conn->conn_cpu >= 0)
+		pos = sprintf(buf, "%d\n", conn->conn_cpu);
+	else
+		pos = sprintf(buf, "%s\n", "none");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static struct kobj_attribute iscsi_conn_cpu_attr =
+	__ATTR(cpu, S_IRUGO, iscsi_conn_cpu_show, NULL);
+
 static void conn_sysfs_del(struct iscsi_conn *conn)
 {
 	int rc;
@@ -323,6 +537,54 @@ restart:
 		goto out_err;
 	}
 
+	res = sysfs_create_file(&conn->conn_kobj,
+			&iscsi_conn_digest_time_attr.attr);
+	if (res != 0) {
+		PRINT_ERROR("Unable create sysfs attribute %s for conn %s",
+			iscsi_conn_digest_time_attr.attr.name, addr);
+		goto out_err;
+	}
+
+	res = sysfs_create_file(&conn->conn_kobj,
+			&iscsi_conn_itt_lookup_depth_attr.attr);
+	if (res != 0) {
+		PRINT_ERROR("Unable create sysfs attribute %s for conn %s",
+			iscsi_conn_itt_lookup_depth_attr.attr.name, addr);
+		goto out_err;
+	}
+
+	res = sysfs_create_file(&conn->conn_kobj,
+			&iscsi_conn_pdus_per_send_attr.attr);
+	if (res != 0) {
+		PRINT_ERROR("Unable create sysfs attribute %s for conn %s",
+			iscsi_conn_pdus_per_send_attr.attr.name, addr);
+		goto out_err;
+	}
+
+	res = sysfs_create_file(&conn->conn_kobj,
+			&iscsi_conn_cpu_attr.attr);
+	if (res != 0) {
+		PRINT_ERROR("Unable create sysfs attribute %s for conn %s",
+			iscsi_conn_cpu_attr.attr.name, addr);
+		goto out_err;
+	}
+
+	res = sysfs_create_file(&conn->conn_kobj,
+			&iscsi_conn_io_stats_attr.attr);
+	if (res != 0) {
+		PRINT_ERROR("Unable create sysfs attribute %s for conn %s",
+			iscsi_conn_io_stats_attr.attr.name, addr);
+		goto out_err;
+	}
+
+	res = sysfs_create_file(&conn->conn_kobj,
+			&iscsi_conn_r2t_stats_attr.attr);
+	if (res != 0) {
+		PRINT_ERROR("Unable create sysfs attribute %s for conn %s",
+			iscsi_conn_r2t_stats_attr.attr.name, addr);
+		goto out_err;
+	}
+
 out:
 	TRACE_EXIT_RES(res);
 	return res;
@@ -750,6 +1012,95 @@ static void conn_activate(struct iscsi_conn *conn)
 	return;
 }
 
+/*
+ * Returns CPU, which handles RX interrupts for the conn's socket, or -1, if
+ * it can't be found out.
+ */
+static int conn_get_incoming_cpu(struct iscsi_conn *conn)
+{
+	struct sock *sk = conn->sock->sk;
+	int cpu = -1;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+	cpu = sk->sk_incoming_cpu;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+	{
+		/*
+		 * No sk_incoming_cpu, so let's suppose the usual RSS setup,
+		 * when IRQ of each NIC RX queue is bound to its own CPU.
+		 */
+		int queue = sk_rx_queue_get(sk);
+
+		if (queue >= 0) {
+			int n = queue % num_online_cpus();
+
+			for_each_online_cpu(cpu) {
+				if (n-- == 0)
+					break;
+			}
+		}
+	}
+#endif
+
+	if ((cpu < 0) || (cpu >= nr_cpu_ids) || !cpu_online(cpu))
+		cpu = -1;
+
+	return cpu;
+}
+
+/*
+ * Sets the threads pool serving conn. In the CPU affinity mode it is the
+ * pool of the threads bound to the CPU receiving conn's packets, so all
+ * processing of the connection, including its socket, stays on that CPU.
+ * Otherwise, or if the CPU isn't allowed for the session's ACG, it is
+ * the session's pool.
+ */
+static void conn_set_thr_pool(struct iscsi_conn *conn)
+{
+	struct iscsi_session *session = conn->session;
+	const cpumask_t *acg_mask = &session->scst_sess->acg->acg_cpu_mask;
+	int cpu, res;
+
+	TRACE_ENTRY();
+
+	conn->conn_thr_pool = session->sess_thr_pool;
+	conn->conn_cpu = -1;
+
+	if (!iscsi_conn_cpu_affinity)
+		goto out;
+
+	cpu = conn_get_incoming_cpu(conn);
+	if ((cpu < 0) || !cpumask_test_cpu(cpu, acg_mask)) {
+		TRACE_MGMT_DBG("Incoming CPU %d for conn %p unusable, using "
+			"session's threads", cpu, conn);
+		goto out;
+	}
+
+	res = iscsi_threads_pool_get(cpumask_of(cpu), &conn->conn_thr_pool);
+	if (res != 0) {
+		PRINT_WARNING("Unable to get threads for CPU %d (conn %p, "
+			"res %d), using session's threads", cpu, conn, res);
+		conn->conn_thr_pool = session->sess_thr_pool;
+		goto out;
+	}
+
+	conn->conn_cpu = cpu;
+
+	TRACE_MGMT_DBG("Conn %p bound to CPU %d (pool %p)", conn, cpu,
+		conn->conn_thr_pool);
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+static void conn_put_thr_pool(struct iscsi_conn *conn)
+{
+	if (conn->conn_cpu >= 0)
+		iscsi_threads_pool_put(conn->conn_thr_pool);
+	return;
+}
+
 /*
  * Note: the code below passes a kernel space pointer (&opt) to setsockopt()
  * while the declaration of setsockopt specifies that it expects a user space
@@ -827,6 +1178,8 @@ int conn_free(struct iscsi_conn *conn)
 
 	list_del(&conn->conn_list_entry);
 
+	conn_put_thr_pool(conn);
+
 	fput(conn->file);
 	conn->file = NULL;
 	conn->sock = NULL;
@@ -848,7 +1201,7 @@ static int iscsi_conn_alloc(struct iscsi_session *session,
 	struct iscsi_kern_conn_info *info, struct iscsi_conn **new_conn)
 {
 	struct iscsi_conn *conn;
-	int res = 0;
+	int res = 0, i;
 
 	conn = kzalloc(sizeof(*conn), GFP_KERNEL);
 	if (!conn) {
@@ -856,8 +1209,11 @@ static int iscsi_conn_alloc(struct iscsi_session *session,
 		goto out_err;
 	}
 
-	TRACE_MGMT_DBG("Creating connection %p for sid %#Lx, cid %u", conn,
-		       (long long unsigned int)session->sid, info->cid);
+	conn->transport = &iscsi_tcp_transport;
+
+	TRACE_MGMT_DBG("Creating %s connection %p for sid %#Lx, cid %u",
+		conn->transport->name, conn,
+		(long long unsigned int)session->sid, info->cid);
 
 	/* Changing it, change ISCSI_CONN_IOV_MAX as well !! */
 	conn->read_iov = (struct iovec *)get_zeroed_page(GFP_KERNEL);
@@ -867,6 +1223,9 @@ static int iscsi_conn_alloc(struct iscsi_session *session,
 	}
 
 	atomic_set(&conn->conn_ref_cnt, 0);
+	atomic_long_set(&conn->rx_digest_time_ns, 0);
+	atomic_long_set(&conn->tx_digest_time_ns, 0);
+	atomic_set(&conn->r2t_outstanding, 0);
 	conn->session = session;
 	if (session->sess_reinstating)
 		__set_bit(ISCSI_CONN_REINSTATING, &conn->conn_aflags);
@@ -885,6 +1244,8 @@ static int iscsi_conn_alloc(struct iscsi_session *session,
 	conn->target = session->target;
 	spin_lock_init(&conn->cmd_list_lock);
 	INIT_LIST_HEAD(&conn->cmd_list);
+	for (i = 0; i < ARRAY_SIZE(conn->cmnd_itt_hash); i++)
+		INIT_LIST_HEAD(&conn->cmnd_itt_hash[i]);
 	spin_lock_init(&conn->write_list_lock);
 	INIT_LIST_HEAD(&conn->write_list);
 	INIT_LIST_HEAD(&conn->write_timeout_list);
@@ -895,8 +1256,6 @@ static int iscsi_conn_alloc(struct iscsi_session *session,
 	INIT_LIST_HEAD(&conn->nop_req_list);
 	spin_lock_init(&conn->nop_req_list_lock);
 
-	conn->conn_thr_pool = session->sess_thr_pool;
-
 	conn->nop_in_ttt = 0;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20))
 	INIT_DELAYED_WORK(&conn->nop_in_delayed_work,
@@ -921,10 +1280,12 @@ static int iscsi_conn_alloc(struct iscsi_session *session,
 	if (res != 0)
 		goto out_fput;
 
+	conn_set_thr_pool(conn);
+
 #ifndef CONFIG_SCST_PROC
 	res = conn_sysfs_add(conn);
 	if (res != 0)
-		goto out_fput;
+		goto out_put_pool;
 #endif
 
 	list_add_tail(&conn->conn_list_entry, &session->conn_list);
@@ -934,6 +1295,11 @@ static int iscsi_conn_alloc(struct iscsi_session *session,
 out:
 	return res;
 
+#ifndef CONFIG_SCST_PROC
+out_put_pool:
+	conn_put_thr_pool(conn);
+#endif
+
 out_fput:
 	fput(conn->file);
 
@@ -19,6 +19,7 @@
 
 #include <linux/types.h>
 #include <linux/scatterlist.h>
+#include <linux/ktime.h>
 
 #include "iscsi.h"
 #include "digest.h"
@@ -58,10 +59,57 @@ int digest_init(struct iscsi_conn *conn)
 	return 0;
 }
 
-static __be32 evaluate_crc32_from_sg(struct scatterlist *sg, int nbytes,
-	uint32_t padding)
+static inline void digest_account(atomic_long_t *time_ns, ktime_t start)
+{
+	atomic_long_add((long)ktime_to_ns(ktime_sub(ktime_get(), start)),
+		time_ns);
+}
+
+/*
+ * Updates crc with nbytes of data of sg vector starting at offset. As the
+ * rest of the RX path, relies on each entry covering a single page, the
+ * first one from sg[0].offset, so the entry containing offset is found by
+ * the page arithmetic. Neighbour entries, which happen to be contiguous in
+ * the kernel virtual address space, are fed to crc32c() as a single chunk,
+ * so the (possibly hardware accelerated) crc32c transform can work on as
+ * big buffers as possible.
+ */
+static u32 crc32c_update_sg(u32 crc, struct scatterlist *sg, u32 offset,
+	u32 nbytes)
+{
+#if defined(CONFIG_LIBCRC32C_MODULE) || defined(CONFIG_LIBCRC32C)
+	u8 *chunk = NULL;
+	u32 chunk_len = 0, skip;
+
+	offset += sg[0].offset;
+	sg += offset >> PAGE_SHIFT;
+	skip = (offset & ~PAGE_MASK) - sg->offset;
+
+	while (nbytes > 0) {
+		u8 *addr = (u8 *)sg_virt(sg) + skip;
+		u32 d = min_t(u32, nbytes, sg->length - skip);
+
+		if (addr == chunk + chunk_len)
+			chunk_len += d;
+		else {
+			if (chunk_len != 0)
+				crc = crc32c(crc, chunk, chunk_len);
+			chunk = addr;
+			chunk_len = d;
+		}
+		nbytes -= d;
+		skip = 0;
+		sg++;
+	}
+
+	if (chunk_len != 0)
+		crc = crc32c(crc, chunk, chunk_len);
+#endif
+	return crc;
+}
+
+static __be32 crc32c_finish(u32 crc, int nbytes, uint32_t padding)
 {
-	u32 crc = ~0;
 	int pad_bytes = ((nbytes + 3) & -4) - nbytes;
 
 #ifdef CONFIG_SCST_ISCSI_DEBUG_DIGEST_FAILURES
@@ -72,13 +120,6 @@ static __be32 evaluate_crc32_from_sg(struct scatterlist *sg, int nbytes,
 #endif
 
 #if defined(CONFIG_LIBCRC32C_MODULE) || defined(CONFIG_LIBCRC32C)
-	while (nbytes > 0) {
-		int d = min(nbytes, (int)(sg->length));
-		crc = crc32c(crc, sg_virt(sg), d);
-		nbytes -= d;
-		sg++;
-	}
-
 	if (pad_bytes)
 		crc = crc32c(crc, (u8 *)&padding, pad_bytes);
 #endif
@@ -88,54 +129,45 @@ static __be32 evaluate_crc32_from_sg(struct scatterlist *sg, int nbytes,
 
 static __be32 digest_header(struct iscsi_pdu *pdu)
 {
-	struct scatterlist sg[2];
 	unsigned int nbytes = sizeof(struct iscsi_hdr);
-	int asize = (pdu->ahssize + 3) & -4;
-
-	sg_init_table(sg, 2);
+	u32 crc = ~0;
 
-	sg_set_buf(&sg[0], &pdu->bhs, nbytes);
+#if defined(CONFIG_LIBCRC32C_MODULE) || defined(CONFIG_LIBCRC32C)
+	crc = crc32c(crc, (u8 *)&pdu->bhs, nbytes);
 	if (pdu->ahssize) {
-		sg_set_buf(&sg[1], pdu->ahs, asize);
+		int asize = (pdu->ahssize + 3) & -4;
+		crc = crc32c(crc, (u8 *)pdu->ahs, asize);
 		nbytes += asize;
 	}
+#endif
 	EXTRACHECKS_BUG_ON((nbytes & 3) != 0);
-	return evaluate_crc32_from_sg(sg, nbytes, 0);
+	return crc32c_finish(crc, nbytes, 0);
 }
 
 static __be32 digest_data(struct iscsi_cmnd *cmd, u32 size, u32 offset,
 	uint32_t padding)
 {
-	struct scatterlist *sg = cmd->sg;
+	u32 sg_offset = offset + cmd->sg[0].offset;
 	int idx, count;
-	struct scatterlist saved_sg;
-	__be32 crc;
 
-	offset += sg[0].offset;
-	idx = offset >> PAGE_SHIFT;
-	offset &= ~PAGE_MASK;
-
-	count = get_pgcnt(size, offset);
+	idx = sg_offset >> PAGE_SHIFT;
+	count = get_pgcnt(size, sg_offset & ~PAGE_MASK);
 
 	TRACE_DBG("req %p, idx %d, count %d, sg_cnt %d, size %d, "
 		"offset %d", cmd, idx, count, cmd->sg_cnt, size, offset);
 	sBUG_ON(idx + count > cmd->sg_cnt);
 
-	saved_sg = sg[idx];
-	sg[idx].offset = offset;
-	sg[idx].length -= offset - saved_sg.offset;
-
-	crc = evaluate_crc32_from_sg(sg + idx, size, padding);
-
-	sg[idx] = saved_sg;
-	return crc;
+	return crc32c_finish(crc32c_update_sg(~0, cmd->sg, offset, size),
+			size, padding);
 }
 
 int digest_rx_header(struct iscsi_cmnd *cmnd)
 {
 	__be32 crc;
+	ktime_t start = ktime_get();
 
 	crc = digest_header(&cmnd->pdu);
+	digest_account(&cmnd->conn->rx_digest_time_ns, start);
 	if (unlikely(crc != cmnd->hdigest)) {
 		PRINT_ERROR("%s", "RX header digest failed");
 		return -EIO;
@@ -147,33 +179,38 @@ int digest_rx_header(struct iscsi_cmnd *cmnd)
 
 void digest_tx_header(struct iscsi_cmnd *cmnd)
 {
+	ktime_t start = ktime_get();
+
 	cmnd->hdigest = digest_header(&cmnd->pdu);
+	digest_account(&cmnd->conn->tx_digest_time_ns, start);
 	TRACE_DBG("TX header digest for cmd %p: %x", cmnd, cmnd->hdigest);
 }
 
-int digest_rx_data(struct iscsi_cmnd *cmnd)
+/*
+ * Returns the request, in which data buffer cmnd's data are received, and
+ * the offset of them in it, or NULL, if the data digest check should be
+ * skipped for cmnd.
+ */
+static struct iscsi_cmnd *digest_rx_data_req(struct iscsi_cmnd *cmnd,
+	u32 *offset, bool warn)
 {
 	struct iscsi_cmnd *req;
 	struct iscsi_data_out_hdr *req_hdr;
-	u32 offset;
-	__be32 crc;
-	int res = 0;
 
 	switch (cmnd_opcode(cmnd)) {
 	case ISCSI_OP_SCSI_DATA_OUT:
 		req = cmnd->cmd_req;
 		if (unlikely(req == NULL)) {
 			/* It can be for prelim completed commands */
-			req = cmnd;
-			goto out;
+			goto out_skip;
 		}
 		req_hdr = (struct iscsi_data_out_hdr *)&cmnd->pdu.bhs;
-		offset = be32_to_cpu(req_hdr->buffer_offset);
+		*offset = be32_to_cpu(req_hdr->buffer_offset);
 		break;
 
 	default:
 		req = cmnd;
-		offset = 0;
+		*offset = 0;
 	}
 
 	/*
@@ -184,7 +221,7 @@ int digest_rx_data(struct iscsi_cmnd *cmnd)
 	 * do it).
 	 */
 	if (unlikely(req->prelim_compl_flags != 0))
-		goto out;
+		goto out_skip;
 
 	/*
 	 * Temporary to not crash with write residual overflows. ToDo. Until
@@ -194,16 +231,97 @@ int digest_rx_data(struct iscsi_cmnd *cmnd)
 	 * not trivial for such virtually never used case, so let's do it,
 	 * when it gets needed.
 	 */
-	if (unlikely(offset + cmnd->pdu.datasize > req->bufflen)) {
-		PRINT_WARNING("Skipping RX data digest check for residual "
-			"overflow command op %x (data size %d, buffer size %d)",
-			cmnd_hdr(req)->scb[0], offset + cmnd->pdu.datasize,
-			req->bufflen);
+	if (unlikely(*offset + cmnd->pdu.datasize > req->bufflen)) {
+		if (warn)
+			PRINT_WARNING("Skipping RX data digest check for "
+				"residual overflow command op %x (data size "
+				"%d, buffer size %d)", cmnd_hdr(req)->scb[0],
+				*offset + cmnd->pdu.datasize, req->bufflen);
+		goto out_skip;
+	}
+
+out:
+	return req;
+
+out_skip:
+	req = NULL;
+	goto out;
+}
+
+/*
+ * Called by the read thread before it starts receiving cmnd's data. If
+ * possible, arms calculation of the data digest on the fly, while the data
+ * are still cache hot, see digest_rx_data_update().
+ */
+void digest_rx_data_start(struct iscsi_cmnd *cmnd)
+{
+	u32 offset;
+
+	cmnd->rx_ddigest_crc = ~0;
+	cmnd->rx_ddigest_done = 0;
+	cmnd->rx_ddigest_otf =
+		(cmnd->conn->read_size == cmnd->pdu.datasize) &&
+		(digest_rx_data_req(cmnd, &offset, false) != NULL);
+
+	TRACE_DBG("cmnd %p, on the fly RX ddigest %d", cmnd,
+		cmnd->rx_ddigest_otf);
+	return;
+}
+
+/*
+ * Called by the read thread each time after some of cmnd's data received.
+ * Received is the total amount of received so far data.
+ */
+void digest_rx_data_update(struct iscsi_cmnd *cmnd, u32 received)
+{
+	struct iscsi_cmnd *req;
+	u32 offset;
+	ktime_t start;
+
+	if (received == cmnd->rx_ddigest_done)
+		goto out;
+
+	/* The command could be prelim completed in the meantime */
+	req = digest_rx_data_req(cmnd, &offset, false);
+	if (unlikely(req == NULL)) {
+		cmnd->rx_ddigest_otf = 0;
 		goto out;
 	}
 
-	crc = digest_data(req, cmnd->pdu.datasize, offset,
+	start = ktime_get();
+	cmnd->rx_ddigest_crc = crc32c_update_sg(cmnd->rx_ddigest_crc, req->sg,
+		offset + cmnd->rx_ddigest_done,
+		received - cmnd->rx_ddigest_done);
+	digest_account(&cmnd->conn->rx_digest_time_ns, start);
+
+	cmnd->rx_ddigest_done = received;
+
+out:
+	return;
+}
+
+int digest_rx_data(struct iscsi_cmnd *cmnd)
+{
+	struct iscsi_cmnd *req;
+	u32 offset;
+	__be32 crc;
+	ktime_t start;
+	int res = 0;
+
+	req = digest_rx_data_req(cmnd, &offset, true);
+	if (req == NULL)
+		goto out;
+
+	start = ktime_get();
+	if (cmnd->rx_ddigest_otf &&
+	    (cmnd->rx_ddigest_done == cmnd->pdu.datasize)) {
+		TRACE_DBG("Using on the fly RX data digest for cmd %p", cmnd);
+		crc = crc32c_finish(cmnd->rx_ddigest_crc, cmnd->pdu.datasize,
+			cmnd->conn->rpadding);
+	} else
+		crc = digest_data(req, cmnd->pdu.datasize, offset,
 			cmnd->conn->rpadding);
+	digest_account(&cmnd->conn->rx_digest_time_ns, start);
 
 	if (unlikely(crc != cmnd->ddigest)) {
 		TRACE(TRACE_MINOR|TRACE_MGMT_DEBUG, "%s", "RX data digest "
@@ -223,6 +341,7 @@ void digest_tx_data(struct iscsi_cmnd *cmnd)
 {
 	struct iscsi_data_in_hdr *hdr;
 	u32 offset;
+	ktime_t start;
 
 	TRACE_DBG("%s:%d req %p, own_sg %d, sg %p, sgcnt %d cmnd %p, "
 		"own_sg %d, sg %p, sgcnt %d", __func__, __LINE__,
@@ -239,7 +358,9 @@ void digest_tx_data(struct iscsi_cmnd *cmnd)
 		offset = 0;
 	}
 
+	start = ktime_get();
 	cmnd->ddigest = digest_data(cmnd, cmnd->pdu.datasize, offset, 0);
+	digest_account(&cmnd->conn->tx_digest_time_ns, start);
 	TRACE_DBG("TX data digest for cmd %p: %x (offset %d, opcode %x)", cmnd,
 		cmnd->ddigest, offset, cmnd_opcode(cmnd));
 }
@@ -25,6 +25,8 @@ extern int digest_init(struct iscsi_conn *conn);
 
 extern int digest_rx_header(struct iscsi_cmnd *cmnd);
 extern int digest_rx_data(struct iscsi_cmnd *cmnd);
+extern void digest_rx_data_start(struct iscsi_cmnd *cmnd);
+extern void digest_rx_data_update(struct iscsi_cmnd *cmnd, u32 received);
 
 extern void digest_tx_header(struct iscsi_cmnd *cmnd);
 extern void digest_tx_data(struct iscsi_cmnd *cmnd);
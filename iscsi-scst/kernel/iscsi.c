@@ -20,6 +20,7 @@
 #include <linux/kthread.h>
 #include <linux/scatterlist.h>
 #include <linux/ctype.h>
+#include <linux/ktime.h>
 #include <net/tcp.h>
 #include <scsi/scsi.h>
 #include <asm/byteorder.h>
@@ -46,6 +47,14 @@ static const char ctr_name[] = "iscsi-scst-ctl";
 unsigned long iscsi_trace_flag = ISCSI_DEFAULT_LOG_FLAGS;
 #endif
 
+/*
+ * If set, R2Ts are sent as soon as the command's buffer is allocated and
+ * the next R2T is sent as soon as the final Data-Out PDU header of the
+ * previous one is received, instead of after the command is ordered by
+ * CmdSN and the previous sequence's data are received.
+ */
+int iscsi_early_r2t;
+
 static struct kmem_cache *iscsi_cmnd_cache;
 
 static DEFINE_MUTEX(iscsi_threads_pool_mutex);
@@ -325,6 +334,7 @@ struct iscsi_cmnd *cmnd_alloc(struct iscsi_conn *conn,
 #endif
 		INIT_LIST_HEAD(&cmnd->rsp_cmd_list);
 		INIT_LIST_HEAD(&cmnd->rx_ddigest_cmd_list);
+		INIT_LIST_HEAD(&cmnd->itt_hash_list_entry);
 		cmnd->target_task_tag = ISCSI_RESERVED_TAG_CPU32;
 
 		spin_lock_bh(&conn->cmd_list_lock);
@@ -430,8 +440,13 @@ void cmnd_done(struct iscsi_cmnd *cmnd)
 
 		spin_lock_bh(&conn->cmd_list_lock);
 		list_del(&cmnd->cmd_list_entry);
+		list_del(&cmnd->itt_hash_list_entry);
 		spin_unlock_bh(&conn->cmd_list_lock);
 
+		/* For aborted commands some R2Ts may stay unanswered */
+		if (unlikely(cmnd->solicited_r2t != 0))
+			atomic_sub(cmnd->solicited_r2t, &conn->r2t_outstanding);
+
 		conn_put(conn);
 
 		EXTRACHECKS_BUG_ON(!list_empty(&cmnd->rx_ddigest_cmd_list));
@@ -792,7 +807,7 @@ static void iscsi_cmnds_init_write(struct list_head *send, int flags)
 	spin_unlock_bh(&conn->write_list_lock);
 
 	if (flags & ISCSI_INIT_WRITE_WAKE)
-		iscsi_make_conn_wr_active(conn);
+		conn->transport->iscsit_make_conn_wr_active(conn);
 
 	return;
 }
@@ -1255,17 +1270,41 @@ static void update_stat_sn(struct iscsi_cmnd *cmnd)
 	return;
 }
 
+/*
+ * Adds cmnd, which header was just received, to the conn's ITT hash, so
+ * it can be found by cmnd_find_itt_get().
+ */
+static void cmnd_itt_hash(struct iscsi_cmnd *cmnd)
+{
+	struct iscsi_conn *conn = cmnd->conn;
+	struct list_head *head;
+
+	head = &conn->cmnd_itt_hash[cmnd_hashfn((__force u32)cmnd->pdu.bhs.itt)];
+
+	spin_lock_bh(&conn->cmd_list_lock);
+	list_add_tail(&cmnd->itt_hash_list_entry, head);
+	spin_unlock_bh(&conn->cmd_list_lock);
+	return;
+}
+
 static struct iscsi_cmnd *cmnd_find_itt_get(struct iscsi_conn *conn, __be32 itt)
 {
 	struct iscsi_cmnd *cmnd, *found_cmnd = NULL;
+	struct list_head *head;
+	unsigned long depth = 0;
+
+	head = &conn->cmnd_itt_hash[cmnd_hashfn((__force u32)itt)];
 
 	spin_lock_bh(&conn->cmd_list_lock);
-	list_for_each_entry(cmnd, &conn->cmd_list, cmd_list_entry) {
+	list_for_each_entry(cmnd, head, itt_hash_list_entry) {
+		depth++;
 		if ((cmnd->pdu.bhs.itt == itt) && !cmnd_get_check(cmnd)) {
 			found_cmnd = cmnd;
 			break;
 		}
 	}
+	conn->itt_lookups++;
+	conn->itt_lookup_depth += depth;
 	spin_unlock_bh(&conn->cmd_list_lock);
 
 	return found_cmnd;
@@ -1600,10 +1639,12 @@ static int cmnd_prepare_recv_pdu(struct iscsi_conn *conn,
 
 static void send_r2t(struct iscsi_cmnd *req)
 {
-	struct iscsi_session *sess = req->conn->session;
+	struct iscsi_conn *conn = req->conn;
+	struct iscsi_session *sess = conn->session;
 	struct iscsi_cmnd *rsp;
 	struct iscsi_r2t_hdr *rsp_hdr;
 	u32 offset, burst;
+	unsigned int sent = 0, outstanding;
 	LIST_HEAD(send);
 
 	TRACE_ENTRY();
@@ -1659,10 +1700,19 @@ static void send_r2t(struct iscsi_cmnd *req)
 
 		list_add_tail(&rsp->write_list_entry, &send);
 		req->outstanding_r2t++;
+		sent++;
 
 	} while ((req->outstanding_r2t < sess->sess_params.max_outstanding_r2t) &&
 		 (req->r2t_len_to_send != 0));
 
+	if (req->r2t_start_ns == 0)
+		req->r2t_start_ns = ktime_to_ns(ktime_get());
+	req->solicited_r2t += sent;
+	conn->r2t_sent += sent;
+	outstanding = atomic_add_return(sent, &conn->r2t_outstanding);
+	if (outstanding > conn->max_r2t_outstanding)
+		conn->max_r2t_outstanding = outstanding;
+
 	iscsi_cmnds_init_write(&send, ISCSI_INIT_WRITE_WAKE);
 
 out:
@@ -1893,6 +1943,12 @@ int cmnd_rx_continue(struct iscsi_cmnd *req)
 			/* For performance better to send R2Ts ASAP */
 			if (likely(res == 0) && (req->r2t_len_to_send != 0))
 				send_r2t(req);
+		} else if (iscsi_early_r2t && (req->r2t_len_to_send != 0)) {
+			/*
+			 * The buffer is ready, so there's no need to wait
+			 * until the command is ordered by CmdSN.
+			 */
+			send_r2t(req);
 		}
 	} else {
 		req->sg = scst_cmd_get_sg(scst_cmd);
@@ -2124,12 +2180,27 @@ static int data_out_start(struct iscsi_cmnd *cmnd)
 #endif
 
 go:
-	if (req_hdr->flags & ISCSI_FLG_FINAL)
+	if (req_hdr->flags & ISCSI_FLG_FINAL) {
 		orig_req->outstanding_r2t--;
+		if ((req_hdr->ttt != ISCSI_RESERVED_TAG) &&
+		    (orig_req->solicited_r2t != 0)) {
+			orig_req->solicited_r2t--;
+			atomic_dec(&conn->r2t_outstanding);
+		}
+	}
 
 	EXTRACHECKS_BUG_ON(orig_req->data_out_in_data_receiving);
 	orig_req->data_out_in_data_receiving = 1;
 
+	/*
+	 * The R2T slot is free now, so, if requested, let the initiator have
+	 * the next R2T while the data of this PDU are still coming.
+	 */
+	if (iscsi_early_r2t && (req_hdr->flags & ISCSI_FLG_FINAL) &&
+	    (orig_req->prelim_compl_flags == 0) &&
+	    (orig_req->r2t_len_to_send != 0))
+		send_r2t(orig_req);
+
 	TRACE_WRITE("cmnd %p, orig_req %p, offset %u, datasize %u", cmnd,
 		orig_req, offset, cmnd->pdu.datasize);
 
@@ -2202,6 +2273,14 @@ static void data_out_end(struct iscsi_cmnd *cmnd)
 		goto out_put;
 
 	if (req->r2t_len_to_receive == 0) {
+		if (req->r2t_start_ns != 0) {
+			struct iscsi_conn *conn = cmnd->conn;
+
+			conn->data_out_wait_ns += ktime_to_ns(ktime_get()) -
+						  req->r2t_start_ns;
+			conn->data_out_waits++;
+			req->r2t_start_ns = 0;
+		}
 		if (!req->pending)
 			iscsi_restart_cmnd(req);
 	} else if (req->r2t_len_to_send != 0)
@@ -2792,19 +2871,6 @@ out:
 	return;
 }
 
-static void set_cork(struct socket *sock, int on)
-{
-	int opt = on;
-	mm_segment_t oldfs;
-
-	oldfs = get_fs();
-	set_fs(get_ds());
-	sock->ops->setsockopt(sock, SOL_TCP, TCP_CORK,
-			      (void __force __user *)&opt, sizeof(opt));
-	set_fs(oldfs);
-	return;
-}
-
 void cmnd_tx_start(struct iscsi_cmnd *cmnd)
 {
 	struct iscsi_conn *conn = cmnd->conn;
@@ -2814,8 +2880,6 @@ void cmnd_tx_start(struct iscsi_cmnd *cmnd)
 
 	iscsi_extracheck_is_wr_thread(conn);
 
-	set_cork(conn->sock, 1);
-
 	conn->write_iop = conn->write_iov;
 	conn->write_iop->iov_base = (void __force __user *)(&cmnd->pdu.bhs);
 	conn->write_iop->iov_len = sizeof(cmnd->pdu.bhs);
@@ -2918,7 +2982,6 @@ void cmnd_tx_end(struct iscsi_cmnd *cmnd)
 		}
 	}
 
-	set_cork(cmnd->conn->sock, 0);
 	return;
 }
 
@@ -3095,6 +3158,8 @@ int cmnd_rx_start(struct iscsi_cmnd *cmnd)
 
 	iscsi_dump_pdu(&cmnd->pdu);
 
+	cmnd_itt_hash(cmnd);
+
 	res = check_segment_length(cmnd);
 	if (res != 0)
 		goto out;
@@ -3197,7 +3262,7 @@ static void iscsi_preprocessing_done(struct scst_cmd *scst_cmd)
 		 * We wait for the state change without any protection, so
 		 * without cmnd_get() it is possible that req will die
 		 * "immediately" after the state assignment and
-		 * iscsi_make_conn_rd_active() will operate on dead data.
+		 * iscsit_make_conn_rd_active() will operate on dead data.
 		 * We use the ordered version of cmnd_get(), because "get"
 		 * must be done before the state assignment.
 		 *
@@ -3207,7 +3272,7 @@ static void iscsi_preprocessing_done(struct scst_cmd *scst_cmd)
 		 */
 		cmnd_get(req);
 		req->scst_state = ISCSI_CMD_STATE_AFTER_PREPROC;
-		iscsi_make_conn_rd_active(req->conn);
+		req->conn->transport->iscsit_make_conn_rd_active(req->conn);
 		if (unlikely(req->conn->closing)) {
 			TRACE_DBG("Waking up closing conn %p", req->conn);
 			wake_up(&req->conn->read_state_waitQ);
@@ -3250,7 +3315,7 @@ static void iscsi_try_local_processing(struct iscsi_cmnd *req)
 		int rc = 1;
 
 		do {
-			rc = iscsi_send(conn);
+			rc = conn->transport->iscsit_send(conn);
 			if (rc <= 0)
 				break;
 		} while (req->not_processed_rsp_cnt != 0);
@@ -3417,7 +3482,7 @@ out:
 out_push_to_wr_thread:
 	TRACE_DBG("Waking up write thread (conn %p)", conn);
 	req_cmnd_release(req);
-	iscsi_make_conn_wr_active(conn);
+	conn->transport->iscsit_make_conn_wr_active(conn);
 	goto out;
 }
 
@@ -4023,10 +4088,46 @@ out_free:
 	goto out_unlock;
 }
 
-void iscsi_threads_pool_put(struct iscsi_thread_pool *p)
+/* The pool must be already deleted from iscsi_thread_pools_list */
+static void iscsi_threads_pool_free(struct iscsi_thread_pool *p)
 {
 	struct iscsi_thread *t, *tt;
 
+	TRACE_DBG("Freeing iSCSI thread pool %p", p);
+
+	list_for_each_entry_safe(t, tt, &p->threads_list, threads_list_entry) {
+		kthread_stop(t->thr);
+		list_del(&t->threads_list_entry);
+		kfree(t);
+	}
+
+	kfree(p);
+	return;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
+static void iscsi_threads_pool_free_fn(void *ctx)
+#else
+static void iscsi_threads_pool_free_fn(struct work_struct *work)
+#endif
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
+	struct iscsi_thread_pool *p = ctx;
+#else
+	struct iscsi_thread_pool *p = container_of(work,
+		struct iscsi_thread_pool, thread_pool_free_work);
+#endif
+
+	TRACE_ENTRY();
+	iscsi_threads_pool_free(p);
+	TRACE_EXIT();
+	return;
+}
+
+void iscsi_threads_pool_put(struct iscsi_thread_pool *p)
+{
+	struct iscsi_thread *t;
+
 	TRACE_ENTRY();
 
 	mutex_lock(&iscsi_threads_pool_mutex);
@@ -4038,17 +4139,30 @@ void iscsi_threads_pool_put(struct iscsi_thread_pool *p)
 		goto out_unlock;
 	}
 
-	TRACE_DBG("Freeing iSCSI thread pool %p", p);
+	list_del(&p->thread_pools_list_entry);
 
-	list_for_each_entry_safe(t, tt, &p->threads_list, threads_list_entry) {
-		kthread_stop(t->thr);
-		list_del(&t->threads_list_entry);
-		kfree(t);
+	/*
+	 * A thread of the pool, e.g. the read thread closing a connection
+	 * directly, if the close thread couldn't be started, can't stop
+	 * itself, so then let a work to do the freeing.
+	 */
+	list_for_each_entry(t, &p->threads_list, threads_list_entry) {
+		if (t->thr == current) {
+			TRACE_MGMT_DBG("Deferring freeing of iSCSI thread "
+				"pool %p", p);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
+			INIT_WORK(&p->thread_pool_free_work,
+				iscsi_threads_pool_free_fn, p);
+#else
+			INIT_WORK(&p->thread_pool_free_work,
+				iscsi_threads_pool_free_fn);
+#endif
+			schedule_work(&p->thread_pool_free_work);
+			goto out_unlock;
+		}
 	}
 
-	list_del(&p->thread_pools_list_entry);
-
-	kfree(p);
+	iscsi_threads_pool_free(p);
 
 out_unlock:
 	mutex_unlock(&iscsi_threads_pool_mutex);
@@ -4168,6 +4282,9 @@ static void __exit iscsi_exit(void)
 {
 	iscsi_threads_pool_put(iscsi_main_thread_pool);
 
+	/* Wait for deferred freeing of thread pools */
+	flush_scheduled_work();
+
 	sBUG_ON(!list_empty(&iscsi_thread_pools_list));
 
 	unregister_chrdev(ctr_major, ctr_name);
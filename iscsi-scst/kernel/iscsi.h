@@ -88,6 +88,9 @@ struct iscsi_thread_pool {
 	struct list_head threads_list;
 
 	struct list_head thread_pools_list_entry;
+
+	/* Frees the pool, if its last reference put by one of its threads */
+	struct work_struct thread_pool_free_work;
 };
 
 
@@ -115,6 +118,14 @@ struct iscsi_target {
 
 	unsigned int tgt_enabled:1;
 
+	/*
+	 * Time, during which read threads busy poll for new data of this
+	 * target's connections before going to sleep, in us. 0 - disabled.
+	 */
+	unsigned int busy_poll_usecs;
+	atomic_long_t busy_poll_hits;
+	atomic_long_t busy_poll_misses;
+
 #ifndef CONFIG_SCST_PROC
 	/* Protected by target_mutex */
 	struct list_head attrs_list;
@@ -189,9 +200,42 @@ struct iscsi_session {
 #define ISCSI_CONN_WR_STATE_SPACE_WAIT		2
 #define ISCSI_CONN_WR_STATE_PROCESSING		3
 
+#define ISCSI_MAX_BUSY_POLL_USECS		10000
+
+/* Max number of PDUs sent in a row with the socket corked by iscsi_send() */
+#define ISCSI_DEF_TX_BATCH_SIZE			16
+#define ISCSI_MAX_TX_BATCH_SIZE			256
+
+struct iscsi_conn;
+
+/*
+ * Transport, which moves PDUs of iSCSI connections. iscsi.c reaches the
+ * connections' data path only through it.
+ */
+struct iscsit_transport {
+	const char *name;
+
+	/* Queues conn to be served by a read thread */
+	void (*iscsit_make_conn_rd_active)(struct iscsi_conn *conn);
+
+	/* Queues conn to be served by a write thread */
+	void (*iscsit_make_conn_wr_active)(struct iscsi_conn *conn);
+
+	/*
+	 * Sends queued PDUs of conn in the caller's context, which must own
+	 * conn's write state. Returns >0, if sending should be continued, 0,
+	 * if nothing left to send, or negative error code, e.g. -EAGAIN, if
+	 * the transport is out of send space.
+	 */
+	int (*iscsit_send)(struct iscsi_conn *conn);
+};
+
 struct iscsi_conn {
 	struct iscsi_session *session; /* owning session */
 
+	/* Read only */
+	const struct iscsit_transport *transport;
+
 	/* Both protected by session->sn_lock */
 	u32 stat_sn;
 	u32 exp_stat_sn;
@@ -205,6 +249,14 @@ struct iscsi_conn {
 	/* Protected by cmd_list_lock */
 	struct list_head cmd_list; /* in/outcoming pdus */
 
+	/*
+	 * All protected by cmd_list_lock. ITT hash of the commands from
+	 * cmd_list with already received headers and its lookups stats.
+	 */
+	struct list_head cmnd_itt_hash[1 << ISCSI_HASH_ORDER];
+	unsigned long itt_lookups;
+	unsigned long itt_lookup_depth;
+
 	atomic_t conn_ref_cnt;
 
 	spinlock_t write_list_lock;
@@ -241,6 +293,10 @@ struct iscsi_conn {
 	u32 write_size;
 	u32 write_offset;
 	int write_state;
+	int tx_corked;
+	/* TX batches stats, see iscsi_send() */
+	unsigned long tx_batches;
+	unsigned long tx_batch_pdus;
 
 	/* Both don't need any protection */
 	struct file *file;
@@ -254,6 +310,29 @@ struct iscsi_conn {
 	int hdigest_type;
 	int ddigest_type;
 
+	/*
+	 * I/O stats. Each updated only from the read or write thread
+	 * correspondingly, so no protection.
+	 */
+	u64 rx_bytes;
+	u64 rx_scsi_cmds;
+	u64 tx_bytes;
+
+	/*
+	 * R2T stats. All, except r2t_outstanding, updated only from the read
+	 * thread, so no protection.
+	 */
+	atomic_t r2t_outstanding;
+	unsigned int max_r2t_outstanding;
+	u64 r2t_sent;
+	/* Number and total time, in ns, of the solicited Data-Out waits */
+	u64 data_out_waits;
+	u64 data_out_wait_ns;
+
+	/* CPU time spent on digests calculation, in ns */
+	atomic_long_t rx_digest_time_ns;
+	atomic_long_t tx_digest_time_ns;
+
 	struct iscsi_thread_pool *conn_thr_pool;
 
 	/* All 6 protected by rd_lock */
@@ -299,6 +378,9 @@ struct iscsi_conn {
 	/* Doesn't need any protection */
 	u16 cid;
 
+	/* CPU, to which threads conn bound, or -1. Read only. */
+	int conn_cpu;
+
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20))
 	struct delayed_work nop_in_delayed_work;
 #else
@@ -377,6 +459,8 @@ struct iscsi_cmnd {
 	unsigned int force_cleanup_done:1;
 	unsigned int dec_active_cmds:1;
 	unsigned int ddigest_checked:1;
+	/* Set, if rx_ddigest_crc being calculated on the fly is valid */
+	unsigned int rx_ddigest_otf:1;
 	/*
 	 * Used to prevent release of original req while its related DATA OUT
 	 * cmd is receiving data, i.e. stays between data_out_start() and
@@ -489,11 +573,21 @@ struct iscsi_cmnd {
 	unsigned int r2t_len_to_receive;
 	unsigned int r2t_len_to_send;
 	unsigned int outstanding_r2t;
+	/* Sent R2Ts not yet answered by the final Data-Out PDU */
+	unsigned int solicited_r2t;
+	/* When the first R2T was sent, in ns, see data_out_end() */
+	s64 r2t_start_ns;
 	u32 target_task_tag;
 	__be32 hdigest;
 	__be32 ddigest;
 
+	/* Both accessed only from the read thread */
+	u32 rx_ddigest_crc;
+	u32 rx_ddigest_done;
+
 	struct list_head cmd_list_entry;
+	/* Entry in conn->cmnd_itt_hash, protected by conn->cmd_list_lock */
+	struct list_head itt_hash_list_entry;
 	struct list_head nop_req_list_entry;
 
 	unsigned int not_received_data_len;
@@ -518,6 +612,7 @@ extern int ctr_open_state;
 extern const struct file_operations ctr_fops;
 
 /* iscsi.c */
+extern int iscsi_early_r2t;
 extern struct iscsi_cmnd *cmnd_alloc(struct iscsi_conn *,
 	struct iscsi_cmnd *parent);
 extern int cmnd_rx_start(struct iscsi_cmnd *);
@@ -544,6 +639,7 @@ extern void iscsi_threads_pool_put(struct iscsi_thread_pool *p);
 #ifndef CONFIG_SCST_PROC
 extern struct kobj_type iscsi_conn_ktype;
 #endif
+extern int iscsi_conn_cpu_affinity;
 extern struct iscsi_conn *conn_lookup(struct iscsi_session *, u16);
 extern void conn_reinst_finished(struct iscsi_conn *);
 extern int __add_conn(struct iscsi_session *, struct iscsi_kern_conn_info *);
@@ -563,6 +659,8 @@ extern void iscsi_check_tm_data_wait_timeouts(struct iscsi_conn *conn,
 extern void __iscsi_write_space_ready(struct iscsi_conn *conn);
 
 /* nthread.c */
+extern const struct iscsit_transport iscsi_tcp_transport;
+extern int iscsi_tx_batch_size;
 extern int iscsi_send(struct iscsi_conn *conn);
 #if defined(CONFIG_TCP_ZERO_COPY_TRANSFER_COMPLETION_NOTIFICATION)
 extern void iscsi_get_page_callback(struct page *page);
@@ -16,11 +16,18 @@
  *  GNU General Public License for more details.
  */
 
+#include <linux/version.h>
 #include <linux/sched.h>
 #include <linux/file.h>
 #include <linux/kthread.h>
 #include <linux/delay.h>
+#include <linux/ktime.h>
+#include <net/tcp.h>
 #include <net/tcp_states.h>
+#if defined(CONFIG_NET_RX_BUSY_POLL) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
+#include <net/busy_poll.h>
+#endif
 
 #include "iscsi.h"
 #include "digest.h"
@@ -52,6 +59,11 @@ enum tx_state {
 	TX_END,
 };
 
+int iscsi_tx_batch_size = ISCSI_DEF_TX_BATCH_SIZE;
+
+/* Min data size of PDUs received by do_recv_direct() */
+#define ISCSI_RX_DIRECT_MIN_SIZE	PAGE_SIZE
+
 #if defined(CONFIG_TCP_ZERO_COPY_TRANSFER_COMPLETION_NOTIFICATION)
 static void iscsi_check_closewait(struct iscsi_conn *conn)
 {
@@ -733,6 +745,7 @@ restart:
 		 */
 		sBUG_ON((res >= first_len) &&
 			(conn->read_msg.msg_iov->iov_len != 0));
+		conn->rx_bytes += res;
 		conn->read_size -= res;
 		if (conn->read_size != 0) {
 			if (res >= first_len) {
@@ -768,6 +781,123 @@ out:
 	return res;
 }
 
+/*
+ * tcp_read_sock() actor copying received data from skb directly into the
+ * conn's read iovecs, i.e. into the pages of the command's data buffer.
+ * The data digest, if needed, is updated right after each skb copied,
+ * while the data are in the CPU cache.
+ */
+static int iscsi_tcp_recv_actor(read_descriptor_t *desc, struct sk_buff *skb,
+	unsigned int offset, size_t len)
+{
+	struct iscsi_conn *conn = desc->arg.data;
+	struct iscsi_cmnd *cmnd = conn->read_cmnd;
+	size_t copied = 0;
+
+	len = min_t(size_t, len, desc->count);
+
+	while (copied < len) {
+		struct iovec *iov = conn->read_msg.msg_iov;
+		size_t n = min_t(size_t, len - copied, iov->iov_len);
+
+		if (unlikely(n == 0)) {
+			/* Left by do_recv() */
+			sBUG_ON(conn->read_msg.msg_iovlen <= 1);
+			conn->read_msg.msg_iov++;
+			conn->read_msg.msg_iovlen--;
+			continue;
+		}
+
+		if (unlikely(skb_copy_bits(skb, offset + copied,
+				(void __force *)iov->iov_base, n) != 0)) {
+			desc->error = -EFAULT;
+			break;
+		}
+
+		iov->iov_base += n;
+		iov->iov_len -= n;
+		copied += n;
+		conn->read_size -= n;
+
+		if ((iov->iov_len == 0) && (conn->read_size != 0)) {
+			conn->read_msg.msg_iov++;
+			conn->read_msg.msg_iovlen--;
+		}
+	}
+
+	desc->count -= copied;
+
+	if (cmnd->rx_ddigest_otf)
+		digest_rx_data_update(cmnd,
+			cmnd->pdu.datasize - conn->read_size);
+
+	return copied;
+}
+
+/*
+ * Same as do_recv(), but receives data via tcp_read_sock() without the
+ * sock_recvmsg() and iovecs walking overhead. Used for big data PDUs.
+ */
+static int do_recv_direct(struct iscsi_conn *conn)
+{
+	struct sock *sk = conn->sock->sk;
+	read_descriptor_t desc;
+	int res;
+
+	EXTRACHECKS_BUG_ON(conn->read_cmnd == NULL);
+
+	if (unlikely(conn->closing)) {
+		res = -EIO;
+		goto out;
+	}
+
+	desc.arg.data = conn;
+	desc.count = conn->read_size;
+	desc.written = 0;
+	desc.error = 0;
+
+	lock_sock(sk);
+	res = tcp_read_sock(sk, &desc, iscsi_tcp_recv_actor);
+	release_sock(sk);
+
+	TRACE_DBG("read_size %d, res %d, error %d", conn->read_size, res,
+		desc.error);
+
+	if (unlikely(desc.error != 0)) {
+		if (!conn->closing) {
+			PRINT_ERROR("tcp_read_sock() failed: %d", desc.error);
+			mark_conn_closed(conn);
+		}
+		res = desc.error;
+		goto out;
+	}
+
+	if (res <= 0) {
+		/*
+		 * Nothing received. Let do_recv() find out if it's just
+		 * EAGAIN, the connection closed by the peer or an error.
+		 */
+		res = do_recv(conn);
+		goto out;
+	}
+
+	conn->rx_bytes += res;
+	res = conn->read_size;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static inline void iscsi_rx_start_data(struct iscsi_conn *conn,
+	struct iscsi_cmnd *cmnd)
+{
+	if ((conn->ddigest_type & DIGEST_NONE) == 0)
+		digest_rx_data_start(cmnd);
+	conn->read_state = RX_DATA;
+	return;
+}
+
 static int iscsi_rx_check_ddigest(struct iscsi_conn *conn)
 {
 	struct iscsi_cmnd *cmnd = conn->read_cmnd;
@@ -777,11 +907,14 @@ static int iscsi_rx_check_ddigest(struct iscsi_conn *conn)
 	if (res == 0) {
 		conn->read_state = RX_END;
 
-		if (cmnd->pdu.datasize <= 16*1024) {
+		if ((cmnd->pdu.datasize <= 16*1024) || cmnd->rx_ddigest_otf) {
 			/*
 			 * It's cache hot, so let's compute it inline. The
 			 * choice here about what will expose more latency:
 			 * possible cache misses or the digest calculation.
+			 * If the digest was calculated on the fly, only
+			 * the final comparison is left, so it's always
+			 * done inline.
 			 */
 			TRACE_DBG("cmnd %p, opcode %x: checking RX "
 				"ddigest inline", cmnd, cmnd_opcode(cmnd));
@@ -880,7 +1013,7 @@ static int process_read_io(struct iscsi_conn *conn, int *closed)
 				if (cmnd->pdu.datasize == 0)
 					conn->read_state = RX_END;
 				else
-					conn->read_state = RX_DATA;
+					iscsi_rx_start_data(conn, cmnd);
 			} else if (res > 0)
 				conn->read_state = RX_CMD_CONTINUE;
 			else
@@ -901,12 +1034,19 @@ static int process_read_io(struct iscsi_conn *conn, int *closed)
 				if (cmnd->pdu.datasize == 0)
 					conn->read_state = RX_END;
 				else
-					conn->read_state = RX_DATA;
+					iscsi_rx_start_data(conn, cmnd);
 			}
 			break;
 
 		case RX_DATA:
-			res = do_recv(conn);
+			if ((cmnd->pdu.datasize >= ISCSI_RX_DIRECT_MIN_SIZE) &&
+			    (conn->sock->sk->sk_protocol == IPPROTO_TCP))
+				res = do_recv_direct(conn);
+			else
+				res = do_recv(conn);
+			if ((res >= 0) && cmnd->rx_ddigest_otf)
+				digest_rx_data_update(cmnd,
+					cmnd->pdu.datasize - res);
 			if (res == 0) {
 				int psz = ((cmnd->pdu.datasize + 3) & -4) - cmnd->pdu.datasize;
 				if (psz != 0) {
@@ -931,6 +1071,9 @@ static int process_read_io(struct iscsi_conn *conn, int *closed)
 			conn->read_cmnd = NULL;
 			conn->read_state = RX_INIT_BHS;
 
+			if (cmnd_opcode(cmnd) == ISCSI_OP_SCSI_CMD)
+				conn->rx_scsi_cmds++;
+
 			cmnd_rx_end(cmnd);
 
 			EXTRACHECKS_BUG_ON(conn->read_size != 0);
@@ -1016,7 +1159,8 @@ out:
  * Called under rd_lock and BHs disabled, but will drop it inside,
  * then reacquire.
  */
-static void scst_do_job_rd(struct iscsi_thread_pool *p)
+static void scst_do_job_rd(struct iscsi_thread_pool *p,
+	struct iscsi_conn **poll_conn)
 	__acquires(&rd_lock)
 	__releases(&rd_lock)
 {
@@ -1060,8 +1204,16 @@ static void scst_do_job_rd(struct iscsi_thread_pool *p)
 		if ((rc == 0) || conn->rd_data_ready) {
 			list_add_tail(&conn->rd_list_entry, &p->rd_list);
 			conn->rd_state = ISCSI_CONN_RD_STATE_IN_LIST;
-		} else
+		} else {
 			conn->rd_state = ISCSI_CONN_RD_STATE_IDLE;
+			if ((conn->target->busy_poll_usecs != 0) &&
+			    !conn->closing) {
+				if (*poll_conn != NULL)
+					conn_put(*poll_conn);
+				conn_get(conn);
+				*poll_conn = conn;
+			}
+		}
 	}
 
 	TRACE_EXIT();
@@ -1075,9 +1227,50 @@ static inline int test_rd_list(struct iscsi_thread_pool *p)
 	return res;
 }
 
+/*
+ * Spins waiting for new data for this pool's connections during the busy
+ * poll time of conn's target, so those data are picked up without the read
+ * thread's wakeup. Where supported, the conn's socket's NIC queue is polled
+ * meanwhile directly, bypassing the interrupts.
+ */
+static void iscsi_rd_busy_poll(struct iscsi_thread_pool *p,
+	struct iscsi_conn *conn)
+{
+	struct iscsi_target *target = conn->target;
+	s64 end = ktime_to_ns(ktime_get()) +
+			(s64)target->busy_poll_usecs * NSEC_PER_USEC;
+
+	TRACE_ENTRY();
+
+	while (1) {
+#if defined(CONFIG_NET_RX_BUSY_POLL) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
+		struct sock *sk = conn->sock->sk;
+
+		if (sk_can_busy_loop(sk))
+			sk_busy_loop(sk, 1);
+#endif
+		if (!list_empty(&p->rd_list)) {
+			atomic_long_inc(&target->busy_poll_hits);
+			break;
+		}
+		if (unlikely(conn->closing || kthread_should_stop()) ||
+		    need_resched() ||
+		    (ktime_to_ns(ktime_get()) >= end)) {
+			atomic_long_inc(&target->busy_poll_misses);
+			break;
+		}
+		cpu_relax();
+	}
+
+	TRACE_EXIT();
+	return;
+}
+
 int istrd(void *arg)
 {
 	struct iscsi_thread_pool *p = arg;
+	struct iscsi_conn *poll_conn = NULL;
 	int rc;
 
 	TRACE_ENTRY();
@@ -1095,10 +1288,21 @@ int istrd(void *arg)
 
 	spin_lock_bh(&p->rd_lock);
 	while (!kthread_should_stop()) {
+		if (poll_conn != NULL) {
+			if (list_empty(&p->rd_list)) {
+				spin_unlock_bh(&p->rd_lock);
+				iscsi_rd_busy_poll(p, poll_conn);
+				spin_lock_bh(&p->rd_lock);
+			}
+			conn_put(poll_conn);
+			poll_conn = NULL;
+		}
 		wait_event_locked(p->rd_waitQ, test_rd_list(p), lock_bh,
 				  p->rd_lock);
-		scst_do_job_rd(p);
+		scst_do_job_rd(p, &poll_conn);
 	}
+	if (poll_conn != NULL)
+		conn_put(poll_conn);
 	spin_unlock_bh(&p->rd_lock);
 
 	/*
@@ -1685,14 +1889,21 @@ static int iscsi_do_send(struct iscsi_conn *conn, int state)
 	return res;
 }
 
-/*
- * No locks, conn is wr processing.
- *
- * IMPORTANT! Connection conn must be protected by additional conn_get()
- * upon entrance in this function, because otherwise it could be destroyed
- * inside as a result of cmnd release.
- */
-int iscsi_send(struct iscsi_conn *conn)
+static void set_cork(struct socket *sock, int on)
+{
+	int opt = on;
+	mm_segment_t oldfs;
+
+	oldfs = get_fs();
+	set_fs(get_ds());
+	sock->ops->setsockopt(sock, SOL_TCP, TCP_CORK,
+			      (void __force __user *)&opt, sizeof(opt));
+	set_fs(oldfs);
+	return;
+}
+
+/* No locks, conn is wr processing */
+static int __iscsi_send(struct iscsi_conn *conn)
 {
 	struct iscsi_cmnd *cmnd = conn->write_cmnd;
 	int ddigest, res = 0;
@@ -1711,6 +1922,10 @@ int iscsi_send(struct iscsi_conn *conn)
 		cmnd = conn->write_cmnd = iscsi_get_send_cmnd(conn);
 		if (!cmnd)
 			goto out;
+		if (!conn->tx_corked) {
+			set_cork(conn->sock, 1);
+			conn->tx_corked = 1;
+		}
 		cmnd_tx_start(cmnd);
 		if (!(conn->hdigest_type & DIGEST_NONE))
 			init_tx_hdigest(cmnd);
@@ -1763,12 +1978,59 @@ int iscsi_send(struct iscsi_conn *conn)
 
 	conn->write_cmnd = NULL;
 	conn->write_state = TX_INIT;
+	conn->tx_batch_pdus++;
 
 out:
 	TRACE_EXIT_RES(res);
 	return res;
 }
 
+/*
+ * No locks, conn is wr processing.
+ *
+ * Sends up to iscsi_tx_batch_size PDUs in a row with the socket corked, so
+ * BHSs, data and statuses of them are coalesced in as few TCP segments as
+ * possible. The socket is uncorked, i.e. the batch is pushed, as soon as
+ * there is no partially sent PDU left.
+ *
+ * IMPORTANT! Connection conn must be protected by additional conn_get()
+ * upon entrance in this function, because otherwise it could be destroyed
+ * inside as a result of cmnd release.
+ */
+int iscsi_send(struct iscsi_conn *conn)
+{
+	int res, pdus = 0;
+
+	TRACE_ENTRY();
+
+	while (1) {
+		res = __iscsi_send(conn);
+		if (res <= 0)
+			break;
+		conn->tx_bytes += res;
+		if ((conn->write_cmnd == NULL) &&
+		    (++pdus >= iscsi_tx_batch_size))
+			break;
+	}
+
+	if (conn->tx_corked && (conn->write_cmnd == NULL)) {
+		set_cork(conn->sock, 0);
+		conn->tx_corked = 0;
+		conn->tx_batches++;
+	}
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* iSCSI over TCP, the only transport at the moment */
+const struct iscsit_transport iscsi_tcp_transport = {
+	.name = "tcp",
+	.iscsit_make_conn_rd_active = iscsi_make_conn_rd_active,
+	.iscsit_make_conn_wr_active = iscsi_make_conn_wr_active,
+	.iscsit_send = iscsi_send,
+};
+
 /*
  * Called under wr_lock and BHs disabled, but will drop it inside,
  * then reacquire.
@@ -475,8 +475,134 @@ out:
 static struct kobj_attribute iscsi_tgt_attr_tid =
 	__ATTR(tid, S_IRUGO, iscsi_tgt_tid_show, NULL);
 
+static ssize_t iscsi_tgt_busy_poll_usecs_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int res = -E_TGT_PRIV_NOT_YET_SET;
+	struct scst_tgt *scst_tgt;
+	struct iscsi_target *tgt;
+
+	TRACE_ENTRY();
+
+	scst_tgt = container_of(kobj, struct scst_tgt, tgt_kobj);
+	tgt = scst_tgt_get_tgt_priv(scst_tgt);
+	if (!tgt)
+		goto out;
+
+	res = sprintf(buf, "%u\n%s\n", tgt->busy_poll_usecs,
+		(tgt->busy_poll_usecs == 0) ? "" : SCST_SYSFS_KEY_MARK);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static ssize_t iscsi_tgt_busy_poll_usecs_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	unsigned long val;
+	struct scst_tgt *scst_tgt;
+	struct iscsi_target *tgt;
+
+	TRACE_ENTRY();
+
+	scst_tgt = container_of(kobj, struct scst_tgt, tgt_kobj);
+	tgt = scst_tgt_get_tgt_priv(scst_tgt);
+	if (!tgt) {
+		res = -E_TGT_PRIV_NOT_YET_SET;
+		goto out;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+	res = kstrtoul(buf, 0, &val);
+#else
+	res = strict_strtoul(buf, 0, &val);
+#endif
+	if (res != 0) {
+		PRINT_ERROR("strict_strtoul() for %s failed: %d ", buf, res);
+		goto out;
+	}
+
+	if (val > ISCSI_MAX_BUSY_POLL_USECS) {
+		PRINT_ERROR("Illegal busy poll time %lu us (allowed 0 - %d)",
+			val, ISCSI_MAX_BUSY_POLL_USECS);
+		res = -EINVAL;
+		goto out;
+	}
+
+	tgt->busy_poll_usecs = val;
+	PRINT_INFO("Busy poll time for target %s set to %u us", tgt->name,
+		tgt->busy_poll_usecs);
+
+	res = count;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute iscsi_tgt_attr_busy_poll_usecs =
+	__ATTR(busy_poll_usecs, S_IRUGO | S_IWUSR,
+		iscsi_tgt_busy_poll_usecs_show,
+		iscsi_tgt_busy_poll_usecs_store);
+
+static ssize_t iscsi_tgt_busy_poll_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int res = -E_TGT_PRIV_NOT_YET_SET;
+	struct scst_tgt *scst_tgt;
+	struct iscsi_target *tgt;
+
+	TRACE_ENTRY();
+
+	scst_tgt = container_of(kobj, struct scst_tgt, tgt_kobj);
+	tgt = scst_tgt_get_tgt_priv(scst_tgt);
+	if (!tgt)
+		goto out;
+
+	res = sprintf(buf, "Hits %lu\nMisses %lu\n",
+		(unsigned long)atomic_long_read(&tgt->busy_poll_hits),
+		(unsigned long)atomic_long_read(&tgt->busy_poll_misses));
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static ssize_t iscsi_tgt_busy_poll_stats_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res = count;
+	struct scst_tgt *scst_tgt;
+	struct iscsi_target *tgt;
+
+	TRACE_ENTRY();
+
+	scst_tgt = container_of(kobj, struct scst_tgt, tgt_kobj);
+	tgt = scst_tgt_get_tgt_priv(scst_tgt);
+	if (!tgt) {
+		res = -E_TGT_PRIV_NOT_YET_SET;
+		goto out;
+	}
+
+	atomic_long_set(&tgt->busy_poll_hits, 0);
+	atomic_long_set(&tgt->busy_poll_misses, 0);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute iscsi_tgt_attr_busy_poll_stats =
+	__ATTR(busy_poll_stats, S_IRUGO | S_IWUSR,
+		iscsi_tgt_busy_poll_stats_show,
+		iscsi_tgt_busy_poll_stats_store);
+
 const struct attribute *iscsi_tgt_attrs[] = {
 	&iscsi_tgt_attr_tid.attr,
+	&iscsi_tgt_attr_busy_poll_usecs.attr,
+	&iscsi_tgt_attr_busy_poll_stats.attr,
 	NULL,
 };
 
@@ -87,6 +87,10 @@ typedef _Bool bool;
 #define nr_cpu_ids NR_CPUS
 #endif
 
+#ifndef NUMA_NO_NODE
+#define NUMA_NO_NODE	(-1)
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 28)
 #define cpumask_bits(maskp) ((maskp)->bits)
 #ifdef CONFIG_CPUMASK_OFFSTACK
@@ -1317,6 +1321,20 @@ struct scst_dev_type {
 	 */
 	bool (*on_sg_tablesize_low) (struct scst_cmd *cmd);
 
+	/*
+	 * Called by the EXTENDED COPY engine to check if the designation
+	 * descriptor desc (in the Device Identification VPD page format,
+	 * i.e. 4 bytes header followed by desc[3] bytes of designator) from
+	 * an Identification CSCD descriptor identifies this device. Should
+	 * return true, if it does.
+	 *
+	 * Called in the thread context without any locks held.
+	 *
+	 * OPTIONAL, devices without it can't be sources or destinations
+	 * of EXTENDED COPY.
+	 */
+	bool (*copy_id_match) (struct scst_device *dev, const uint8_t *desc);
+
 	/*
 	 * Called when new device is attaching to the dev handler
 	 * Returns 0 on success, error code otherwise.
@@ -1543,6 +1561,13 @@ struct scst_tgt {
 
 	uint16_t rel_tgt_id;
 
+	/*
+	 * NUMA node, from which data buffers for commands of new sessions
+	 * are allocated, or NUMA_NO_NODE. Target drivers can set it, e.g.,
+	 * to the node of their HBA, after the target is registered.
+	 */
+	int tgt_numa_node;
+
 #ifdef CONFIG_SCST_PROC
 	/* Name of the default security group ("Default_target_name") */
 	char *default_group_name;
@@ -1634,6 +1659,22 @@ struct scst_session {
 #define	SESS_TGT_DEV_LIST_HASH_FN(val) ((val) & (SESS_TGT_DEV_LIST_HASH_SIZE - 1))
 	struct list_head sess_tgt_dev_list[SESS_TGT_DEV_LIST_HASH_SIZE];
 
+	/*
+	 * Direct LUN to tgt_dev map for LUNs below SESS_TGT_DEV_LUN_MAP_SIZE,
+	 * so the per command translation of them is a single indexed load.
+	 * Other LUNs are looked up in sess_tgt_dev_list. Protected the same
+	 * way as sess_tgt_dev_list.
+	 */
+#define	SESS_TGT_DEV_LUN_MAP_SIZE 512
+	struct scst_tgt_dev **sess_tgt_dev_lun_map;
+
+	/*
+	 * Number of LUN translations, which had to go to sess_tgt_dev_list,
+	 * and number of its entries walked by them.
+	 */
+	atomic_long_t tgt_dev_hash_lookups;
+	atomic_long_t tgt_dev_hash_lookup_steps;
+
 	/*
 	 * List of cmds in this session. Protected by sess_list_lock.
 	 *
@@ -1643,6 +1684,18 @@ struct scst_session {
 	 */
 	struct list_head sess_cmd_list;
 
+	/*
+	 * Hash of cmds in this session by their tags to speed up
+	 * scst_find_cmd_by_tag() and ABORT TASK. It isn't hlist, because
+	 * the search needs the cmds in the order of arrival. Internal cmds
+	 * are not added there. Protected by sess_list_lock.
+	 */
+#define	SESS_CMD_TAG_HASH_SIZE (1 << 8)
+#define	SESS_CMD_TAG_HASH_FN(tag) \
+	(((unsigned int)(tag) ^ (unsigned int)((tag) >> 32)) & \
+	 (SESS_CMD_TAG_HASH_SIZE - 1))
+	struct list_head sess_cmd_tag_hash[SESS_CMD_TAG_HASH_SIZE];
+
 	spinlock_t sess_list_lock; /* protects sess_cmd_list, etc */
 
 	atomic_t refcnt;		/* get/put counter */
@@ -1769,6 +1822,7 @@ struct scst_pr_abort_all_pending_mgmt_cmds_counter {
 struct scst_cmd_threads {
 	spinlock_t cmd_list_lock;
 	struct list_head active_cmd_list; /* commands queue */
+	int active_cmd_cnt; /* commands on active_cmd_list */
 	wait_queue_head_t cmd_list_waitQ;
 
 	struct io_context *io_context; /* IO context of the threads pool */
@@ -1782,6 +1836,12 @@ struct scst_cmd_threads {
 	int nr_threads; /* number of processing threads */
 	struct list_head threads_list; /* processing threads */
 
+	/*
+	 * NUMA node, to which CPUs new threads of this pool are bound, or
+	 * NUMA_NO_NODE. Protected by scst_mutex.
+	 */
+	int numa_node;
+
 	struct list_head lists_list_entry;
 };
 
@@ -1869,6 +1929,12 @@ struct scst_cmd {
 	/* Set if cmd is internally generated */
 	unsigned int internal:1;
 
+	/*
+	 * Set if internal cmd is sent to another device than its original
+	 * cmd, so it is subject to that device's blocking.
+	 */
+	unsigned int internal_other_dev:1;
+
 	/* Set if the device was blocked by scst_check_blocked_dev() */
 	unsigned int unblock_dev:1;
 
@@ -2002,9 +2068,14 @@ struct scst_cmd {
 	/* List entry for sess's sess_cmd_list */
 	struct list_head sess_cmd_list_entry;
 
+	/* List entry for sess's sess_cmd_tag_hash */
+	struct list_head sess_cmd_tag_hash_entry;
+
 	/*
 	 * Used to found the cmd by scst_find_cmd_by_tag(). Set by the
-	 * target driver on the cmd's initialization time
+	 * target driver on the cmd's initialization time and must not be
+	 * changed after scst_cmd_init_done(), because used as the key in
+	 * sess->sess_cmd_tag_hash.
 	 */
 	uint64_t tag;
 
@@ -2398,6 +2469,18 @@ struct scst_device {
 	/* Memory limits for this device */
 	struct scst_mem_lim dev_mem_lim;
 
+	/*
+	 * EXTENDED COPY statistics, protected by dev_lock. Commands, bytes
+	 * and time (in ms) are accounted for the device, which received
+	 * EXTENDED COPY, read and written bytes - for the copy source and
+	 * destination devices correspondingly.
+	 */
+	uint64_t xcopy_cmds;
+	uint64_t xcopy_bytes;
+	uint64_t xcopy_time_ms;
+	uint64_t xcopy_read_bytes;
+	uint64_t xcopy_written_bytes;
+
 	/*************************************************************
 	 ** Persistent reservation fields. Protected by dev_pr_mutex.
 	 *************************************************************/
@@ -2469,6 +2552,12 @@ struct scst_device {
 	/* Threads pool type of the device. Valid only if threads_num > 0. */
 	enum scst_dev_type_threads_pool_type threads_pool_type;
 
+	/*
+	 * NUMA node, to which CPUs threads of the device's threads pools are
+	 * bound, or NUMA_NO_NODE. Protected by scst_mutex.
+	 */
+	int dev_numa_node;
+
 #ifndef CONFIG_SCST_PROC
 	/* sysfs release completion */
 	struct completion *dev_kobj_release_cmpl;
@@ -2558,6 +2647,16 @@ struct scst_tgt_dev {
 	/* Set if INQUIRY DATA HAS CHANGED UA is needed */
 	unsigned int inq_changed_ua_needed:1;
 
+	/*
+	 * Results of the last finished EXTENDED COPY for RECEIVE COPY
+	 * RESULTS. All protected by tgt_dev_lock.
+	 */
+	unsigned int xcopy_last_valid:1;
+	uint8_t xcopy_last_list_id;
+	uint8_t xcopy_last_status;
+	uint16_t xcopy_last_segs_done;
+	uint64_t xcopy_last_bytes;
+
 	/*
 	 * Stored Unit Attention sense and its length for possible
 	 * subsequent REQUEST SENSE. Both protected by tgt_dev_lock.
@@ -4382,6 +4481,7 @@ struct scst_sysfs_work_item {
 			struct scst_device *dev;
 			int new_threads_num;
 			enum scst_dev_type_threads_pool_type new_threads_pool_type;
+			int new_numa_node;
 		};
 		struct scst_session *sess;
 		struct {
@@ -4424,5 +4524,16 @@ struct scst_data_descriptor {
 };
 
 void scst_write_same(struct scst_cmd *cmd);
+void scst_ext_copy(struct scst_cmd *cmd);
+void scst_receive_copy_results(struct scst_cmd *cmd);
+
+/*
+ * Max size of each, compare and write, parts of COMPARE AND WRITE supported
+ * by scst_cmp_wr()
+ */
+#define SCST_MAX_CMP_WR_SIZE		(128*1024)
+
+typedef void (*scst_cmp_wr_done_fn_t)(struct scst_cmd *cmd);
+void scst_cmp_wr(struct scst_cmd *cmd, scst_cmp_wr_done_fn_t done);
 
 #endif /* __SCST_H */
@@ -290,6 +290,11 @@ static inline int scst_sense_response_code(const uint8_t *sense)
 #define scst_sense_saving_params_unsup		ILLEGAL_REQUEST, 0x39, 0
 #define scst_sense_invalid_message		ILLEGAL_REQUEST, 0x49, 0
 #define scst_sense_parameter_list_length_invalid ILLEGAL_REQUEST, 0x1A, 0
+#define scst_sense_too_many_tgt_descr		ILLEGAL_REQUEST, 0x26, 6
+#define scst_sense_unsupported_tgt_descr_type	ILLEGAL_REQUEST, 0x26, 7
+#define scst_sense_too_many_seg_descr		ILLEGAL_REQUEST, 0x26, 8
+#define scst_sense_unsupported_seg_descr_type	ILLEGAL_REQUEST, 0x26, 9
+#define scst_sense_copy_tgt_not_reachable	COPY_ABORTED,    0x0D, 2
 #define scst_sense_data_protect			DATA_PROTECT,    0x00, 0
 #define scst_sense_miscompare_error		MISCOMPARE,      0x1D, 0
 #define scst_sense_write_error			MEDIUM_ERROR,    0x03, 0
@@ -379,6 +384,10 @@ static inline int scst_sense_response_code(const uint8_t *sense)
 #define WRITE_SAME_16	      0x93
 #endif
 
+#ifndef COMPARE_AND_WRITE
+#define COMPARE_AND_WRITE     0x89
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 33)
 /*
  * From <scsi/scsi.h>. See also commit
@@ -302,6 +302,43 @@ union scst_user_prealloc_buffer {
 	struct scst_user_prealloc_buffer_out out;
 };
 
+struct scst_user_get_multi {
+	aligned_u64 preplies;	/* in, array of struct scst_user_reply_cmd */
+	int16_t replies_cnt;	/* in */
+	int16_t replies_done;	/* out */
+	int16_t cmds_cnt;	/* in, max commands to get, out, got commands */
+	int16_t pad;
+	struct scst_user_get_cmd cmds[0]; /* out */
+};
+
+/* Be careful adding new members here, this structure is allocated on stack! */
+struct scst_user_ring_desc {
+	uint32_t entries;
+	uint32_t ring_size;
+};
+
+#define SCST_USER_MAX_RING_ENTRIES	4096
+
+/*
+ * Header of the shared commands and replies rings, mmap()'ed at offset 0
+ * of the device file. Each ring is indexed by free running head and tail
+ * counters, taken modulo entries.
+ */
+struct scst_user_ring_hdr {
+	/* Commands ring: struct scst_user_get_cmd entries at cmd_offs */
+	uint32_t cmd_head;	/* written by user space */
+	uint32_t cmd_tail;	/* written by SCST */
+
+	/* Replies ring: struct scst_user_reply_cmd entries at reply_offs */
+	uint32_t reply_head;	/* written by SCST */
+	uint32_t reply_tail;	/* written by user space */
+
+	/* All read only */
+	uint32_t entries;
+	uint32_t cmd_offs;
+	uint32_t reply_offs;
+};
+
 #define SCST_USER_REGISTER_DEVICE	_IOW('u', 1, struct scst_user_dev_desc)
 #define SCST_USER_UNREGISTER_DEVICE	_IO('u', 2)
 #define SCST_USER_SET_OPTIONS		_IOW('u', 3, struct scst_user_opt)
@@ -312,6 +349,9 @@ union scst_user_prealloc_buffer {
 #define SCST_USER_DEVICE_CAPACITY_CHANGED _IO('u', 8)
 #define SCST_USER_GET_EXTENDED_CDB	_IOWR('u', 9, struct scst_user_get_ext_cdb)
 #define SCST_USER_PREALLOC_BUFFER	_IOWR('u', 10, union scst_user_prealloc_buffer)
+#define SCST_USER_SETUP_RING		_IOWR('u', 11, struct scst_user_ring_desc)
+#define SCST_USER_RING_KICK		_IO('u', 12)
+#define SCST_USER_REPLY_AND_GET_MULTI	_IOWR('u', 13, struct scst_user_get_multi)
 
 /* Values for scst_user_get_cmd.subcode */
 #define SCST_USER_ATTACH_SESS		\
@@ -23,6 +23,8 @@
 #include <linux/poll.h>
 #include <linux/stddef.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 
 #define LOG_PREFIX		DEV_USER_NAME
 
@@ -47,6 +49,26 @@
 #define DEV_USER_CMD_HASH_ORDER		6
 #define DEV_USER_ATTACH_TIMEOUT		(5*HZ)
 
+/* Shared with user space commands and replies rings */
+struct scst_user_ring {
+	/* vmalloc_user()'ed, hdr is at its start */
+	struct scst_user_ring_hdr *hdr;
+	struct scst_user_get_cmd *cmds;
+	struct scst_user_reply_cmd *replies;
+	unsigned int entries;
+	unsigned int size;
+
+	/*
+	 * Private copies of the indexes owned by SCST, because the shared
+	 * ones can be overwritten by user space at any time.
+	 */
+	struct mutex reply_mutex;
+	uint32_t reply_head;	/* protected by reply_mutex */
+
+	struct mutex cmd_mutex;
+	uint32_t cmd_tail;	/* protected by cmd_mutex */
+};
+
 struct scst_user_dev {
 	struct rw_semaphore dev_rwsem;
 
@@ -91,6 +113,9 @@ struct scst_user_dev {
 
 	struct scst_device *sdev;
 
+	/* Set once by SCST_USER_SETUP_RING, then read only */
+	struct scst_user_ring *ring;
+
 	int virt_id;
 	struct list_head dev_list_entry;
 	char name[SCST_MAX_NAME];
@@ -179,8 +204,12 @@ static int __dev_user_set_opt(struct scst_user_dev *dev,
 	const struct scst_user_opt *opt);
 static int dev_user_set_opt(struct file *file, const struct scst_user_opt *opt);
 static int dev_user_get_opt(struct file *file, void __user *arg);
+static int dev_user_reply_get_multi(struct file *file, void __user *arg);
+static int dev_user_setup_ring(struct file *file, void __user *arg);
+static int dev_user_ring_kick(struct file *file);
 
 static unsigned int dev_user_poll(struct file *filp, poll_table *wait);
+static int dev_user_mmap(struct file *file, struct vm_area_struct *vma);
 static long dev_user_ioctl(struct file *file, unsigned int cmd,
 	unsigned long arg);
 static int dev_user_release(struct inode *inode, struct file *file);
@@ -217,6 +246,7 @@ static DEFINE_MUTEX(dev_priv_mutex);
 
 static const struct file_operations dev_user_fops = {
 	.poll		= dev_user_poll,
+	.mmap		= dev_user_mmap,
 	.unlocked_ioctl	= dev_user_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl	= dev_user_ioctl,
@@ -1831,6 +1861,7 @@ static int dev_user_process_scst_commands(struct scst_user_dev *dev)
 			cmd_list_entry);
 		TRACE_DBG("Deleting cmd %p from active cmd list", cmd);
 		list_del(&cmd->cmd_list_entry);
+		dev->udev_cmd_threads.active_cmd_cnt--;
 		spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
 		scst_process_active_cmd(cmd, false);
 		spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
@@ -2060,6 +2091,436 @@ out_free:
 	goto out_up;
 }
 
+static int dev_user_reply_get_multi(struct file *file, void __user *arg)
+{
+	int res = 0, rc;
+	struct scst_user_dev *dev;
+	struct scst_user_get_multi __user *multi = arg;
+	struct scst_user_reply_cmd *reply;
+	struct scst_user_cmd *ucmd;
+	uint64_t preplies;
+	int16_t replies_cnt, cmds_cnt;
+	int i;
+
+	TRACE_ENTRY();
+
+	mutex_lock(&dev_priv_mutex);
+	dev = file->private_data;
+	res = dev_user_check_reg(dev);
+	if (unlikely(res != 0)) {
+		mutex_unlock(&dev_priv_mutex);
+		goto out;
+	}
+	down_read(&dev->dev_rwsem);
+	mutex_unlock(&dev_priv_mutex);
+
+	/* get_user() can't be used with 64-bit values on x86_32 */
+	rc = copy_from_user(&preplies, &multi->preplies, sizeof(preplies));
+	rc |= get_user(replies_cnt, &multi->replies_cnt);
+	rc |= get_user(cmds_cnt, &multi->cmds_cnt);
+	if (unlikely(rc != 0)) {
+		PRINT_ERROR("%s", "Unable to get multi arguments");
+		res = -EFAULT;
+		goto out_up;
+	}
+
+	TRACE_DBG("preplies %lld, replies_cnt %d, cmds_cnt %d (dev %s)",
+		(long long unsigned int)preplies, replies_cnt, cmds_cnt,
+		dev->name);
+
+	if (unlikely((replies_cnt < 0) || (cmds_cnt < 0))) {
+		PRINT_ERROR("Wrong replies_cnt %d or cmds_cnt %d", replies_cnt,
+			cmds_cnt);
+		res = -EINVAL;
+		goto out_up;
+	}
+
+	i = 0;
+	if (replies_cnt > 0) {
+		reply = kmem_cache_alloc(user_get_cmd_cachep, GFP_KERNEL);
+		if (unlikely(reply == NULL)) {
+			res = -ENOMEM;
+			goto out_put_done;
+		}
+
+		for (i = 0; i < replies_cnt; i++) {
+			unsigned long u = (unsigned long)preplies +
+						i * sizeof(*reply);
+
+			rc = copy_from_user(reply, (void __user *)u,
+					sizeof(*reply));
+			if (unlikely(rc != 0)) {
+				PRINT_ERROR("Failed to copy %d user's bytes",
+					rc);
+				res = -EFAULT;
+				break;
+			}
+
+			TRACE_BUFFER("Reply", reply, sizeof(*reply));
+
+			res = dev_user_process_reply(dev, reply);
+			if (unlikely(res < 0))
+				break;
+		}
+
+		kmem_cache_free(user_get_cmd_cachep, reply);
+	}
+
+out_put_done:
+	rc = put_user(i, &multi->replies_done);
+	if (unlikely(rc != 0))
+		res = -EFAULT;
+	if (unlikely(res < 0))
+		goto out_up;
+
+	i = 0;
+	spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+	while (i < cmds_cnt) {
+		int len;
+
+		if (i == 0) {
+			res = dev_user_get_next_cmd(dev, &ucmd);
+			if (res != 0)
+				break;
+		} else {
+			/* Don't wait for more commands */
+			dev_user_process_scst_commands(dev);
+			ucmd = __dev_user_get_next_cmd(&dev->ready_cmd_list);
+			if (ucmd == NULL)
+				break;
+		}
+
+		/* See the comment in dev_user_reply_get_cmd() */
+		if (unlikely(ucmd_get_check(ucmd)))
+			continue;
+		spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+
+		EXTRACHECKS_BUG_ON(ucmd->user_cmd_payload_len == 0);
+
+		len = ucmd->user_cmd_payload_len;
+		TRACE_BUFFER("UCMD", &ucmd->user_cmd, len);
+		rc = copy_to_user(&multi->cmds[i], &ucmd->user_cmd, len);
+		if (unlikely(rc != 0)) {
+			PRINT_ERROR("Copy to user failed (%d), requeuing ucmd "
+				"%p back to head of ready cmd list", rc, ucmd);
+			if (i == 0)
+				res = -EFAULT;
+			/* Requeue ucmd back */
+			spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+			list_add(&ucmd->ready_cmd_list_entry,
+				&dev->ready_cmd_list);
+			spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+			ucmd_put(ucmd);
+			goto out_put_cnt;
+		}
+#ifdef CONFIG_SCST_EXTRACHECKS
+		ucmd->user_cmd_payload_len = 0;
+#endif
+		ucmd_put(ucmd);
+		i++;
+
+		spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+	}
+	spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+
+	if (i != 0)
+		res = 0;
+
+out_put_cnt:
+	rc = put_user(i, &multi->cmds_cnt);
+	if (unlikely(rc != 0))
+		res = -EFAULT;
+
+out_up:
+	up_read(&dev->dev_rwsem);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static int dev_user_setup_ring(struct file *file, void __user *arg)
+{
+	int res, rc;
+	struct scst_user_dev *dev;
+	struct scst_user_ring_desc desc;
+	struct scst_user_ring *ring;
+	unsigned int cmd_offs, reply_offs, size;
+
+	TRACE_ENTRY();
+
+	mutex_lock(&dev_priv_mutex);
+	dev = file->private_data;
+	res = dev_user_check_reg(dev);
+	if (unlikely(res != 0)) {
+		mutex_unlock(&dev_priv_mutex);
+		goto out;
+	}
+	down_read(&dev->dev_rwsem);
+	mutex_unlock(&dev_priv_mutex);
+
+	rc = copy_from_user(&desc, arg, sizeof(desc));
+	if (unlikely(rc != 0)) {
+		PRINT_ERROR("Failed to copy %d user's bytes", rc);
+		res = -EFAULT;
+		goto out_up;
+	}
+
+	if ((desc.entries == 0) ||
+	    (desc.entries > SCST_USER_MAX_RING_ENTRIES) ||
+	    ((desc.entries & (desc.entries - 1)) != 0)) {
+		PRINT_ERROR("Wrong ring entries %u (must be power of 2 "
+			"<= %d)", desc.entries, SCST_USER_MAX_RING_ENTRIES);
+		res = -EINVAL;
+		goto out_up;
+	}
+
+	cmd_offs = L1_CACHE_ALIGN(sizeof(struct scst_user_ring_hdr));
+	reply_offs = L1_CACHE_ALIGN(cmd_offs +
+			desc.entries * sizeof(struct scst_user_get_cmd));
+	size = PAGE_ALIGN(reply_offs +
+			desc.entries * sizeof(struct scst_user_reply_cmd));
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (ring == NULL) {
+		res = -ENOMEM;
+		goto out_up;
+	}
+
+	ring->hdr = vmalloc_user(size);
+	if (ring->hdr == NULL) {
+		PRINT_ERROR("Unable to allocate ring of size %u", size);
+		res = -ENOMEM;
+		goto out_free;
+	}
+
+	ring->cmds = (void *)ring->hdr + cmd_offs;
+	ring->replies = (void *)ring->hdr + reply_offs;
+	ring->entries = desc.entries;
+	ring->size = size;
+	mutex_init(&ring->reply_mutex);
+	mutex_init(&ring->cmd_mutex);
+
+	ring->hdr->entries = desc.entries;
+	ring->hdr->cmd_offs = cmd_offs;
+	ring->hdr->reply_offs = reply_offs;
+
+	desc.ring_size = size;
+	rc = copy_to_user(arg, &desc, sizeof(desc));
+	if (unlikely(rc != 0)) {
+		PRINT_ERROR("Failed to copy back %d user's bytes", rc);
+		res = -EFAULT;
+		goto out_vfree;
+	}
+
+	/* Initialize the ring before publishing it */
+	smp_wmb();
+
+	spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+	if (dev->ring == NULL) {
+		dev->ring = ring;
+		ring = NULL;
+	}
+	spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+
+	if (ring != NULL) {
+		PRINT_ERROR("Ring for dev %s already set up", dev->name);
+		res = -EBUSY;
+		goto out_vfree;
+	}
+
+	PRINT_INFO("Set up ring with %u entries (size %u) for dev %s",
+		desc.entries, size, dev->name);
+
+out_up:
+	up_read(&dev->dev_rwsem);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_vfree:
+	vfree(ring->hdr);
+
+out_free:
+	kfree(ring);
+	goto out_up;
+}
+
+/*
+ * Processes all replies queued in the replies ring. Errors of individual
+ * replies are reported by dev_user_process_reply() and otherwise ignored,
+ * because there's nobody to return them to.
+ */
+static int dev_user_ring_process_replies(struct scst_user_dev *dev,
+	struct scst_user_ring *ring)
+{
+	int res = 0;
+	struct scst_user_reply_cmd reply;
+	uint32_t tail;
+
+	TRACE_ENTRY();
+
+	mutex_lock(&ring->reply_mutex);
+
+	tail = ACCESS_ONCE(ring->hdr->reply_tail);
+	/* Read the entries only after the tail */
+	smp_rmb();
+
+	if (unlikely((tail - ring->reply_head) > ring->entries)) {
+		PRINT_ERROR("Invalid replies ring tail %u (head %u, entries "
+			"%u, dev %s)", tail, ring->reply_head, ring->entries,
+			dev->name);
+		res = -EINVAL;
+		goto out_unlock;
+	}
+
+	if (ring->reply_head == tail)
+		goto out_unlock;
+
+	while (ring->reply_head != tail) {
+		/* User space can change the entry under us, so copy it */
+		memcpy(&reply,
+			&ring->replies[ring->reply_head & (ring->entries - 1)],
+			sizeof(reply));
+		ring->reply_head++;
+
+		TRACE_BUFFER("Reply", &reply, sizeof(reply));
+
+		dev_user_process_reply(dev, &reply);
+	}
+
+	/* Finish reading the entries before giving them back */
+	smp_mb();
+	ring->hdr->reply_head = ring->reply_head;
+
+out_unlock:
+	mutex_unlock(&ring->reply_mutex);
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * Moves as many ready commands as fit into the commands ring. Waits for
+ * the first one, if the ring is empty and the device is blocking. Returns
+ * the number of queued commands or an error code.
+ */
+static int dev_user_ring_queue_cmds(struct scst_user_dev *dev,
+	struct scst_user_ring *ring)
+{
+	int res, queued = 0;
+	struct scst_user_cmd *ucmd;
+	uint32_t used;
+
+	TRACE_ENTRY();
+
+	res = mutex_lock_interruptible(&ring->cmd_mutex);
+	if (res != 0)
+		goto out;
+
+	used = ring->cmd_tail - ACCESS_ONCE(ring->hdr->cmd_head);
+	if (unlikely(used > ring->entries)) {
+		PRINT_ERROR("Invalid commands ring head %u (tail %u, entries "
+			"%u, dev %s)", ring->cmd_tail - used, ring->cmd_tail,
+			ring->entries, dev->name);
+		res = -EINVAL;
+		goto out_unlock;
+	}
+
+	spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+	while (used < ring->entries) {
+		if ((used == 0) && (queued == 0)) {
+			res = dev_user_get_next_cmd(dev, &ucmd);
+			if (res != 0)
+				break;
+		} else {
+			dev_user_process_scst_commands(dev);
+			ucmd = __dev_user_get_next_cmd(&dev->ready_cmd_list);
+			if (ucmd == NULL)
+				break;
+		}
+
+		/* See the comment in dev_user_reply_get_cmd() */
+		if (unlikely(ucmd_get_check(ucmd)))
+			continue;
+		spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+
+		EXTRACHECKS_BUG_ON(ucmd->user_cmd_payload_len == 0);
+
+		TRACE_BUFFER("UCMD", &ucmd->user_cmd,
+			ucmd->user_cmd_payload_len);
+		memcpy(&ring->cmds[ring->cmd_tail & (ring->entries - 1)],
+			&ucmd->user_cmd, ucmd->user_cmd_payload_len);
+#ifdef CONFIG_SCST_EXTRACHECKS
+		ucmd->user_cmd_payload_len = 0;
+#endif
+		ucmd_put(ucmd);
+
+		ring->cmd_tail++;
+		used++;
+		queued++;
+
+		spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+	}
+	spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+
+	if (queued != 0) {
+		/* Write the entries before the tail */
+		smp_wmb();
+		ring->hdr->cmd_tail = ring->cmd_tail;
+		res = queued;
+	}
+
+out_unlock:
+	mutex_unlock(&ring->cmd_mutex);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static int dev_user_ring_kick(struct file *file)
+{
+	int res;
+	struct scst_user_dev *dev;
+	struct scst_user_ring *ring;
+
+	TRACE_ENTRY();
+
+	mutex_lock(&dev_priv_mutex);
+	dev = file->private_data;
+	res = dev_user_check_reg(dev);
+	if (unlikely(res != 0)) {
+		mutex_unlock(&dev_priv_mutex);
+		goto out;
+	}
+	down_read(&dev->dev_rwsem);
+	mutex_unlock(&dev_priv_mutex);
+
+	ring = ACCESS_ONCE(dev->ring);
+	if (unlikely(ring == NULL)) {
+		PRINT_ERROR("Ring for dev %s isn't set up", dev->name);
+		res = -EINVAL;
+		goto out_up;
+	}
+	/* Pairs with smp_wmb() in dev_user_setup_ring() */
+	smp_rmb();
+
+	res = dev_user_ring_process_replies(dev, ring);
+	if (unlikely(res != 0))
+		goto out_up;
+
+	res = dev_user_ring_queue_cmds(dev, ring);
+
+out_up:
+	up_read(&dev->dev_rwsem);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 static long dev_user_ioctl(struct file *file, unsigned int cmd,
 	unsigned long arg)
 {
@@ -2073,6 +2534,11 @@ static long dev_user_ioctl(struct file *file, unsigned int cmd,
 		res = dev_user_reply_get_cmd(file, (void __user *)arg);
 		break;
 
+	case SCST_USER_REPLY_AND_GET_MULTI:
+		TRACE_DBG("%s", "REPLY_AND_GET_MULTI");
+		res = dev_user_reply_get_multi(file, (void __user *)arg);
+		break;
+
 	case SCST_USER_REPLY_CMD:
 		TRACE_DBG("%s", "REPLY_CMD");
 		res = dev_user_reply_cmd(file, (void __user *)arg);
@@ -2148,6 +2614,16 @@ static long dev_user_ioctl(struct file *file, unsigned int cmd,
 		res = dev_user_prealloc_buffer(file, (void __user *)arg);
 		break;
 
+	case SCST_USER_SETUP_RING:
+		TRACE_DBG("%s", "SETUP_RING");
+		res = dev_user_setup_ring(file, (void __user *)arg);
+		break;
+
+	case SCST_USER_RING_KICK:
+		TRACE_DBG("%s", "RING_KICK");
+		res = dev_user_ring_kick(file);
+		break;
+
 	default:
 		PRINT_ERROR("Invalid ioctl cmd %x", cmd);
 		res = -EINVAL;
@@ -2208,6 +2684,51 @@ out:
 	return res;
 }
 
+static int dev_user_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int res;
+	struct scst_user_dev *dev;
+	struct scst_user_ring *ring;
+
+	TRACE_ENTRY();
+
+	mutex_lock(&dev_priv_mutex);
+	dev = file->private_data;
+	res = dev_user_check_reg(dev);
+	if (unlikely(res != 0)) {
+		mutex_unlock(&dev_priv_mutex);
+		goto out;
+	}
+	down_read(&dev->dev_rwsem);
+	mutex_unlock(&dev_priv_mutex);
+
+	ring = ACCESS_ONCE(dev->ring);
+	if (ring == NULL) {
+		PRINT_ERROR("Ring for dev %s isn't set up", dev->name);
+		res = -EINVAL;
+		goto out_up;
+	}
+	smp_rmb();
+
+	if ((vma->vm_pgoff != 0) ||
+	    ((vma->vm_end - vma->vm_start) > ring->size)) {
+		PRINT_ERROR("Wrong ring mapping (offset %lu, size %lu, ring "
+			"size %u)", vma->vm_pgoff << PAGE_SHIFT,
+			vma->vm_end - vma->vm_start, ring->size);
+		res = -EINVAL;
+		goto out_up;
+	}
+
+	res = remap_vmalloc_range(vma, ring->hdr, 0);
+
+out_up:
+	up_read(&dev->dev_rwsem);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 /*
  * Called under udev_cmd_threads.cmd_list_lock, but can drop it inside,
  * then reacquire.
@@ -2254,6 +2775,7 @@ static void dev_user_unjam_cmd(struct scst_user_cmd *ucmd, int busy,
 		TRACE_MGMT_DBG("Adding ucmd %p to active list", ucmd);
 		list_add(&ucmd->cmd->cmd_list_entry,
 			&ucmd->cmd->cmd_threads->active_cmd_list);
+		ucmd->cmd->cmd_threads->active_cmd_cnt++;
 		wake_up(&ucmd->cmd->cmd_threads->cmd_list_waitQ);
 		break;
 
@@ -3493,6 +4015,12 @@ static int dev_user_exit_dev(struct scst_user_dev *dev)
 	sgv_pool_del(dev->pool_clust);
 	sgv_pool_del(dev->pool);
 
+	if (dev->ring != NULL) {
+		/* Pages still mapped by user space stay until unmapped */
+		vfree(dev->ring->hdr);
+		kfree(dev->ring);
+	}
+
 	scst_deinit_threads(&dev->udev_cmd_threads);
 
 	TRACE_MGMT_DBG("Releasing completed (dev %p)", dev);
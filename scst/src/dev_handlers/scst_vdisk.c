@@ -37,6 +37,7 @@
 #include <linux/vmalloc.h>
 #include <asm/atomic.h>
 #include <linux/kthread.h>
+#include <linux/workqueue.h>
 #include <linux/sched.h>
 #include <linux/delay.h>
 #ifndef INSIDE_KERNEL_TREE
@@ -48,6 +49,7 @@
 #include <linux/bio.h>
 #include <linux/crc32c.h>
 #include <linux/swap.h>
+#include <linux/sort.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
 #include <linux/falloc.h>
 #endif
@@ -110,6 +112,7 @@ static struct scst_trace_log vdisk_local_trace_tbl[] = {
 #define DEF_REMOVABLE			0
 #define DEF_ROTATIONAL			1
 #define DEF_THIN_PROVISIONED		0
+#define DEF_ASYNC			0
 
 #define VDISK_NULLIO_SIZE		(5LL*1024*1024*1024*1024/2)
 
@@ -160,6 +163,50 @@ struct scst_vdisk_dev {
 	unsigned int thin_provisioned_manually_set:1;
 	unsigned int dev_thin_provisioned:1;
 	unsigned int rotational:1;
+	unsigned int async:1;
+	unsigned int bg_unmap:1;
+
+	/*
+	 * Number of O_DIRECT mode cmds, for which all pages of their range
+	 * were dropped from the page cache, and of ones, for which some of
+	 * them stayed cached.
+	 */
+	atomic_long_t cache_bypass_hits;
+	atomic_long_t cache_bypass_misses;
+
+	/*
+	 * LBA ranges of being executed COMPARE AND WRITE commands, protected
+	 * by caw_lock.
+	 */
+	spinlock_t caw_lock;
+	struct list_head caw_ranges_list;
+
+	/* Number of COMPARE AND WRITE commands finished with MISCOMPARE */
+	atomic_long_t caw_miscompares;
+
+	/* Direct WRITE SAME statistics, protected by ws_stats_lock */
+	spinlock_t ws_stats_lock;
+	uint64_t ws_cmds;
+	uint64_t ws_bytes;
+	uint64_t ws_zeroed_bytes;
+	uint64_t ws_time_ms;
+	int ws_active_cmds;
+	uint64_t ws_left_bytes;
+
+	/*
+	 * Not yet discarded ranges of UNMAP commands in background UNMAP
+	 * mode, protected by bg_unmap_lock. bg_unmap_blocks counts blocks
+	 * in them together with the range being discarded now (bg_unmap_cur_*).
+	 */
+	spinlock_t bg_unmap_lock;
+	struct list_head bg_unmap_list;
+	atomic_long_t bg_unmap_blocks;
+	uint64_t bg_unmap_cur_lba;
+	uint64_t bg_unmap_cur_len;
+	bool bg_unmap_scheduled;
+	wait_queue_head_t bg_unmap_waitQ;
+	int bg_unmap_rate_mb; /* 0 - unlimited */
+	struct delayed_work bg_unmap_work;
 
 	struct file *fd;
 	struct block_device *bdev;
@@ -188,17 +235,29 @@ struct scst_vdisk_dev {
 	int blk_shift;
 };
 
-struct vdisk_cmd_params {
-	struct scatterlist small_sg[4];
-	struct iovec *iv;
-	int iv_count;
-	struct iovec small_iv[4];
-	struct scst_cmd *cmd;
-	loff_t loff;
-	int fua;
-	bool use_zero_copy;
+/* LBA range to be discarded in background UNMAP mode */
+struct vdisk_bg_unmap_range {
+	struct list_head bur_list_entry;
+	uint64_t bur_lba;
+	uint64_t bur_len;
+};
+
+/* LBA range locked by a COMPARE AND WRITE command */
+struct vdisk_caw_range {
+	struct list_head caw_range_list_entry;
+	struct scst_cmd *caw_cmd;
+	uint64_t caw_lba;
+	int caw_blocks;
+
+	/* COMPARE AND WRITE commands waiting for this range to unlock */
+	struct list_head caw_waiting_list;
+
+	/* Other writes waiting for this range to unlock */
+	struct list_head caw_parked_writes;
 };
 
+struct vdisk_cmd_params;
+
 enum compl_status_e {
 #if defined(SCST_DEBUG)
 	COMPL_STATUS_START_AT = 777,
@@ -211,6 +270,34 @@ enum compl_status_e {
 
 typedef enum compl_status_e (*vdisk_op_fn)(struct vdisk_cmd_params *p);
 
+struct vdisk_cmd_params {
+	struct scatterlist small_sg[4];
+	struct iovec *iv;
+	int iv_count;
+	struct iovec small_iv[4];
+	struct scst_cmd *cmd;
+	loff_t loff;
+	int fua;
+	bool use_zero_copy;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+	/* Used to execute read/write of async FILEIO devices */
+	struct work_struct async_work;
+	vdisk_op_fn async_op;
+#endif
+};
+
+/* Write parked until an overlapping COMPARE AND WRITE range unlocks */
+struct vdisk_parked_write {
+	struct list_head pw_list_entry;
+	struct scst_cmd *pw_cmd;
+	const vdisk_op_fn *pw_ops;
+	uint64_t pw_lba;
+	uint64_t pw_blocks;
+
+	/* Copy of on stack params of non-FILEIO cmds, otherwise unused */
+	struct vdisk_cmd_params pw_p;
+};
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 29)
 #define DEF_NUM_THREADS		5
 #else
@@ -222,6 +309,31 @@ static int num_threads = DEF_NUM_THREADS;
 module_param_named(num_threads, num_threads, int, S_IRUGO);
 MODULE_PARM_DESC(num_threads, "vdisk threads count");
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+#define DEF_ASYNC_MAX_ACTIVE	256
+static int async_max_active = DEF_ASYNC_MAX_ACTIVE;
+
+module_param_named(async_max_active, async_max_active, int, S_IRUGO);
+MODULE_PARM_DESC(async_max_active, "maximum number of reads and writes "
+	"executed at the same time for FILEIO devices in async mode");
+
+/* Executes reads and writes of FILEIO devices in async mode */
+static struct workqueue_struct *vdisk_async_wq;
+
+#define DEF_UNMAP_MAX_ACTIVE	16
+static int unmap_max_active = DEF_UNMAP_MAX_ACTIVE;
+
+module_param_named(unmap_max_active, unmap_max_active, int, S_IRUGO);
+MODULE_PARM_DESC(unmap_max_active, "maximum number of discards of UNMAP "
+	"commands executed at the same time for all devices");
+
+/*
+ * Executes discards of UNMAP commands. Separate from vdisk_async_wq, so
+ * long discards of trim storms don't delay async reads and writes.
+ */
+static struct workqueue_struct *vdisk_unmap_wq;
+#endif
+
 static int vdisk_attach(struct scst_device *dev);
 static void vdisk_detach(struct scst_device *dev);
 static int vdisk_attach_tgt(struct scst_tgt_dev *tgt_dev);
@@ -260,6 +372,15 @@ static enum compl_status_e vdisk_exec_read_toc(struct vdisk_cmd_params *p);
 static enum compl_status_e vdisk_exec_prevent_allow_medium_removal(struct vdisk_cmd_params *p);
 static enum compl_status_e vdisk_exec_unmap(struct vdisk_cmd_params *p);
 static enum compl_status_e vdisk_exec_write_same(struct vdisk_cmd_params *p);
+static enum compl_status_e vdisk_exec_write_same_direct(struct vdisk_cmd_params *p);
+static enum compl_status_e vdisk_exec_ext_copy(struct vdisk_cmd_params *p);
+static enum compl_status_e vdisk_exec_receive_copy_results(struct vdisk_cmd_params *p);
+static enum compl_status_e vdisk_exec_caw(struct vdisk_cmd_params *p);
+static bool vdisk_copy_id_match(struct scst_device *dev, const uint8_t *desc);
+static void vdisk_bg_unmap_clip(struct scst_cmd *cmd);
+static int vdisk_caw_park_write(struct vdisk_cmd_params *p,
+	const vdisk_op_fn *ops);
+static void vdisk_bg_unmap_drain(struct scst_vdisk_dev *virt_dev);
 static int vdisk_fsync(struct vdisk_cmd_params *p, loff_t loff,
 	loff_t len, struct scst_device *dev, gfp_t gfp_flags,
 	struct scst_cmd *cmd);
@@ -320,6 +441,32 @@ static ssize_t vdev_sysfs_usn_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf);
 static ssize_t vdev_zero_copy_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf);
+static ssize_t vdev_zero_copy_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count);
+static ssize_t vdisk_sysfs_async_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_async_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count);
+static ssize_t vdisk_sysfs_cache_bypass_hits_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_cache_bypass_misses_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_caw_miscompares_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_ws_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_ws_stats_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count);
+static ssize_t vdisk_sysfs_bg_unmap_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_bg_unmap_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count);
+static ssize_t vdisk_sysfs_bg_unmap_rate_mb_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_bg_unmap_rate_mb_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count);
+static ssize_t vdisk_sysfs_bg_unmap_pending_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
 
 static ssize_t vcdrom_sysfs_filename_store(struct kobject *kobj,
 	struct kobj_attribute *attr, const char *buf, size_t count);
@@ -352,7 +499,33 @@ static struct kobj_attribute vdev_t10_dev_id_attr =
 static struct kobj_attribute vdev_usn_attr =
 	__ATTR(usn, S_IWUSR|S_IRUGO, vdev_sysfs_usn_show, vdev_sysfs_usn_store);
 static struct kobj_attribute vdev_zero_copy_attr =
-	__ATTR(zero_copy, S_IRUGO, vdev_zero_copy_show, NULL);
+	__ATTR(zero_copy, S_IWUSR|S_IRUGO, vdev_zero_copy_show,
+		vdev_zero_copy_store);
+static struct kobj_attribute vdisk_async_attr =
+	__ATTR(async, S_IWUSR|S_IRUGO, vdisk_sysfs_async_show,
+		vdisk_sysfs_async_store);
+static struct kobj_attribute vdisk_cache_bypass_hits_attr =
+	__ATTR(cache_bypass_hits, S_IRUGO,
+		vdisk_sysfs_cache_bypass_hits_show, NULL);
+static struct kobj_attribute vdisk_cache_bypass_misses_attr =
+	__ATTR(cache_bypass_misses, S_IRUGO,
+		vdisk_sysfs_cache_bypass_misses_show, NULL);
+static struct kobj_attribute vdisk_caw_miscompares_attr =
+	__ATTR(caw_miscompares, S_IRUGO,
+		vdisk_sysfs_caw_miscompares_show, NULL);
+static struct kobj_attribute vdisk_ws_stats_attr =
+	__ATTR(ws_stats, S_IWUSR|S_IRUGO, vdisk_sysfs_ws_stats_show,
+		vdisk_sysfs_ws_stats_store);
+static struct kobj_attribute vdisk_bg_unmap_attr =
+	__ATTR(bg_unmap, S_IWUSR|S_IRUGO, vdisk_sysfs_bg_unmap_show,
+		vdisk_sysfs_bg_unmap_store);
+static struct kobj_attribute vdisk_bg_unmap_rate_mb_attr =
+	__ATTR(bg_unmap_rate_mb, S_IWUSR|S_IRUGO,
+		vdisk_sysfs_bg_unmap_rate_mb_show,
+		vdisk_sysfs_bg_unmap_rate_mb_store);
+static struct kobj_attribute vdisk_bg_unmap_pending_attr =
+	__ATTR(bg_unmap_pending, S_IRUGO,
+		vdisk_sysfs_bg_unmap_pending_show, NULL);
 
 static struct kobj_attribute vcdrom_filename_attr =
 	__ATTR(filename, S_IRUGO|S_IWUSR, vdev_sysfs_filename_show,
@@ -373,6 +546,14 @@ static const struct attribute *vdisk_fileio_attrs[] = {
 	&vdev_t10_dev_id_attr.attr,
 	&vdev_usn_attr.attr,
 	&vdev_zero_copy_attr.attr,
+	&vdisk_async_attr.attr,
+	&vdisk_cache_bypass_hits_attr.attr,
+	&vdisk_cache_bypass_misses_attr.attr,
+	&vdisk_caw_miscompares_attr.attr,
+	&vdisk_ws_stats_attr.attr,
+	&vdisk_bg_unmap_attr.attr,
+	&vdisk_bg_unmap_rate_mb_attr.attr,
+	&vdisk_bg_unmap_pending_attr.attr,
 	NULL,
 };
 
@@ -389,6 +570,11 @@ static const struct attribute *vdisk_blockio_attrs[] = {
 	&vdev_t10_dev_id_attr.attr,
 	&vdev_usn_attr.attr,
 	&vdisk_tp_attr.attr,
+	&vdisk_caw_miscompares_attr.attr,
+	&vdisk_ws_stats_attr.attr,
+	&vdisk_bg_unmap_attr.attr,
+	&vdisk_bg_unmap_rate_mb_attr.attr,
+	&vdisk_bg_unmap_pending_attr.attr,
 	NULL,
 };
 
@@ -400,6 +586,7 @@ static const struct attribute *vdisk_nullio_attrs[] = {
 	&vdev_t10_dev_id_attr.attr,
 	&vdev_usn_attr.attr,
 	&vdisk_rotational_attr.attr,
+	&vdisk_caw_miscompares_attr.attr,
 	NULL,
 };
 
@@ -449,6 +636,7 @@ static struct scst_dev_type vdisk_file_devtype = {
 	.exec =			vdisk_exec,
 	.on_free_cmd =		fileio_on_free_cmd,
 	.task_mgmt_fn_done =	vdisk_task_mgmt_fn_done,
+	.copy_id_match =	vdisk_copy_id_match,
 	.devt_priv =		(void *)fileio_ops,
 #ifdef CONFIG_SCST_PROC
 	.read_proc =		vdisk_read_proc,
@@ -459,7 +647,8 @@ static struct scst_dev_type vdisk_file_devtype = {
 	.dev_attrs =		vdisk_fileio_attrs,
 	.add_device_parameters = "filename, blocksize, write_through, "
 		"nv_cache, o_direct, read_only, removable, rotational, "
-		"thin_provisioned, zero_copy",
+		"thin_provisioned, zero_copy, async, bg_unmap, "
+		"bg_unmap_rate_mb",
 #endif
 #if defined(CONFIG_SCST_DEBUG) || defined(CONFIG_SCST_TRACING)
 	.default_trace_flags =	SCST_DEFAULT_DEV_LOG_FLAGS,
@@ -489,6 +678,7 @@ static struct scst_dev_type vdisk_blk_devtype = {
 	.parse =		non_fileio_parse,
 	.exec =			non_fileio_exec,
 	.task_mgmt_fn_done =	vdisk_task_mgmt_fn_done,
+	.copy_id_match =	vdisk_copy_id_match,
 	.devt_priv =		(void *)blockio_ops,
 #ifndef CONFIG_SCST_PROC
 	.add_device =		vdisk_add_blockio_device,
@@ -496,7 +686,7 @@ static struct scst_dev_type vdisk_blk_devtype = {
 	.dev_attrs =		vdisk_blockio_attrs,
 	.add_device_parameters = "filename, blocksize, write_through, "
 		"nv_cache, read_only, removable, rotational, "
-		"thin_provisioned",
+		"thin_provisioned, bg_unmap, bg_unmap_rate_mb",
 #endif
 #if defined(CONFIG_SCST_DEBUG) || defined(CONFIG_SCST_TRACING)
 	.default_trace_flags =	SCST_DEFAULT_DEV_LOG_FLAGS,
@@ -524,6 +714,7 @@ static struct scst_dev_type vdisk_null_devtype = {
 	.parse =		non_fileio_parse,
 	.exec =			non_fileio_exec,
 	.task_mgmt_fn_done =	vdisk_task_mgmt_fn_done,
+	.copy_id_match =	vdisk_copy_id_match,
 	.devt_priv =		(void *)nullio_ops,
 #ifndef CONFIG_SCST_PROC
 	.add_device =		vdisk_add_nullio_device,
@@ -618,13 +809,21 @@ static struct file *vdev_open_fd(const struct scst_vdisk_dev *virt_dev)
 		open_flags |= O_RDONLY;
 	else
 		open_flags |= O_RDWR;
-	if (virt_dev->o_direct_flag)
-		open_flags |= O_DIRECT;
+	/*
+	 * O_DIRECT mode is emulated by vdisk_bypass_cache(), because direct
+	 * I/O can't be done from kernel buffers, see the comment there.
+	 */
 	if (virt_dev->wt_flag && !virt_dev->nv_cache)
 		open_flags |= O_DSYNC;
 	TRACE_DBG("Opening file %s, flags 0x%x",
 		  virt_dev->filename, open_flags);
 	fd = filp_open(virt_dev->filename, O_LARGEFILE | open_flags, 0600);
+	/*
+	 * Pages read ahead would be left in the page cache, because
+	 * vdisk_bypass_cache() drops only the pages the command covered.
+	 */
+	if (!IS_ERR(fd) && virt_dev->o_direct_flag)
+		fd->f_ra.ra_pages = 0;
 
 	TRACE_EXIT();
 	return fd;
@@ -978,6 +1177,8 @@ static void vdisk_detach_tgt(struct scst_tgt_dev *tgt_dev)
 	if (--virt_dev->tgt_dev_cnt > 0)
 		goto out;
 
+	vdisk_bg_unmap_drain(virt_dev);
+
 	virt_dev->bdev = NULL;
 	if (virt_dev->fd) {
 		filp_close(virt_dev->fd, NULL);
@@ -989,6 +1190,41 @@ out:
 	return;
 }
 
+/*
+ * Matches the designators reported in the Device Identification VPD page.
+ * The vendor part of the T10 vendor ID designator depends on the target,
+ * so only the T10 device ID part is compared.
+ */
+static bool vdisk_copy_id_match(struct scst_device *dev, const uint8_t *desc)
+{
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	int len = desc[3];
+	bool res = false;
+
+	TRACE_ENTRY();
+
+	/* Only logical unit designators */
+	if ((desc[1] & 0x30) != 0)
+		goto out;
+
+	read_lock(&vdisk_serial_rwlock);
+	switch (desc[1] & 0xF) {
+	case 0x1: /* T10 vendor ID */
+		res = (len > 8) && (len - 8 == strlen(virt_dev->t10_dev_id)) &&
+		      (memcmp(&desc[4 + 8], virt_dev->t10_dev_id, len - 8) == 0);
+		break;
+	case 0x2: /* EUI-64 */
+		res = (len == 8) &&
+		      (memcmp(&desc[4], virt_dev->t10_dev_id, 8) == 0);
+		break;
+	}
+	read_unlock(&vdisk_serial_rwlock);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 static enum compl_status_e vdisk_synchronize_cache(struct vdisk_cmd_params *p)
 {
 	struct scst_cmd *cmd = p->cmd;
@@ -1107,6 +1343,9 @@ static enum compl_status_e vdisk_invalid_opcode(struct vdisk_cmd_params *p)
 	[UNMAP] = vdisk_exec_unmap,					\
 	[WRITE_SAME] = vdisk_exec_write_same,				\
 	[WRITE_SAME_16] = vdisk_exec_write_same,			\
+	[EXTENDED_COPY] = vdisk_exec_ext_copy,				\
+	[RECEIVE_COPY_RESULTS] = vdisk_exec_receive_copy_results,	\
+	[COMPARE_AND_WRITE] = vdisk_exec_caw,				\
 	[MAINTENANCE_IN] = vdisk_exec_maintenance_in,			\
 	[SEND_DIAGNOSTIC] = vdisk_exec_send_diagnostic,
 
@@ -1566,13 +1805,13 @@ static int prepare_read(struct file *filp, struct scatterlist *sg, int sg_cnt,
 {
 	struct page *page;
 	int i, res;
-	loff_t off, last = ((offset + sg_cnt - 1) << PAGE_SHIFT) +
+	loff_t off, last = ((loff_t)(offset + sg_cnt - 1) << PAGE_SHIFT) +
 		sg[sg_cnt - 1].offset + sg[sg_cnt - 1].length;
 
 	TRACE_ENTRY();
 
 	for (i = 0; i < sg_cnt; ++i) {
-		off = (offset + i) << PAGE_SHIFT | sg[i].offset;
+		off = ((loff_t)(offset + i) << PAGE_SHIFT) | sg[i].offset;
 		res = prepare_read_page(filp, sg[i].length, off, last, &page);
 		if (res <= 0)
 			goto err;
@@ -1662,8 +1901,6 @@ static int fileio_alloc_data_buf(struct scst_cmd *cmd)
 
 	EXTRACHECKS_BUG_ON(!(cmd->data_direction & SCST_DATA_READ));
 
-	scst_cmd_set_dh_data_buff_alloced(cmd);
-
 	cmd->sg = alloc_sg(cmd->bufflen, p->loff & ~PAGE_MASK, gfp_mask,
 			   p->small_sg, ARRAY_SIZE(p->small_sg), &cmd->sg_cnt);
 	if (!cmd->sg) {
@@ -1675,17 +1912,34 @@ static int fileio_alloc_data_buf(struct scst_cmd *cmd)
 	sg = cmd->sg;
 	nr = prepare_read(virt_dev->fd, sg, sg_cnt, p->loff >> PAGE_SHIFT);
 	if (nr < 0) {
-		PRINT_ERROR("prepare_read() failed: %d", nr);
+		/*
+		 * For instance, the range is beyond EOF of a sparse or
+		 * concurrently truncated file. Let's read it via a regular
+		 * buffer, which will handle it as usual.
+		 */
+		TRACE(TRACE_MINOR, "prepare_read() failed: %d, falling back "
+			"to copy (cmd %p)", nr, cmd);
 		goto out_free_sg;
 	}
+
+	/*
+	 * From now the page cache pages are referenced by cmd->sg until
+	 * finish_read(), so they can't be freed, even if invalidated or
+	 * truncated meanwhile.
+	 */
+	scst_cmd_set_dh_data_buff_alloced(cmd);
+
 out:
 	TRACE_EXIT();
 	return SCST_CMD_STATE_DEFAULT;
 
 out_free_sg:
-	kfree(cmd->sg);
+	if (cmd->sg != p->small_sg)
+		kfree(cmd->sg);
 	cmd->sg = NULL;
 	cmd->sg_cnt = 0;
+	p->use_zero_copy = false;
+	goto out;
 
 enomem:
 	scst_set_busy(cmd);
@@ -1712,30 +1966,86 @@ static void finish_read(struct scatterlist *sg, int sg_cnt)
 }
 #endif
 
-static int vdev_do_job(struct scst_cmd *cmd, const vdisk_op_fn *ops)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+static void fileio_async_work_fn(struct work_struct *work)
 {
-	int res;
-	uint8_t *cdb = cmd->cdb;
-	int opcode = cdb[0];
-	struct vdisk_cmd_params *p = cmd->dh_priv;
-	struct scst_vdisk_dev *virt_dev;
-	vdisk_op_fn op = ops[opcode];
+	struct vdisk_cmd_params *p = container_of(work,
+		struct vdisk_cmd_params, async_work);
+	struct scst_cmd *cmd = p->cmd;
 	enum compl_status_e s;
 
 	TRACE_ENTRY();
 
-	EXTRACHECKS_BUG_ON(!p);
+	TRACE_DBG("Async executing cmd %p (op %x)", cmd, cmd->cdb[0]);
 
-	virt_dev = cmd->dev->dh_priv;
+	s = p->async_op(p);
+	if (unlikely(s == CMD_FAILED))
+		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_hardw_error));
+	else
+		EXTRACHECKS_BUG_ON(s != CMD_SUCCEEDED);
 
-	EXTRACHECKS_BUG_ON(p->cmd != cmd);
-	EXTRACHECKS_BUG_ON(ops != blockio_ops && ops != fileio_ops && ops != nullio_ops);
+	cmd->completed = 1;
+	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
+		scst_estimate_context());
+
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Queues reads and writes of FILEIO devices in async mode to
+ * vdisk_async_wq, so they don't occupy the vdisk threads while waiting
+ * for the backend file. Returns true, if cmd was queued.
+ */
+static bool fileio_queue_async(struct vdisk_cmd_params *p, vdisk_op_fn op)
+{
+	struct scst_vdisk_dev *virt_dev = p->cmd->dev->dh_priv;
+
+	if (!virt_dev->async)
+		return false;
+
+	if ((op != fileio_exec_read) && (op != fileio_exec_write))
+		return false;
+
+	TRACE_DBG("Queueing async cmd %p", p->cmd);
+
+	p->async_op = op;
+	INIT_WORK(&p->async_work, fileio_async_work_fn);
+	queue_work(vdisk_async_wq, &p->async_work);
+	return true;
+}
+#else
+static inline bool fileio_queue_async(struct vdisk_cmd_params *p,
+	vdisk_op_fn op)
+{
+	return false;
+}
+#endif
+
+/* Executes cmd and, unless it is running asynchronously, completes it */
+static void __vdev_do_job(struct vdisk_cmd_params *p, const vdisk_op_fn *ops)
+{
+	struct scst_cmd *cmd = p->cmd;
+	int opcode = cmd->cdb[0];
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	vdisk_op_fn op = ops[opcode];
+	enum compl_status_e s;
+
+	TRACE_ENTRY();
+
+	if (unlikely(atomic_long_read(&virt_dev->bg_unmap_blocks) != 0) &&
+	    (cmd->op_flags & SCST_WRITE_MEDIUM) && (opcode != UNMAP))
+		vdisk_bg_unmap_clip(cmd);
+
+	/* Only FILEIO cmd params live until the cmd is freed */
+	if ((ops == fileio_ops) && fileio_queue_async(p, op))
+		goto out;
 
 	s = op(p);
 	if (s == CMD_SUCCEEDED)
 		;
 	else if (s == RUNNING_ASYNC)
-		goto out_thr;
+		goto out;
 	else if (s == CMD_FAILED)
 		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_hardw_error));
 	else if (s == INVALID_OPCODE)
@@ -1747,11 +2057,9 @@ out_compl:
 	cmd->completed = 1;
 	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
 
-out_thr:
-	res = SCST_EXEC_COMPLETED;
-
-	TRACE_EXIT_RES(res);
-	return res;
+out:
+	TRACE_EXIT();
+	return;
 
 out_invalid_opcode:
 	TRACE_DBG("Invalid opcode 0x%x", opcode);
@@ -1759,6 +2067,50 @@ out_invalid_opcode:
 	goto out_compl;
 }
 
+static int vdev_do_job(struct scst_cmd *cmd, const vdisk_op_fn *ops)
+{
+	int res;
+	int opcode = cmd->cdb[0];
+	struct vdisk_cmd_params *p = cmd->dh_priv;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	EXTRACHECKS_BUG_ON(!p);
+
+	virt_dev = cmd->dev->dh_priv;
+
+	EXTRACHECKS_BUG_ON(p->cmd != cmd);
+	EXTRACHECKS_BUG_ON(ops != blockio_ops && ops != fileio_ops && ops != nullio_ops);
+
+	/*
+	 * Unlocked check, because a write racing with the start of a
+	 * COMPARE AND WRITE isn't ordered against it anyway.
+	 */
+	if (unlikely(!list_empty(&virt_dev->caw_ranges_list)) &&
+	    (cmd->op_flags & SCST_WRITE_MEDIUM) &&
+	    (opcode != COMPARE_AND_WRITE)) {
+		int rc = vdisk_caw_park_write(p, ops);
+		if (rc > 0)
+			goto out;
+		else if (rc < 0) {
+			scst_set_busy(cmd);
+			cmd->completed = 1;
+			cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
+				SCST_CONTEXT_SAME);
+			goto out;
+		}
+	}
+
+	__vdev_do_job(p, ops);
+
+out:
+	res = SCST_EXEC_COMPLETED;
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 static int vdisk_exec(struct scst_cmd *cmd)
 {
 	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
@@ -1771,19 +2123,19 @@ static int vdisk_exec(struct scst_cmd *cmd)
 static void fileio_on_free_cmd(struct scst_cmd *cmd)
 {
 	struct vdisk_cmd_params *p = cmd->dh_priv;
-	struct scst_vdisk_dev *virt_dev;
 
 	TRACE_ENTRY();
 
 	if (!p)
 		goto out;
 
-	virt_dev = cmd->dev->dh_priv;
-
+	/*
+	 * Don't look at virt_dev->zero_copy here, it could be changed
+	 * via sysfs after this cmd was parsed.
+	 */
 	if (p->use_zero_copy) {
-		if ((cmd->data_direction & SCST_DATA_READ) &&
-		    virt_dev->zero_copy)
-			finish_read(cmd->sg, cmd->sg_cnt);
+		EXTRACHECKS_BUG_ON(!(cmd->data_direction & SCST_DATA_READ));
+		finish_read(cmd->sg, cmd->sg_cnt);
 		if (cmd->sg != p->small_sg)
 			kfree(cmd->sg);
 		cmd->sg_cnt = 0;
@@ -1886,132 +2238,165 @@ static uint64_t vdisk_gen_dev_id_num(const char *virt_dev_name)
 #endif
 }
 
-/* start and len in blocks */
-static int vdisk_unmap_range(struct scst_cmd *cmd,
-	struct scst_vdisk_dev *virt_dev, uint64_t start, uint32_t len)
+/*
+ * Discards blocks from start to start + len without any checks. Doesn't
+ * set sense, so can be called outside of cmd's context. Returns
+ * -EOPNOTSUPP, if not supported on this kernel.
+ */
+static int __vdisk_unmap_range(struct scst_vdisk_dev *virt_dev,
+	uint64_t start, uint64_t len, gfp_t gfp)
 {
-	int res, err;
+	int res = 0;
 	struct file *fd = virt_dev->fd;
 	struct inode *inode = fd->f_dentry->d_inode;
+	const int block_shift = virt_dev->dev->block_shift;
 
 	TRACE_ENTRY();
 
-	if (len == 0)
-		goto success;
-
-	if ((start > virt_dev->nblocks) ||
-	    ((start + len) > virt_dev->nblocks)) {
-		PRINT_ERROR("Device %s: attempt to write beyond max "
-			"size", virt_dev->name);
-		scst_set_cmd_error(cmd,
-			SCST_LOAD_SENSE(scst_sense_block_out_range_error));
-		res = -EINVAL;
-		goto out;
-	}
-
 	TRACE_DBG("Unmapping lba %lld (blocks %lld)",
 		(unsigned long long)start, (unsigned long long)len);
 
 	if (virt_dev->blockio) {
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 27)
-		gfp_t gfp = scst_cmd_get_gfp_flags(cmd);
+		const sector_t s = start << (block_shift - 9);
+		const sector_t l = (sector_t)len << (block_shift - 9);
+
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 31)
-		err = blkdev_issue_discard(inode->i_bdev, start, len, gfp);
+		res = blkdev_issue_discard(inode->i_bdev, s, l, gfp);
 #elif LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 35)       \
       && !(LINUX_VERSION_CODE == KERNEL_VERSION(2, 6, 34) \
            && defined(CONFIG_SUSE_KERNEL))
-		err = blkdev_issue_discard(inode->i_bdev, start, len,
+		res = blkdev_issue_discard(inode->i_bdev, s, l,
 				gfp, DISCARD_FL_WAIT);
 #elif LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 37)
-		err = blkdev_issue_discard(inode->i_bdev, start, len,
+		res = blkdev_issue_discard(inode->i_bdev, s, l,
 				gfp, BLKDEV_IFL_WAIT);
 #else
-		err = blkdev_issue_discard(inode->i_bdev, start, len, gfp, 0);
+		res = blkdev_issue_discard(inode->i_bdev, s, l, gfp, 0);
 #endif
-		if (unlikely(err != 0)) {
+		if (unlikely(res != 0))
 			PRINT_ERROR("blkdev_issue_discard() for "
-				"LBA %lld len %d failed: %d",
-				(unsigned long long)start, len, err);
-			scst_set_cmd_error(cmd,
-				SCST_LOAD_SENSE(scst_sense_write_error));
-			res = -EIO;
-			goto out;
-		}
+				"LBA %lld len %lld failed: %d",
+				(unsigned long long)start,
+				(unsigned long long)len, res);
 #else
-		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_invalid_opcode));
-		res = -EIO;
-		goto out;
+		res = -EOPNOTSUPP;
 #endif
 	} else {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
-		struct scst_device *dev = cmd->dev;
-		const int block_shift = dev->block_shift;
 		const loff_t s = start << block_shift;
-		const loff_t l = len << block_shift;
+		const loff_t l = (loff_t)len << block_shift;
 
 		TRACE_DBG("Fallocating range %lld, len %lld",
 			(unsigned long long)s, (unsigned long long)l);
 
-		err = fd->f_op->fallocate(fd,
+		res = fd->f_op->fallocate(fd,
 			FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, s, l);
-		if (unlikely(err != 0)) {
+		if (unlikely(res != 0))
 			PRINT_ERROR("fallocate() for LBA %lld len %lld "
 				"failed: %d", (unsigned long long)start,
-				(unsigned long long)len, err);
-			scst_set_cmd_error(cmd,
-				SCST_LOAD_SENSE(scst_sense_write_error));
-			res = -EIO;
-			goto out;
-		}
+				(unsigned long long)len, res);
 #else
 		sBUG();
 #endif
 	}
 
-success:
-	res = 0;
-
-out:
 	TRACE_EXIT_RES(res);
 	return res;
 }
 
-static void vdisk_exec_write_same_unmap(struct vdisk_cmd_params *p)
+static void vdisk_unmap_set_error(struct scst_cmd *cmd, int err)
 {
-	int rc;
-	struct scst_cmd *cmd = p->cmd;
-	struct scst_device *dev = cmd->dev;
-	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
-
-	TRACE_ENTRY();
-
-	if (unlikely(!virt_dev->thin_provisioned)) {
-		TRACE_DBG("%s", "Device not thin provisioned");
+	if (err == -EOPNOTSUPP)
 		scst_set_cmd_error(cmd,
 			SCST_LOAD_SENSE(scst_sense_invalid_opcode));
-		goto out;
-	}
-
-	rc = vdisk_unmap_range(cmd, virt_dev, cmd->lba,
-		cmd->data_len >> dev->block_shift);
-	if (rc != 0)
-		goto out;
-
-out:
-	TRACE_EXIT();
+	else
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_write_error));
 	return;
 }
 
-static enum compl_status_e vdisk_exec_write_same(struct vdisk_cmd_params *p)
+/* start and len in blocks */
+static int vdisk_unmap_check_range(struct scst_cmd *cmd,
+	struct scst_vdisk_dev *virt_dev, uint64_t start, uint64_t len)
 {
-	struct scst_cmd *cmd = p->cmd;
-	enum compl_status_e res = CMD_SUCCEEDED;
+	int res = 0;
 
-	TRACE_ENTRY();
+	if ((start > virt_dev->nblocks) ||
+	    ((start + len) > virt_dev->nblocks)) {
+		PRINT_ERROR("Device %s: attempt to write beyond max "
+			"size", virt_dev->name);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_block_out_range_error));
+		res = -EINVAL;
+	}
 
-	if (unlikely(cmd->cdb[1] & 1)) {
-		TRACE_DBG("%s", "ANCHOR not supported");
-		scst_set_invalid_field_in_cdb(cmd, 1,
+	return res;
+}
+
+/* start and len in blocks */
+static int vdisk_unmap_range(struct scst_cmd *cmd,
+	struct scst_vdisk_dev *virt_dev, uint64_t start, uint32_t len)
+{
+	int res;
+
+	TRACE_ENTRY();
+
+	if (len == 0) {
+		res = 0;
+		goto out;
+	}
+
+	res = vdisk_unmap_check_range(cmd, virt_dev, start, len);
+	if (res != 0)
+		goto out;
+
+	res = __vdisk_unmap_range(virt_dev, start, len,
+		scst_cmd_get_gfp_flags(cmd));
+	if (unlikely(res != 0))
+		vdisk_unmap_set_error(cmd, res);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static void vdisk_exec_write_same_unmap(struct vdisk_cmd_params *p)
+{
+	int rc;
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+
+	TRACE_ENTRY();
+
+	if (unlikely(!virt_dev->thin_provisioned)) {
+		TRACE_DBG("%s", "Device not thin provisioned");
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_invalid_opcode));
+		goto out;
+	}
+
+	rc = vdisk_unmap_range(cmd, virt_dev, cmd->lba,
+		cmd->data_len >> dev->block_shift);
+	if (rc != 0)
+		goto out;
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+static enum compl_status_e vdisk_exec_write_same(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	enum compl_status_e res = CMD_SUCCEEDED;
+
+	TRACE_ENTRY();
+
+	if (unlikely(cmd->cdb[1] & 1)) {
+		TRACE_DBG("%s", "ANCHOR not supported");
+		scst_set_invalid_field_in_cdb(cmd, 1,
 			SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
 		goto out;
 	}
@@ -2028,6 +2413,16 @@ static enum compl_status_e vdisk_exec_write_same(struct vdisk_cmd_params *p)
 		goto out;
 	}
 
+	/*
+	 * LBDATA and PBDATA need different data in each block. Blocks bigger
+	 * than a page can't be replicated from a single page.
+	 */
+	if (((cmd->cdb[1] & 0x6) == 0) &&
+	    (cmd->dev->block_size <= PAGE_SIZE)) {
+		res = vdisk_exec_write_same_direct(p);
+		goto out;
+	}
+
 	scst_write_same(cmd);
 	res = RUNNING_ASYNC;
 
@@ -2036,12 +2431,724 @@ out:
 	return res;
 }
 
+static enum compl_status_e vdisk_exec_ext_copy(struct vdisk_cmd_params *p)
+{
+	TRACE_ENTRY();
+
+	scst_ext_copy(p->cmd);
+
+	TRACE_EXIT();
+	return RUNNING_ASYNC;
+}
+
+static enum compl_status_e vdisk_exec_receive_copy_results(
+	struct vdisk_cmd_params *p)
+{
+	TRACE_ENTRY();
+
+	scst_receive_copy_results(p->cmd);
+
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
+}
+
+static void vdisk_caw_start(struct scst_vdisk_dev *virt_dev,
+	struct vdisk_caw_range *r);
+
+/*
+ * Must be called under caw_lock. Returns the being executed COMPARE AND
+ * WRITE range overlapping with the given one or NULL.
+ */
+static struct vdisk_caw_range *__vdisk_caw_find_overlap(
+	struct scst_vdisk_dev *virt_dev, uint64_t lba, uint64_t blocks)
+{
+	struct vdisk_caw_range *a;
+
+	list_for_each_entry(a, &virt_dev->caw_ranges_list,
+			caw_range_list_entry) {
+		if ((lba < a->caw_lba + a->caw_blocks) &&
+		    (a->caw_lba < lba + blocks))
+			return a;
+	}
+
+	return NULL;
+}
+
+/*
+ * Parks w on the being executed COMPARE AND WRITE range it overlaps with
+ * and returns true or returns false, if there's no such range.
+ */
+static bool vdisk_caw_try_park(struct scst_vdisk_dev *virt_dev,
+	struct vdisk_parked_write *w)
+{
+	struct vdisk_caw_range *a;
+
+	spin_lock(&virt_dev->caw_lock);
+	a = __vdisk_caw_find_overlap(virt_dev, w->pw_lba, w->pw_blocks);
+	if (a != NULL) {
+		TRACE_DBG("Write cmd %p waiting for COMPARE AND WRITE cmd %p",
+			w->pw_cmd, a->caw_cmd);
+		list_add_tail(&w->pw_list_entry, &a->caw_parked_writes);
+	}
+	spin_unlock(&virt_dev->caw_lock);
+
+	return a != NULL;
+}
+
+/*
+ * Makes writes overlapping with a being executed COMPARE AND WRITE wait
+ * until it is done, so the COMPARE AND WRITE is atomic. Writes are parked
+ * instead of waiting, because the COMPARE AND WRITE needs the vdisk
+ * threads to execute its own internal READ(16) and WRITE(16). Those, as
+ * other internal cmds, aren't parked.
+ *
+ * Returns 1, if cmd was parked, 0, if it can be executed now, or negative
+ * error code.
+ */
+static int vdisk_caw_park_write(struct vdisk_cmd_params *p,
+	const vdisk_op_fn *ops)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct vdisk_parked_write *w;
+	int res = 0;
+
+	TRACE_ENTRY();
+
+	if (cmd->internal || (cmd->op_flags & SCST_LBA_NOT_VALID) ||
+	    (cmd->data_len == 0))
+		goto out;
+
+	w = kmalloc(sizeof(*w), GFP_KERNEL);
+	if (w == NULL) {
+		PRINT_ERROR("Unable to allocate parked write (cmd %p)", cmd);
+		res = -ENOMEM;
+		goto out;
+	}
+
+	w->pw_cmd = cmd;
+	w->pw_ops = ops;
+	w->pw_lba = cmd->lba;
+	w->pw_blocks = cmd->data_len >> cmd->dev->block_shift;
+	if (ops != fileio_ops)
+		w->pw_p = *p;
+
+	if (vdisk_caw_try_park(virt_dev, w))
+		res = 1;
+	else
+		kfree(w);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* Executes w, unless it overlaps with another COMPARE AND WRITE by now */
+static void vdisk_caw_restart_write(struct scst_vdisk_dev *virt_dev,
+	struct vdisk_parked_write *w)
+{
+	struct scst_cmd *cmd = w->pw_cmd;
+	struct vdisk_cmd_params *p;
+
+	TRACE_ENTRY();
+
+	if (vdisk_caw_try_park(virt_dev, w))
+		goto out;
+
+	TRACE_DBG("Restarting write cmd %p", cmd);
+
+	if (w->pw_ops == fileio_ops)
+		p = cmd->dh_priv;
+	else {
+		p = &w->pw_p;
+		cmd->dh_priv = p;
+	}
+
+	__vdev_do_job(p, w->pw_ops);
+
+	if (w->pw_ops != fileio_ops)
+		cmd->dh_priv = NULL;
+
+	kfree(w);
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Called by scst_cmp_wr() in thread context just before cmd's completion.
+ * Unlocks cmd's LBA range and restarts COMPARE AND WRITE commands and
+ * other writes waiting for it.
+ */
+static void vdisk_caw_done(struct scst_cmd *cmd)
+{
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct vdisk_caw_range *r, *t;
+	struct vdisk_parked_write *w, *tw;
+	LIST_HEAD(waiting_list);
+	LIST_HEAD(parked_writes);
+	bool found = false;
+
+	TRACE_ENTRY();
+
+	if ((cmd->status == SAM_STAT_CHECK_CONDITION) &&
+	    scst_analyze_sense(cmd->sense, cmd->sense_valid_len,
+			SCST_SENSE_KEY_VALID, MISCOMPARE, 0, 0))
+		atomic_long_inc(&virt_dev->caw_miscompares);
+
+	spin_lock(&virt_dev->caw_lock);
+	list_for_each_entry(r, &virt_dev->caw_ranges_list,
+			caw_range_list_entry) {
+		if (r->caw_cmd == cmd) {
+			list_del(&r->caw_range_list_entry);
+			list_splice_init(&r->caw_waiting_list, &waiting_list);
+			list_splice_init(&r->caw_parked_writes, &parked_writes);
+			found = true;
+			break;
+		}
+	}
+	spin_unlock(&virt_dev->caw_lock);
+
+	if (!found)
+		goto out;
+
+	kfree(r);
+
+	/* Writes first, since they were received before the restarted CAWs */
+	list_for_each_entry_safe(w, tw, &parked_writes, pw_list_entry) {
+		list_del(&w->pw_list_entry);
+		vdisk_caw_restart_write(virt_dev, w);
+	}
+
+	list_for_each_entry_safe(r, t, &waiting_list, caw_range_list_entry) {
+		TRACE_DBG("Restarting COMPARE AND WRITE cmd %p", r->caw_cmd);
+		list_del(&r->caw_range_list_entry);
+		vdisk_caw_start(virt_dev, r);
+	}
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Locks r's LBA range and starts its COMPARE AND WRITE or, if the range
+ * overlaps with a being executed one, queues r to be restarted after the
+ * overlapping command is done. Doesn't block, so neither the cmd thread,
+ * nor other commands to the LU are held.
+ */
+static void vdisk_caw_start(struct scst_vdisk_dev *virt_dev,
+	struct vdisk_caw_range *r)
+{
+	struct vdisk_caw_range *a;
+
+	TRACE_ENTRY();
+
+	spin_lock(&virt_dev->caw_lock);
+	a = __vdisk_caw_find_overlap(virt_dev, r->caw_lba, r->caw_blocks);
+	if (a != NULL) {
+		TRACE_DBG("COMPARE AND WRITE cmd %p waiting for cmd %p",
+			r->caw_cmd, a->caw_cmd);
+		list_add_tail(&r->caw_range_list_entry, &a->caw_waiting_list);
+		spin_unlock(&virt_dev->caw_lock);
+		goto out;
+	}
+	list_add_tail(&r->caw_range_list_entry, &virt_dev->caw_ranges_list);
+	spin_unlock(&virt_dev->caw_lock);
+
+	scst_cmp_wr(r->caw_cmd, vdisk_caw_done);
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+static enum compl_status_e vdisk_exec_caw(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct vdisk_caw_range *r;
+	enum compl_status_e res;
+
+	TRACE_ENTRY();
+
+	if (virt_dev->nullio) {
+		/* Nothing stored, so nothing can miscompare */
+		res = CMD_SUCCEEDED;
+		goto out;
+	}
+
+	r = kzalloc(sizeof(*r), GFP_KERNEL);
+	if (r == NULL) {
+		PRINT_ERROR("Unable to allocate COMPARE AND WRITE range "
+			"(cmd %p)", cmd);
+		scst_set_busy(cmd);
+		res = CMD_SUCCEEDED;
+		goto out;
+	}
+
+	r->caw_cmd = cmd;
+	r->caw_lba = cmd->lba;
+	r->caw_blocks = cmd->cdb[13];
+	INIT_LIST_HEAD(&r->caw_waiting_list);
+	INIT_LIST_HEAD(&r->caw_parked_writes);
+
+	vdisk_caw_start(virt_dev, r);
+	res = RUNNING_ASYNC;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static int vdisk_unmap_descr_cmp(const void *a, const void *b)
+{
+	const struct scst_data_descriptor *da = a, *db = b;
+
+	if (da->sdd_lba < db->sdd_lba)
+		return -1;
+	else if (da->sdd_lba > db->sdd_lba)
+		return 1;
+	return 0;
+}
+
+/*
+ * Sorts UNMAP descriptors by LBA and merges overlapping and adjacent ones,
+ * dropping empty descriptors. Returns the new number of descriptors.
+ */
+static int vdisk_unmap_coalesce(struct scst_data_descriptor *pd, int cnt)
+{
+	int i, j = -1;
+
+	sort(pd, cnt, sizeof(*pd), vdisk_unmap_descr_cmp, NULL);
+
+	for (i = 0; i < cnt; i++) {
+		uint64_t end;
+
+		if (pd[i].sdd_len == 0)
+			continue;
+
+		if ((j >= 0) && (pd[i].sdd_lba <= pd[j].sdd_lba + pd[j].sdd_len)) {
+			end = max(pd[j].sdd_lba + pd[j].sdd_len,
+				  pd[i].sdd_lba + pd[i].sdd_len);
+			pd[j].sdd_len = end - pd[j].sdd_lba;
+			continue;
+		}
+
+		pd[++j] = pd[i];
+	}
+
+	TRACE_DBG("%d UNMAP descriptors coalesced into %d", cnt, j + 1);
+	return j + 1;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+
+/* Max number of discards of an UNMAP command executed at the same time */
+#define VDISK_MAX_UNMAP_WORKS		16
+
+struct vdisk_unmap_cmd;
+
+struct vdisk_unmap_work {
+	struct work_struct uw_work;
+	struct vdisk_unmap_cmd *uw_ucmd;
+	int uw_first;
+	int uw_cnt;
+};
+
+struct vdisk_unmap_cmd {
+	struct scst_cmd *uc_cmd;
+	struct scst_data_descriptor *uc_pd;
+	atomic_t uc_works_left;
+	int uc_error;
+	struct vdisk_unmap_work uc_works[VDISK_MAX_UNMAP_WORKS];
+};
+
+static void vdisk_unmap_work_fn(struct work_struct *work)
+{
+	struct vdisk_unmap_work *w = container_of(work,
+		struct vdisk_unmap_work, uw_work);
+	struct vdisk_unmap_cmd *ucmd = w->uw_ucmd;
+	struct scst_cmd *cmd = ucmd->uc_cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	const struct scst_data_descriptor *pd = ucmd->uc_pd;
+	int i, rc;
+
+	TRACE_ENTRY();
+
+	for (i = w->uw_first; i < w->uw_first + w->uw_cnt; i++) {
+		if (unlikely(test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags))) {
+			TRACE_MGMT_DBG("ABORTED set, aborting cmd %p", cmd);
+			break;
+		}
+
+		/* Don't waste time, if another work already failed */
+		if (unlikely(ACCESS_ONCE(ucmd->uc_error) != 0))
+			break;
+
+		rc = __vdisk_unmap_range(virt_dev, pd[i].sdd_lba,
+			pd[i].sdd_len, GFP_KERNEL);
+		if (unlikely(rc != 0)) {
+			cmpxchg(&ucmd->uc_error, 0, rc);
+			break;
+		}
+	}
+
+	if (!atomic_dec_and_test(&ucmd->uc_works_left))
+		goto out;
+
+	if (ucmd->uc_error != 0)
+		vdisk_unmap_set_error(cmd, ucmd->uc_error);
+
+	kfree(ucmd);
+
+	cmd->completed = 1;
+	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT,
+		scst_estimate_context());
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Splits the descriptors between up to VDISK_MAX_UNMAP_WORKS works on
+ * vdisk_unmap_wq, so they are discarded at the same time and cmd is
+ * completed by the last of them. Returns 0, if cmd was queued.
+ */
+static int vdisk_unmap_async(struct scst_cmd *cmd,
+	struct scst_data_descriptor *pd, int cnt)
+{
+	int res, i, first = 0, works = min(cnt, VDISK_MAX_UNMAP_WORKS);
+	struct vdisk_unmap_cmd *ucmd;
+
+	TRACE_ENTRY();
+
+	ucmd = kzalloc(sizeof(*ucmd), scst_cmd_get_gfp_flags(cmd));
+	if (ucmd == NULL) {
+		TRACE(TRACE_OUT_OF_MEM, "Unable to allocate UNMAP cmd "
+			"(cmd %p), executing synchronously", cmd);
+		res = -ENOMEM;
+		goto out;
+	}
+
+	ucmd->uc_cmd = cmd;
+	ucmd->uc_pd = pd;
+	atomic_set(&ucmd->uc_works_left, works);
+
+	for (i = 0; i < works; i++) {
+		struct vdisk_unmap_work *w = &ucmd->uc_works[i];
+
+		w->uw_ucmd = ucmd;
+		w->uw_first = first;
+		w->uw_cnt = cnt / works + ((i < cnt % works) ? 1 : 0);
+		first += w->uw_cnt;
+		INIT_WORK(&w->uw_work, vdisk_unmap_work_fn);
+	}
+
+	TRACE_DBG("Queueing %d UNMAP works for %d descriptors (cmd %p)",
+		works, cnt, cmd);
+
+	/* ucmd can be freed as soon as the last work is queued */
+	for (i = 0; i < works; i++)
+		queue_work(vdisk_unmap_wq, &ucmd->uc_works[i].uw_work);
+
+	res = 0;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* Max size of a discard in background UNMAP mode */
+#define VDISK_BG_UNMAP_MAX_CHUNK	(64*1024*1024)
+/* bg_unmap_rate_mb budget is given this number of times per second */
+#define VDISK_BG_UNMAP_PERIODS		10
+
+static void vdisk_bg_unmap_work_fn(struct work_struct *work)
+{
+	struct scst_vdisk_dev *virt_dev = container_of(work,
+		struct scst_vdisk_dev, bg_unmap_work.work);
+	const int block_shift = virt_dev->dev->block_shift;
+	const uint64_t chunk = VDISK_BG_UNMAP_MAX_CHUNK >> block_shift;
+	int rate_mb = virt_dev->bg_unmap_rate_mb;
+	uint64_t budget;
+
+	TRACE_ENTRY();
+
+	if (rate_mb != 0)
+		budget = max_t(uint64_t, ((uint64_t)rate_mb *
+			((1 << 20) / VDISK_BG_UNMAP_PERIODS)) >> block_shift, 1);
+	else
+		budget = ~0ULL;
+
+	spin_lock(&virt_dev->bg_unmap_lock);
+	while (!list_empty(&virt_dev->bg_unmap_list)) {
+		struct vdisk_bg_unmap_range *r;
+		uint64_t lba, len;
+
+		if (budget == 0) {
+			TRACE_DBG("Device %s: background UNMAP budget "
+				"exhausted, %ld blocks left", virt_dev->name,
+				atomic_long_read(&virt_dev->bg_unmap_blocks));
+			queue_delayed_work(vdisk_unmap_wq,
+				&virt_dev->bg_unmap_work,
+				HZ / VDISK_BG_UNMAP_PERIODS);
+			goto out_unlock;
+		}
+
+		r = list_first_entry(&virt_dev->bg_unmap_list,
+			struct vdisk_bg_unmap_range, bur_list_entry);
+		lba = r->bur_lba;
+		len = min_t(uint64_t, min_t(uint64_t, r->bur_len, chunk),
+			budget);
+		r->bur_lba += len;
+		r->bur_len -= len;
+		if (r->bur_len == 0) {
+			list_del(&r->bur_list_entry);
+			kfree(r);
+		}
+
+		/* Writes to this range will wait until it is discarded */
+		virt_dev->bg_unmap_cur_lba = lba;
+		virt_dev->bg_unmap_cur_len = len;
+		spin_unlock(&virt_dev->bg_unmap_lock);
+
+		/* Errors are already reported, nothing else can be done */
+		__vdisk_unmap_range(virt_dev, lba, len, GFP_KERNEL);
+
+		budget -= len;
+
+		spin_lock(&virt_dev->bg_unmap_lock);
+		virt_dev->bg_unmap_cur_len = 0;
+		atomic_long_sub(len, &virt_dev->bg_unmap_blocks);
+		wake_up_all(&virt_dev->bg_unmap_waitQ);
+	}
+
+	virt_dev->bg_unmap_scheduled = false;
+
+out_unlock:
+	spin_unlock(&virt_dev->bg_unmap_lock);
+
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Queues the descriptors to be discarded in background. Returns 0, if
+ * all of them were queued.
+ */
+static int vdisk_bg_unmap_queue(struct scst_cmd *cmd,
+	struct scst_vdisk_dev *virt_dev, const struct scst_data_descriptor *pd,
+	int cnt)
+{
+	int res, i;
+	LIST_HEAD(ranges);
+	struct vdisk_bg_unmap_range *r, *t;
+	uint64_t blocks = 0;
+
+	TRACE_ENTRY();
+
+	for (i = 0; i < cnt; i++) {
+		r = kmalloc(sizeof(*r), scst_cmd_get_gfp_flags(cmd));
+		if (r == NULL) {
+			TRACE(TRACE_OUT_OF_MEM, "Unable to allocate background "
+				"UNMAP range (cmd %p)", cmd);
+			res = -ENOMEM;
+			goto out_free;
+		}
+		r->bur_lba = pd[i].sdd_lba;
+		r->bur_len = pd[i].sdd_len;
+		list_add_tail(&r->bur_list_entry, &ranges);
+		blocks += r->bur_len;
+	}
+
+	spin_lock(&virt_dev->bg_unmap_lock);
+	list_splice_tail(&ranges, &virt_dev->bg_unmap_list);
+	atomic_long_add(blocks, &virt_dev->bg_unmap_blocks);
+	if (!virt_dev->bg_unmap_scheduled) {
+		virt_dev->bg_unmap_scheduled = true;
+		queue_delayed_work(vdisk_unmap_wq, &virt_dev->bg_unmap_work, 0);
+	}
+	spin_unlock(&virt_dev->bg_unmap_lock);
+
+	TRACE_DBG("Queued %d background UNMAP ranges (%lld blocks, cmd %p)",
+		cnt, (unsigned long long)blocks, cmd);
+
+	res = 0;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_free:
+	list_for_each_entry_safe(r, t, &ranges, bur_list_entry) {
+		list_del(&r->bur_list_entry);
+		kfree(r);
+	}
+	goto out;
+}
+
+static bool vdisk_bg_unmap_cur_overlaps(struct scst_vdisk_dev *virt_dev,
+	uint64_t lba, uint64_t blocks)
+{
+	bool res;
+
+	spin_lock(&virt_dev->bg_unmap_lock);
+	res = (virt_dev->bg_unmap_cur_len != 0) &&
+	      (virt_dev->bg_unmap_cur_lba < lba + blocks) &&
+	      (lba < virt_dev->bg_unmap_cur_lba + virt_dev->bg_unmap_cur_len);
+	spin_unlock(&virt_dev->bg_unmap_lock);
+
+	return res;
+}
+
+/*
+ * Removes blocks written by cmd from the not yet discarded background
+ * UNMAP ranges and waits until the being discarded range doesn't overlap
+ * them, so written data are never discarded afterwards.
+ */
+static void vdisk_bg_unmap_clip(struct scst_cmd *cmd)
+{
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct vdisk_bg_unmap_range *r, *t;
+	uint64_t lba = cmd->lba, end;
+	uint64_t blocks = cmd->data_len >> cmd->dev->block_shift;
+	uint64_t clipped = 0;
+
+	TRACE_ENTRY();
+
+	if ((cmd->op_flags & SCST_LBA_NOT_VALID) || (blocks == 0))
+		goto out;
+
+	end = lba + blocks;
+
+	spin_lock(&virt_dev->bg_unmap_lock);
+	list_for_each_entry_safe(r, t, &virt_dev->bg_unmap_list,
+				 bur_list_entry) {
+		uint64_t r_end = r->bur_lba + r->bur_len;
+
+		if ((r_end <= lba) || (r->bur_lba >= end))
+			continue;
+
+		if ((r->bur_lba >= lba) && (r_end <= end)) {
+			clipped += r->bur_len;
+			list_del(&r->bur_list_entry);
+			kfree(r);
+		} else if ((r->bur_lba < lba) && (r_end > end)) {
+			struct vdisk_bg_unmap_range *n;
+
+			n = kmalloc(sizeof(*n), GFP_ATOMIC);
+			if (n == NULL) {
+				/* Safe, the space is just not reclaimed */
+				clipped += r->bur_len;
+				list_del(&r->bur_list_entry);
+				kfree(r);
+				continue;
+			}
+			n->bur_lba = end;
+			n->bur_len = r_end - end;
+			list_add(&n->bur_list_entry, &r->bur_list_entry);
+			r->bur_len = lba - r->bur_lba;
+			clipped += blocks;
+		} else if (r->bur_lba < lba) {
+			clipped += r_end - lba;
+			r->bur_len = lba - r->bur_lba;
+		} else {
+			clipped += end - r->bur_lba;
+			r->bur_len = r_end - end;
+			r->bur_lba = end;
+		}
+	}
+	atomic_long_sub(clipped, &virt_dev->bg_unmap_blocks);
+	spin_unlock(&virt_dev->bg_unmap_lock);
+
+	if (clipped != 0)
+		TRACE_DBG("Cmd %p clipped %lld blocks of background UNMAP",
+			cmd, (unsigned long long)clipped);
+
+	wait_event(virt_dev->bg_unmap_waitQ,
+		!vdisk_bg_unmap_cur_overlaps(virt_dev, lba, blocks));
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Drops not yet discarded background UNMAP ranges and waits for the being
+ * discarded one. Called before the backend is closed.
+ */
+static void vdisk_bg_unmap_drain(struct scst_vdisk_dev *virt_dev)
+{
+	LIST_HEAD(ranges);
+	struct vdisk_bg_unmap_range *r, *t;
+	uint64_t blocks = 0;
+
+	TRACE_ENTRY();
+
+	spin_lock(&virt_dev->bg_unmap_lock);
+	list_splice_init(&virt_dev->bg_unmap_list, &ranges);
+	spin_unlock(&virt_dev->bg_unmap_lock);
+
+	cancel_delayed_work_sync(&virt_dev->bg_unmap_work);
+
+	spin_lock(&virt_dev->bg_unmap_lock);
+	virt_dev->bg_unmap_scheduled = false;
+	spin_unlock(&virt_dev->bg_unmap_lock);
+
+	list_for_each_entry_safe(r, t, &ranges, bur_list_entry) {
+		blocks += r->bur_len;
+		list_del(&r->bur_list_entry);
+		kfree(r);
+	}
+
+	if (blocks != 0) {
+		atomic_long_sub(blocks, &virt_dev->bg_unmap_blocks);
+		PRINT_INFO("Device %s: dropped %lld not yet discarded "
+			"background UNMAP blocks", virt_dev->name,
+			(unsigned long long)blocks);
+	}
+
+	TRACE_EXIT();
+	return;
+}
+
+#else /* LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36) */
+
+static inline int vdisk_unmap_async(struct scst_cmd *cmd,
+	struct scst_data_descriptor *pd, int cnt)
+{
+	return -EOPNOTSUPP;
+}
+
+static inline int vdisk_bg_unmap_queue(struct scst_cmd *cmd,
+	struct scst_vdisk_dev *virt_dev, const struct scst_data_descriptor *pd,
+	int cnt)
+{
+	return -EOPNOTSUPP;
+}
+
+static void vdisk_bg_unmap_clip(struct scst_cmd *cmd)
+{
+	return;
+}
+
+static void vdisk_bg_unmap_drain(struct scst_vdisk_dev *virt_dev)
+{
+	return;
+}
+
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36) */
+
 static enum compl_status_e vdisk_exec_unmap(struct vdisk_cmd_params *p)
 {
 	struct scst_cmd *cmd = p->cmd;
 	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
 	struct scst_data_descriptor *pd = cmd->cmd_data_descriptors;
 	int i, cnt = cmd->cmd_data_descriptors_cnt;
+	enum compl_status_e res = CMD_SUCCEEDED;
 
 	TRACE_ENTRY();
 
@@ -2062,6 +3169,27 @@ static enum compl_status_e vdisk_exec_unmap(struct vdisk_cmd_params *p)
 	if (pd == NULL)
 		goto out;
 
+	/* Nothing is discarded, if any of the descriptors is out of range */
+	for (i = 0; i < cnt; i++) {
+		if (vdisk_unmap_check_range(cmd, virt_dev, pd[i].sdd_lba,
+				pd[i].sdd_len) != 0)
+			goto out;
+	}
+
+	cnt = vdisk_unmap_coalesce(pd, cnt);
+	cmd->cmd_data_descriptors_cnt = cnt;
+	if (cnt == 0)
+		goto out;
+
+	if (virt_dev->bg_unmap &&
+	    (vdisk_bg_unmap_queue(cmd, virt_dev, pd, cnt) == 0))
+		goto out;
+
+	if (vdisk_unmap_async(cmd, pd, cnt) == 0) {
+		res = RUNNING_ASYNC;
+		goto out;
+	}
+
 	for (i = 0; i < cnt; i++) {
 		int rc;
 
@@ -2070,14 +3198,17 @@ static enum compl_status_e vdisk_exec_unmap(struct vdisk_cmd_params *p)
 			goto out;
 		}
 
-		rc = vdisk_unmap_range(cmd, virt_dev, pd[i].sdd_lba, pd[i].sdd_len);
-		if (rc != 0)
+		rc = __vdisk_unmap_range(virt_dev, pd[i].sdd_lba,
+			pd[i].sdd_len, scst_cmd_get_gfp_flags(cmd));
+		if (unlikely(rc != 0)) {
+			vdisk_unmap_set_error(cmd, rc);
 			goto out;
+		}
 	}
 
 out:
-	TRACE_EXIT();
-	return CMD_SUCCEEDED;
+	TRACE_EXIT_RES(res);
+	return res;
 }
 
 static void vdev_blockio_get_unmap_params(struct scst_vdisk_dev *virt_dev,
@@ -2290,6 +3421,9 @@ static enum compl_status_e vdisk_exec_inquiry(struct vdisk_cmd_params *p)
 					cmd->tgt_dev->max_sg_cnt << PAGE_SHIFT,
 					8*1024*1024) / dev->block_size;
 			put_unaligned_be32(max_transfer, &buf[8]);
+			/* MAXIMUM COMPARE AND WRITE LENGTH */
+			buf[5] = min_t(int, 255,
+				SCST_MAX_CMP_WR_SIZE >> dev->block_shift);
 			/*
 			 * Let's have optimal transfer len 512KB. Better to not
 			 * set it at all, because we don't have such limit,
@@ -2365,6 +3499,8 @@ static enum compl_status_e vdisk_exec_inquiry(struct vdisk_cmd_params *p)
 		buf[4] = 31;/* n - 4 = 35 - 4 = 31 for full 36 byte data */
 		if (scst_impl_alua_configured(dev))
 			buf[5] = SCST_INQ_TPGS_MODE_IMPLICIT;
+		if (dev->type == TYPE_DISK)
+			buf[5] |= 0x08; /* 3PC, EXTENDED COPY supported */
 		buf[6] = 0x10; /* MultiP 1 */
 		buf[7] = 2; /* CMDQUE 1, BQue 0 => commands queuing supported */
 
@@ -3097,9 +4233,139 @@ out:
 	return CMD_SUCCEEDED;
 }
 
+/*
+ * Finds provisioning status of the block lba and number of the following
+ * blocks, not beyond end, with the same status. Holes of thin provisioned
+ * FILEIO backing files are reported as deallocated, everything else as
+ * mapped, since block devices don't report their allocation state.
+ */
+static int vdisk_get_lba_status(struct scst_vdisk_dev *virt_dev,
+	int block_shift, uint64_t lba, uint64_t end, uint64_t *blocks,
+	int *status)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
+	loff_t data, hole;
+#endif
+	int res = 0;
+
+	TRACE_ENTRY();
+
+	*blocks = end - lba;
+	*status = 0;
+
+	if (!virt_dev->thin_provisioned || virt_dev->blockio ||
+	    (virt_dev->fd == NULL))
+		goto out;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
+	data = vfs_llseek(virt_dev->fd, lba << block_shift, SEEK_DATA);
+	if (data == -ENXIO) {
+		/* Hole up to EOF */
+		*status = 1;
+		goto out;
+	} else if (data < 0) {
+		res = data;
+		goto out;
+	}
+
+	/* Partially allocated blocks are mapped */
+	if ((data >> block_shift) > lba) {
+		*blocks = min_t(uint64_t, data >> block_shift, end) - lba;
+		*status = 1;
+		goto out;
+	}
+
+	hole = vfs_llseek(virt_dev->fd, data, SEEK_HOLE);
+	if (hole < 0) {
+		res = hole;
+		goto out;
+	}
+	hole = ALIGN(hole, 1 << block_shift);
+	*blocks = min_t(uint64_t, hole >> block_shift, end) - lba;
+#endif
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* SBC-3 GET LBA STATUS command */
 static enum compl_status_e vdisk_exec_get_lba_status(struct vdisk_cmd_params *p)
 {
-	return INVALID_OPCODE;
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	uint64_t lba = cmd->lba, blocks;
+	uint8_t small_buf[8+16], *address, *buf;
+	int length, resp_len, max_descr, n, status, rc;
+
+	TRACE_ENTRY();
+
+	if (unlikely(lba >= virt_dev->nblocks)) {
+		TRACE_DBG("GET LBA STATUS beyond the end (lba %lld)",
+			(unsigned long long)lba);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_block_out_range_error));
+		goto out;
+	}
+
+	length = scst_get_buf_full_sense(cmd, &address);
+	if (unlikely(length <= 0))
+		goto out;
+
+	/* Return as many descriptors as fit in the allocation length */
+	if (length < (int)sizeof(small_buf)) {
+		buf = small_buf;
+		max_descr = 1;
+	} else {
+		buf = address;
+		max_descr = (length - 8) / 16;
+	}
+
+	memset(buf, 0, 8);
+
+	for (n = 0; (n < max_descr) && (lba < virt_dev->nblocks); n++) {
+		uint8_t *d = &buf[8 + 16 * n];
+
+		rc = vdisk_get_lba_status(virt_dev, dev->block_shift, lba,
+			virt_dev->nblocks, &blocks, &status);
+		if (unlikely(rc != 0)) {
+			PRINT_ERROR("Unable to get LBA %lld status of device "
+				"%s: %d", (unsigned long long)lba,
+				virt_dev->name, rc);
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_read_error));
+			goto out_put;
+		}
+		blocks = min_t(uint64_t, blocks, 0xFFFFFFFF);
+
+		TRACE_DBG("lba %lld, blocks %lld, status %d",
+			(unsigned long long)lba, (unsigned long long)blocks,
+			status);
+
+		memset(d, 0, 16);
+		put_unaligned_be64(lba, &d[0]);
+		put_unaligned_be32(blocks, &d[8]);
+		d[12] = status;
+
+		lba += blocks;
+	}
+
+	resp_len = 8 + 16 * n;
+	put_unaligned_be32(resp_len - 4, &buf[0]);
+
+	if (buf == small_buf)
+		memcpy(address, small_buf, min(length, resp_len));
+
+	if (resp_len < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, resp_len);
+
+out_put:
+	scst_put_buf_full(cmd, address);
+
+out:
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
 }
 
 /* SPC-4 REPORT TARGET PORT GROUPS command */
@@ -3330,6 +4596,67 @@ static enum compl_status_e blockio_exec_read(struct vdisk_cmd_params *p)
 	return RUNNING_ASYNC;
 }
 
+/*
+ * Emulates O_DIRECT mode: writes back, if needed, and drops from the page
+ * cache all pages of the just read or written range, so the data of this
+ * device don't stay in the page cache. Real O_DIRECT isn't possible here,
+ * because direct I/O pins pages of the iovec by get_user_pages(), which
+ * fails for kernel buffers.
+ *
+ * Pages only partially covered by the range are not dropped, so such
+ * unaligned cmds, as well as cmds whose pages are busy, counted as misses.
+ */
+static int vdisk_bypass_cache(struct scst_vdisk_dev *virt_dev, loff_t loff,
+	loff_t len, bool write)
+{
+	struct address_space *mapping = virt_dev->fd->f_mapping;
+	pgoff_t start, end;
+	unsigned long dropped = 0;
+	bool hit;
+	int res = 0;
+
+	TRACE_ENTRY();
+
+	if (unlikely(len == 0))
+		goto out;
+
+	if (write) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 32)
+		res = sync_page_range(mapping->host, mapping, loff, len);
+#else
+		res = filemap_write_and_wait_range(mapping, loff,
+			loff + len - 1);
+#endif
+		if (unlikely(res != 0)) {
+			PRINT_ERROR("sync range failed (%d)", res);
+			goto out;
+		}
+	}
+
+	hit = ((loff | len) & ~PAGE_CACHE_MASK) == 0;
+
+	/* Only pages fully covered by the range */
+	start = (loff + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	end = (loff + len) >> PAGE_CACHE_SHIFT;
+	if (end > start) {
+		dropped = invalidate_mapping_pages(mapping, start, end - 1);
+		if (dropped < end - start)
+			hit = false;
+	}
+
+	TRACE_DBG("loff %lld, len %lld, dropped %lu pages (hit %d)",
+		(long long)loff, (long long)len, dropped, hit);
+
+	if (hit)
+		atomic_long_inc(&virt_dev->cache_bypass_hits);
+	else
+		atomic_long_inc(&virt_dev->cache_bypass_misses);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 static enum compl_status_e fileio_exec_read(struct vdisk_cmd_params *p)
 {
 	struct scst_cmd *cmd = p->cmd;
@@ -3423,6 +4750,10 @@ static enum compl_status_e fileio_exec_read(struct vdisk_cmd_params *p)
 
 	set_fs(old_fs);
 
+	if (virt_dev->o_direct_flag)
+		vdisk_bypass_cache(virt_dev, p->loff,
+			scst_cmd_get_data_len(cmd), false);
+
 out:
 	TRACE_EXIT();
 	return err >= 0 ? CMD_SUCCEEDED : CMD_FAILED;
@@ -3578,6 +4909,15 @@ restart:
 
 	set_fs(old_fs);
 
+	if (virt_dev->o_direct_flag) {
+		if (vdisk_bypass_cache(virt_dev, p->loff,
+				scst_cmd_get_data_len(cmd), true) != 0) {
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
+			err = -EIO;
+		}
+	}
+
 out_sync:
 	/* O_DSYNC flag is used for WT devices */
 	if (p->fua)
@@ -3867,6 +5207,432 @@ static int vdisk_blockio_flush(struct block_device *bdev, gfp_t gfp_mask,
 	return res;
 }
 
+/* Max size of each write of the direct WRITE SAME */
+#define VDISK_WS_MAX_WRITE_SIZE		(UIO_MAXIOV * PAGE_SIZE)
+
+/* Max size of each zeroing of the direct WRITE SAME */
+#define VDISK_WS_MAX_ZERO_SIZE		(256*1024*1024)
+
+struct vdisk_ws_bio_work {
+	atomic_t bios_inflight;
+	int error;
+	struct completion bios_cmpl;
+};
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
+static int vdisk_ws_endio(struct bio *bio, unsigned int bytes_done, int error)
+#else
+static void vdisk_ws_endio(struct bio *bio, int error)
+#endif
+{
+	struct vdisk_ws_bio_work *ws_work = bio->bi_private;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
+	if (bio->bi_size)
+		return 1;
+#endif
+
+	if (unlikely(!bio_flagged(bio, BIO_UPTODATE)) && (error == 0))
+		error = -EIO;
+
+	if (unlikely(error != 0))
+		ws_work->error = error;
+
+	if (atomic_dec_and_test(&ws_work->bios_inflight))
+		complete(&ws_work->bios_cmpl);
+
+	bio_put(bio);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 24)
+	return 0;
+#else
+	return;
+#endif
+}
+
+/*
+ * Writes len bytes at loff of the BLOCKIO device by bios, all entries of
+ * which point to the same page with the replicated block, and waits for
+ * them to finish.
+ */
+static int blockio_ws_write(struct scst_vdisk_dev *virt_dev,
+	struct page *page, loff_t loff, int len, gfp_t gfp_mask)
+{
+	struct block_device *bdev = virt_dev->bdev;
+	struct request_queue *q = bdev_get_queue(bdev);
+	struct bio *bio = NULL, *hbio = NULL, *tbio = NULL;
+	struct vdisk_ws_bio_work ws_work;
+	sector_t sector = loff >> 9;
+	int max_nr_vecs, bios = 0, res;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+	struct blk_plug plug;
+#endif
+
+	TRACE_ENTRY();
+
+	if (q)
+		max_nr_vecs = min(bio_get_nr_vecs(bdev), BIO_MAX_PAGES);
+	else
+		max_nr_vecs = 1;
+
+	while (len > 0) {
+		int bytes = min_t(int, len, PAGE_SIZE);
+
+		if (bio == NULL) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)
+			bio = bio_kmalloc(gfp_mask, max_nr_vecs);
+#else
+			bio = bio_alloc(gfp_mask, max_nr_vecs);
+#endif
+			if (bio == NULL) {
+				PRINT_ERROR("Failed to create WRITE SAME bio "
+					"(device %s)", virt_dev->name);
+				res = -ENOMEM;
+				goto out_free;
+			}
+
+			bios++;
+			bio->bi_end_io = vdisk_ws_endio;
+			bio->bi_sector = sector;
+			bio->bi_bdev = bdev;
+			bio->bi_private = &ws_work;
+			if (virt_dev->wt_flag)
+				bio->bi_rw |= REQ_FUA;
+
+			if (!hbio)
+				hbio = tbio = bio;
+			else
+				tbio = tbio->bi_next = bio;
+		}
+
+		if (bio_add_page(bio, page, bytes, 0) < bytes) {
+			if (unlikely(bio->bi_vcnt == 0)) {
+				PRINT_ERROR("Unable to add page to empty WRITE "
+					"SAME bio (device %s)", virt_dev->name);
+				res = -EIO;
+				goto out_free;
+			}
+			/* The bio is full, start a new one */
+			bio = NULL;
+			continue;
+		}
+
+		sector += bytes >> 9;
+		len -= bytes;
+	}
+
+	ws_work.error = 0;
+	init_completion(&ws_work.bios_cmpl);
+	/* +1 to prevent too early completion */
+	atomic_set(&ws_work.bios_inflight, bios+1);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+	blk_start_plug(&plug);
+#endif
+
+	while (hbio) {
+		bio = hbio;
+		hbio = hbio->bi_next;
+		bio->bi_next = NULL;
+		submit_bio(WRITE, bio);
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+	blk_finish_plug(&plug);
+#else
+	if (q && q->unplug_fn)
+		q->unplug_fn(q);
+#endif
+
+	if (!atomic_dec_and_test(&ws_work.bios_inflight))
+		wait_for_completion(&ws_work.bios_cmpl);
+
+	res = ws_work.error;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_free:
+	while (hbio) {
+		bio = hbio;
+		hbio = hbio->bi_next;
+		bio_put(bio);
+	}
+	goto out;
+}
+
+/*
+ * Writes len bytes at loff of the FILEIO device from iovecs, all of which
+ * point to the same page with the replicated block.
+ */
+static int fileio_ws_write(struct scst_vdisk_dev *virt_dev, struct iovec *iv,
+	struct page *page, loff_t loff, int len)
+{
+	struct file *fd = virt_dev->fd;
+	uint8_t *buf = page_address(page);
+	mm_segment_t old_fs;
+	int done = 0, res = 0;
+	loff_t pos = loff;
+
+	TRACE_ENTRY();
+
+	old_fs = get_fs();
+	set_fs(get_ds());
+
+	while (done < len) {
+		int iv_count = 0, full_len = 0, offs = done % PAGE_SIZE;
+		ssize_t err;
+
+		/* After a short write the next iovec starts inside the page */
+		while ((done + full_len < len) && (iv_count < UIO_MAXIOV)) {
+			int bytes = min_t(int, len - done - full_len,
+					PAGE_SIZE - offs);
+
+			iv[iv_count].iov_base = (uint8_t __force __user *)buf + offs;
+			iv[iv_count].iov_len = bytes;
+			iv_count++;
+			full_len += bytes;
+			offs = 0;
+		}
+
+		err = vfs_writev(fd, (struct iovec __force __user *)iv,
+				 iv_count, &pos);
+		if (err <= 0) {
+			PRINT_ERROR("WRITE SAME write() returned %lld from %d",
+				(long long)err, full_len);
+			res = (err < 0) ? err : -EIO;
+			goto out_set_fs;
+		}
+
+		done += err;
+	}
+
+out_set_fs:
+	set_fs(old_fs);
+
+	if ((res == 0) && virt_dev->o_direct_flag)
+		res = vdisk_bypass_cache(virt_dev, loff, len, true);
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * Zeroes len bytes at loff using zeroing offload of the backend. Returns
+ * -EOPNOTSUPP, if it isn't supported.
+ */
+static int vdisk_ws_zero(struct scst_vdisk_dev *virt_dev, loff_t loff,
+	loff_t len, gfp_t gfp_mask)
+{
+	int res;
+
+	TRACE_ENTRY();
+
+	if (virt_dev->blockio) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+		res = blkdev_issue_zeroout(virt_dev->bdev, loff >> 9, len >> 9,
+			gfp_mask);
+#else
+		res = -EOPNOTSUPP;
+#endif
+	} else {
+#ifdef FALLOC_FL_ZERO_RANGE
+		struct file *fd = virt_dev->fd;
+
+		if (fd->f_op->fallocate == NULL) {
+			res = -EOPNOTSUPP;
+			goto out;
+		}
+
+		res = fd->f_op->fallocate(fd,
+			FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, loff, len);
+		/* O_DSYNC doesn't cover fallocate() */
+		if ((res == 0) && virt_dev->wt_flag && !virt_dev->nv_cache)
+			res = vfs_fsync_range(fd, loff, loff + len - 1, 1);
+#else
+		res = -EOPNOTSUPP;
+		goto out;
+#endif
+	}
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* Allocates a page filled with the replicated block or zeroed, if NULL */
+static struct page *vdisk_ws_alloc_page(const uint8_t *block, int block_size)
+{
+	struct page *page;
+	int i;
+
+	page = alloc_page(GFP_KERNEL | (block == NULL ? __GFP_ZERO : 0));
+	if ((page == NULL) || (block == NULL))
+		goto out;
+
+	for (i = 0; i < PAGE_SIZE; i += block_size)
+		memcpy((uint8_t *)page_address(page) + i, block, block_size);
+
+out:
+	return page;
+}
+
+/*
+ * Executes WRITE SAME without UNMAP, LBDATA and PBDATA bits in the handler's
+ * thread instead of fanning it out into internal WRITE(16) commands. Zero
+ * blocks are written by blkdev_issue_zeroout() for BLOCKIO and by
+ * FALLOC_FL_ZERO_RANGE for FILEIO, if the backend supports it. Otherwise,
+ * the block is replicated into a page, which is written by up to
+ * VDISK_WS_MAX_WRITE_SIZE bytes at once.
+ */
+static enum compl_status_e vdisk_exec_write_same_direct(
+	struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	gfp_t gfp_mask = scst_cmd_get_gfp_flags(cmd);
+	loff_t loff = p->loff, left = scst_cmd_get_data_len(cmd);
+	uint64_t done = 0, zeroed = 0;
+	unsigned long start_time = jiffies;
+	uint8_t *address;
+	struct page *page = NULL;
+	struct iovec *iv = NULL;
+	bool zero = true;
+	int length, i, rc = 0;
+
+	TRACE_ENTRY();
+
+	if (unlikely(cmd->sg_cnt != 1)) {
+		PRINT_ERROR("WRITE SAME must contain only single block of data "
+			"in a single SG (cmd %p)", cmd);
+		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_parameter_value_invalid));
+		goto out;
+	}
+
+	if (virt_dev->nullio || (left == 0))
+		goto out;
+
+	length = scst_get_buf_first(cmd, &address);
+	if (unlikely((length != dev->block_size) || (length > PAGE_SIZE))) {
+		PRINT_ERROR("Unexpected WRITE SAME data length %d (cmd %p)",
+			length, cmd);
+		if (length > 0)
+			scst_put_buf(cmd, address);
+		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_hardw_error));
+		goto out;
+	}
+
+	for (i = 0; i < length; i++) {
+		if (address[i] != 0) {
+			zero = false;
+			break;
+		}
+	}
+
+	if (!zero) {
+		page = vdisk_ws_alloc_page(address, length);
+		if (page == NULL) {
+			scst_put_buf(cmd, address);
+			scst_set_busy(cmd);
+			goto out;
+		}
+	}
+	scst_put_buf(cmd, address);
+
+	spin_lock(&virt_dev->ws_stats_lock);
+	virt_dev->ws_active_cmds++;
+	virt_dev->ws_left_bytes += left;
+	spin_unlock(&virt_dev->ws_stats_lock);
+
+	while (left > 0) {
+		int len;
+
+		if (unlikely(test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags))) {
+			TRACE_MGMT_DBG("WRITE SAME cmd %p aborted", cmd);
+			break;
+		}
+
+		if (zero) {
+			len = min_t(loff_t, left, VDISK_WS_MAX_ZERO_SIZE);
+			rc = vdisk_ws_zero(virt_dev, loff, len, gfp_mask);
+			if (rc == 0) {
+				zeroed += len;
+				goto next;
+			} else if (rc != -EOPNOTSUPP)
+				goto out_err;
+			TRACE_DBG("Zeroing offload not supported by device %s",
+				virt_dev->name);
+			zero = false;
+		}
+
+		if (page == NULL) {
+			page = vdisk_ws_alloc_page(NULL, length);
+			if (page == NULL) {
+				rc = -ENOMEM;
+				goto out_err;
+			}
+		}
+
+		len = min_t(loff_t, left, VDISK_WS_MAX_WRITE_SIZE);
+		if (virt_dev->blockio)
+			rc = blockio_ws_write(virt_dev, page, loff, len,
+				gfp_mask);
+		else {
+			if (iv == NULL) {
+				iv = kmalloc(sizeof(*iv) * UIO_MAXIOV,
+					GFP_KERNEL);
+				if (iv == NULL) {
+					rc = -ENOMEM;
+					goto out_err;
+				}
+			}
+			rc = fileio_ws_write(virt_dev, iv, page, loff, len);
+		}
+		if (rc != 0)
+			goto out_err;
+
+next:
+		loff += len;
+		left -= len;
+		done += len;
+
+		spin_lock(&virt_dev->ws_stats_lock);
+		virt_dev->ws_left_bytes -= len;
+		spin_unlock(&virt_dev->ws_stats_lock);
+	}
+
+	if ((zeroed != 0) && virt_dev->blockio && virt_dev->wt_flag)
+		vdisk_blockio_flush(virt_dev->bdev, gfp_mask, false);
+
+out_stats:
+	spin_lock(&virt_dev->ws_stats_lock);
+	virt_dev->ws_cmds++;
+	virt_dev->ws_bytes += done;
+	virt_dev->ws_zeroed_bytes += zeroed;
+	virt_dev->ws_time_ms += jiffies_to_msecs(jiffies - start_time);
+	virt_dev->ws_active_cmds--;
+	virt_dev->ws_left_bytes -= left;
+	spin_unlock(&virt_dev->ws_stats_lock);
+
+	kfree(iv);
+	if (page != NULL)
+		__free_page(page);
+
+out:
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
+
+out_err:
+	PRINT_ERROR("WRITE SAME at %lld of device %s failed: %d",
+		(long long)loff, virt_dev->name, rc);
+	if ((rc == -ENOMEM) || (rc == -EAGAIN))
+		scst_set_busy(cmd);
+	else
+		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_write_error));
+	goto out_stats;
+}
+
 static enum compl_status_e fileio_exec_verify(struct vdisk_cmd_params *p)
 {
 	struct scst_cmd *cmd = p->cmd;
@@ -4100,6 +5866,10 @@ static void vdisk_report_registering(const struct scst_vdisk_dev *virt_dev)
 		i += snprintf(&buf[i], sizeof(buf) - i, "%sZERO_COPY",
 			(j == i) ? "(" : ", ");
 
+	if (virt_dev->async)
+		i += snprintf(&buf[i], sizeof(buf) - i, "%sASYNC",
+			(j == i) ? "(" : ", ");
+
 	if (j == i)
 		PRINT_INFO("%s", buf);
 	else
@@ -4171,6 +5941,16 @@ static int vdev_create(struct scst_dev_type *devt,
 	}
 
 	spin_lock_init(&virt_dev->flags_lock);
+	spin_lock_init(&virt_dev->caw_lock);
+	spin_lock_init(&virt_dev->ws_stats_lock);
+	INIT_LIST_HEAD(&virt_dev->caw_ranges_list);
+	spin_lock_init(&virt_dev->bg_unmap_lock);
+	INIT_LIST_HEAD(&virt_dev->bg_unmap_list);
+	atomic_long_set(&virt_dev->bg_unmap_blocks, 0);
+	init_waitqueue_head(&virt_dev->bg_unmap_waitQ);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+	INIT_DELAYED_WORK(&virt_dev->bg_unmap_work, vdisk_bg_unmap_work_fn);
+#endif
 	virt_dev->vdev_devt = devt;
 
 	virt_dev->rd_only = DEF_RD_ONLY;
@@ -4319,14 +6099,8 @@ static int vdev_parse_add_dev_params(struct scst_vdisk_dev *virt_dev,
 			virt_dev->nv_cache = val;
 			TRACE_DBG("NON-VOLATILE CACHE %d", virt_dev->nv_cache);
 		} else if (!strcasecmp("o_direct", p)) {
-#if 0
 			virt_dev->o_direct_flag = val;
 			TRACE_DBG("O_DIRECT %d", virt_dev->o_direct_flag);
-#else
-			PRINT_INFO("O_DIRECT flag doesn't currently"
-				" work, ignoring it, use fileio_tgt "
-				"in O_DIRECT mode instead (device %s)", virt_dev->name);
-#endif
 		} else if (!strcasecmp("read_only", p)) {
 			virt_dev->rd_only = val;
 			TRACE_DBG("READ ONLY %d", virt_dev->rd_only);
@@ -4343,6 +6117,34 @@ static int vdev_parse_add_dev_params(struct scst_vdisk_dev *virt_dev,
 				virt_dev->thin_provisioned);
 		} else if (!strcasecmp("zero_copy", p)) {
 			virt_dev->zero_copy = !!val;
+		} else if (!strcasecmp("async", p)) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+			virt_dev->async = !!val;
+			TRACE_DBG("ASYNC %d", virt_dev->async);
+#else
+			PRINT_INFO("Async mode requires kernel 2.6.36 or "
+				"later, ignoring it (device %s)",
+				virt_dev->name);
+#endif
+		} else if (!strcasecmp("bg_unmap", p)) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+			virt_dev->bg_unmap = !!val;
+			TRACE_DBG("BACKGROUND UNMAP %d", virt_dev->bg_unmap);
+#else
+			PRINT_INFO("Background UNMAP requires kernel 2.6.36 "
+				"or later, ignoring it (device %s)",
+				virt_dev->name);
+#endif
+		} else if (!strcasecmp("bg_unmap_rate_mb", p)) {
+			if (val > INT_MAX) {
+				PRINT_ERROR("Too big bg_unmap_rate_mb %ld "
+					"(device %s)", val, virt_dev->name);
+				res = -EINVAL;
+				goto out;
+			}
+			virt_dev->bg_unmap_rate_mb = val;
+			TRACE_DBG("BACKGROUND UNMAP RATE %d MB/s",
+				virt_dev->bg_unmap_rate_mb);
 		} else if (!strcasecmp("blocksize", p)) {
 			virt_dev->blk_shift = scst_calc_block_shift(val);
 			if (virt_dev->blk_shift < 9) {
@@ -4431,7 +6233,8 @@ static int vdev_blockio_add_device(const char *device_name, char *params)
 	int res = 0;
 	const char *allowed_params[] = { "filename", "read_only", "write_through",
 					 "removable", "blocksize", "nv_cache",
-					 "rotational", "thin_provisioned", NULL };
+					 "rotational", "thin_provisioned",
+					 "bg_unmap", "bg_unmap_rate_mb", NULL };
 	struct scst_vdisk_dev *virt_dev;
 
 	TRACE_ENTRY();
@@ -5182,138 +6985,470 @@ out_put:
 static ssize_t vdev_sysfs_filename_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf)
 {
-	int res = 0;
+	int res = 0;
+	struct scst_device *dev;
+	struct scst_sysfs_work_item *work;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	res = scst_alloc_sysfs_work(vdev_sysfs_process_get_filename,
+					true, &work);
+	if (res != 0)
+		goto out;
+
+	work->dev = dev;
+
+	kobject_get(&dev->dev_kobj);
+
+	scst_sysfs_work_get(work);
+
+	res = scst_sysfs_queue_wait_work(work);
+	if (res != 0)
+		goto out_put;
+
+	res = snprintf(buf, SCST_SYSFS_BLOCK_SIZE, "%s\n", work->res_buf);
+
+out_put:
+	scst_sysfs_work_put(work);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static int vdisk_sysfs_process_resync_size_store(
+	struct scst_sysfs_work_item *work)
+{
+	int res;
+	struct scst_device *dev = work->dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	/* It's safe, since we taken dev_kobj and dh_priv NULLed in attach() */
+	virt_dev = dev->dh_priv;
+
+	res = vdisk_resync_size(virt_dev);
+
+	kobject_put(&dev->dev_kobj);
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static ssize_t vdisk_sysfs_resync_size_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	struct scst_device *dev;
+	struct scst_sysfs_work_item *work;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	res = scst_alloc_sysfs_work(vdisk_sysfs_process_resync_size_store,
+					false, &work);
+	if (res != 0)
+		goto out;
+
+	work->dev = dev;
+
+	kobject_get(&dev->dev_kobj);
+
+	res = scst_sysfs_queue_wait_work(work);
+	if (res == 0)
+		res = count;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static ssize_t vdev_sysfs_t10_dev_id_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res, i;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	write_lock(&vdisk_serial_rwlock);
+
+	if ((count > sizeof(virt_dev->t10_dev_id)) ||
+	    ((count == sizeof(virt_dev->t10_dev_id)) &&
+	     (buf[count-1] != '\n'))) {
+		PRINT_ERROR("T10 device id is too long (max %zd "
+			"characters)", sizeof(virt_dev->t10_dev_id)-1);
+		res = -EINVAL;
+		goto out_unlock;
+	}
+
+	memset(virt_dev->t10_dev_id, 0, sizeof(virt_dev->t10_dev_id));
+	memcpy(virt_dev->t10_dev_id, buf, count);
+
+	i = 0;
+	while (i < sizeof(virt_dev->t10_dev_id)) {
+		if (virt_dev->t10_dev_id[i] == '\n') {
+			virt_dev->t10_dev_id[i] = '\0';
+			break;
+		}
+		i++;
+	}
+
+	virt_dev->t10_dev_id_set = 1;
+
+	res = count;
+
+	PRINT_INFO("T10 device id for device %s changed to %s", virt_dev->name,
+		virt_dev->t10_dev_id);
+
+out_unlock:
+	write_unlock(&vdisk_serial_rwlock);
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static ssize_t vdev_sysfs_t10_dev_id_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	read_lock(&vdisk_serial_rwlock);
+	pos = sprintf(buf, "%s\n%s", virt_dev->t10_dev_id,
+		virt_dev->t10_dev_id_set ? SCST_SYSFS_KEY_MARK "\n" : "");
+	read_unlock(&vdisk_serial_rwlock);
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdev_sysfs_usn_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res, i;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	write_lock(&vdisk_serial_rwlock);
+
+	if ((count > sizeof(virt_dev->usn)) ||
+	    ((count == sizeof(virt_dev->usn)) &&
+	     (buf[count-1] != '\n'))) {
+		PRINT_ERROR("USN is too long (max %zd "
+			"characters)", sizeof(virt_dev->usn)-1);
+		res = -EINVAL;
+		goto out_unlock;
+	}
+
+	memset(virt_dev->usn, 0, sizeof(virt_dev->usn));
+	memcpy(virt_dev->usn, buf, count);
+
+	i = 0;
+	while (i < sizeof(virt_dev->usn)) {
+		if (virt_dev->usn[i] == '\n') {
+			virt_dev->usn[i] = '\0';
+			break;
+		}
+		i++;
+	}
+
+	virt_dev->usn_set = 1;
+
+	res = count;
+
+	PRINT_INFO("USN for device %s changed to %s", virt_dev->name,
+		virt_dev->usn);
+
+out_unlock:
+	write_unlock(&vdisk_serial_rwlock);
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static ssize_t vdev_sysfs_usn_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	read_lock(&vdisk_serial_rwlock);
+	pos = sprintf(buf, "%s\n%s", virt_dev->usn,
+		virt_dev->usn_set ? SCST_SYSFS_KEY_MARK "\n" : "");
+	read_unlock(&vdisk_serial_rwlock);
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdev_zero_copy_show(struct kobject *kobj,
+					struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	pos = sprintf(buf, "%d\n%s", virt_dev->zero_copy,
+		      virt_dev->zero_copy ? SCST_SYSFS_KEY_MARK "\n" : "");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdev_zero_copy_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	unsigned long val;
 	struct scst_device *dev;
-	struct scst_sysfs_work_item *work;
+	struct scst_vdisk_dev *virt_dev;
 
 	TRACE_ENTRY();
 
 	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
 
-	res = scst_alloc_sysfs_work(vdev_sysfs_process_get_filename,
-					true, &work);
-	if (res != 0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+	res = kstrtoul(buf, 0, &val);
+#else
+	res = strict_strtoul(buf, 0, &val);
+#endif
+	if (res != 0) {
+		PRINT_ERROR("strtoul() for %s failed: %d (device %s)",
+			    buf, res, virt_dev->name);
 		goto out;
+	}
 
-	work->dev = dev;
-
-	kobject_get(&dev->dev_kobj);
-
-	scst_sysfs_work_get(work);
+	if (val && virt_dev->o_direct_flag) {
+		PRINT_ERROR("%s: combining zero_copy with o_direct is not"
+			    " supported", virt_dev->name);
+		res = -EINVAL;
+		goto out;
+	}
 
-	res = scst_sysfs_queue_wait_work(work);
-	if (res != 0)
-		goto out_put;
+	/* Cmds parsed before take the old value, which is fine */
+	spin_lock(&virt_dev->flags_lock);
+	virt_dev->zero_copy = !!val;
+	spin_unlock(&virt_dev->flags_lock);
 
-	res = snprintf(buf, SCST_SYSFS_BLOCK_SIZE, "%s\n", work->res_buf);
+	PRINT_INFO("zero_copy for device %s changed to %d", virt_dev->name,
+		virt_dev->zero_copy);
 
-out_put:
-	scst_sysfs_work_put(work);
+	res = count;
 
 out:
 	TRACE_EXIT_RES(res);
 	return res;
 }
 
-static int vdisk_sysfs_process_resync_size_store(
-	struct scst_sysfs_work_item *work)
+static ssize_t vdisk_sysfs_async_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
 {
-	int res;
-	struct scst_device *dev = work->dev;
+	int pos = 0;
+	struct scst_device *dev;
 	struct scst_vdisk_dev *virt_dev;
 
 	TRACE_ENTRY();
 
-	/* It's safe, since we taken dev_kobj and dh_priv NULLed in attach() */
+	dev = container_of(kobj, struct scst_device, dev_kobj);
 	virt_dev = dev->dh_priv;
 
-	res = vdisk_resync_size(virt_dev);
-
-	kobject_put(&dev->dev_kobj);
+	pos = sprintf(buf, "%d\n%s", virt_dev->async ? 1 : 0,
+		(virt_dev->async == DEF_ASYNC) ? "" :
+			SCST_SYSFS_KEY_MARK "\n");
 
-	TRACE_EXIT_RES(res);
-	return res;
+	TRACE_EXIT_RES(pos);
+	return pos;
 }
 
-static ssize_t vdisk_sysfs_resync_size_store(struct kobject *kobj,
+static ssize_t vdisk_sysfs_async_store(struct kobject *kobj,
 	struct kobj_attribute *attr, const char *buf, size_t count)
 {
 	int res;
+	unsigned long val;
 	struct scst_device *dev;
-	struct scst_sysfs_work_item *work;
+	struct scst_vdisk_dev *virt_dev;
 
 	TRACE_ENTRY();
 
 	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
 
-	res = scst_alloc_sysfs_work(vdisk_sysfs_process_resync_size_store,
-					false, &work);
-	if (res != 0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+	res = kstrtoul(buf, 0, &val);
+#else
+	res = strict_strtoul(buf, 0, &val);
+#endif
+	if (res != 0) {
+		PRINT_ERROR("strtoul() for %s failed: %d (device %s)",
+			    buf, res, virt_dev->name);
 		goto out;
+	}
 
-	work->dev = dev;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+	spin_lock(&virt_dev->flags_lock);
+	virt_dev->async = !!val;
+	spin_unlock(&virt_dev->flags_lock);
 
-	kobject_get(&dev->dev_kobj);
+	/*
+	 * Cmds dispatched before take the old mode. Wait for the queued
+	 * ones, so after we return none of them is executed asynchronously
+	 * anymore, if async was cleared.
+	 */
+	flush_workqueue(vdisk_async_wq);
 
-	res = scst_sysfs_queue_wait_work(work);
-	if (res == 0)
-		res = count;
+	PRINT_INFO("async for device %s changed to %d", virt_dev->name,
+		virt_dev->async);
+#else
+	if (val) {
+		PRINT_ERROR("Async mode requires kernel 2.6.36 or later "
+			"(device %s)", virt_dev->name);
+		res = -EINVAL;
+		goto out;
+	}
+#endif
+
+	res = count;
 
 out:
 	TRACE_EXIT_RES(res);
 	return res;
 }
 
-static ssize_t vdev_sysfs_t10_dev_id_store(struct kobject *kobj,
-	struct kobj_attribute *attr, const char *buf, size_t count)
+static ssize_t vdisk_sysfs_cache_bypass_hits_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
 {
-	int res, i;
 	struct scst_device *dev;
 	struct scst_vdisk_dev *virt_dev;
 
-	TRACE_ENTRY();
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	return sprintf(buf, "%ld\n",
+		atomic_long_read(&virt_dev->cache_bypass_hits));
+}
+
+static ssize_t vdisk_sysfs_cache_bypass_misses_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
 
 	dev = container_of(kobj, struct scst_device, dev_kobj);
 	virt_dev = dev->dh_priv;
 
-	write_lock(&vdisk_serial_rwlock);
+	return sprintf(buf, "%ld\n",
+		atomic_long_read(&virt_dev->cache_bypass_misses));
+}
 
-	if ((count > sizeof(virt_dev->t10_dev_id)) ||
-	    ((count == sizeof(virt_dev->t10_dev_id)) &&
-	     (buf[count-1] != '\n'))) {
-		PRINT_ERROR("T10 device id is too long (max %zd "
-			"characters)", sizeof(virt_dev->t10_dev_id)-1);
-		res = -EINVAL;
-		goto out_unlock;
-	}
+static ssize_t vdisk_sysfs_caw_miscompares_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
 
-	memset(virt_dev->t10_dev_id, 0, sizeof(virt_dev->t10_dev_id));
-	memcpy(virt_dev->t10_dev_id, buf, count);
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
 
-	i = 0;
-	while (i < sizeof(virt_dev->t10_dev_id)) {
-		if (virt_dev->t10_dev_id[i] == '\n') {
-			virt_dev->t10_dev_id[i] = '\0';
-			break;
-		}
-		i++;
-	}
+	return sprintf(buf, "%ld\n",
+		atomic_long_read(&virt_dev->caw_miscompares));
+}
 
-	virt_dev->t10_dev_id_set = 1;
+static ssize_t vdisk_sysfs_ws_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+	uint64_t cmds, bytes, zeroed_bytes, time_ms, left_bytes, kbps = 0;
+	int active_cmds, pos;
 
-	res = count;
+	TRACE_ENTRY();
 
-	PRINT_INFO("T10 device id for device %s changed to %s", virt_dev->name,
-		virt_dev->t10_dev_id);
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
 
-out_unlock:
-	write_unlock(&vdisk_serial_rwlock);
+	spin_lock(&virt_dev->ws_stats_lock);
+	cmds = virt_dev->ws_cmds;
+	bytes = virt_dev->ws_bytes;
+	zeroed_bytes = virt_dev->ws_zeroed_bytes;
+	time_ms = virt_dev->ws_time_ms;
+	active_cmds = virt_dev->ws_active_cmds;
+	left_bytes = virt_dev->ws_left_bytes;
+	spin_unlock(&virt_dev->ws_stats_lock);
+
+	if (time_ms != 0) {
+		kbps = bytes * 1000 / 1024;
+		do_div(kbps, time_ms);
+	}
+
+	pos = sprintf(buf, "WRITE SAME commands %llu\n"
+		"Written bytes %llu\nZeroed bytes %llu\nTime %llu ms\n"
+		"Throughput %llu KB/s\nActive commands %d\n"
+		"Left to write bytes %llu\n",
+		(unsigned long long)cmds, (unsigned long long)bytes,
+		(unsigned long long)zeroed_bytes, (unsigned long long)time_ms,
+		(unsigned long long)kbps, active_cmds,
+		(unsigned long long)left_bytes);
 
-	TRACE_EXIT_RES(res);
-	return res;
+	TRACE_EXIT_RES(pos);
+	return pos;
 }
 
-static ssize_t vdev_sysfs_t10_dev_id_show(struct kobject *kobj,
+static ssize_t vdisk_sysfs_ws_stats_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	/* Progress of the active commands isn't reset */
+	spin_lock(&virt_dev->ws_stats_lock);
+	virt_dev->ws_cmds = 0;
+	virt_dev->ws_bytes = 0;
+	virt_dev->ws_zeroed_bytes = 0;
+	virt_dev->ws_time_ms = 0;
+	spin_unlock(&virt_dev->ws_stats_lock);
+
+	TRACE_EXIT_RES(count);
+	return count;
+}
+
+static ssize_t vdisk_sysfs_bg_unmap_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf)
 {
 	int pos = 0;
@@ -5325,19 +7460,18 @@ static ssize_t vdev_sysfs_t10_dev_id_show(struct kobject *kobj,
 	dev = container_of(kobj, struct scst_device, dev_kobj);
 	virt_dev = dev->dh_priv;
 
-	read_lock(&vdisk_serial_rwlock);
-	pos = sprintf(buf, "%s\n%s", virt_dev->t10_dev_id,
-		virt_dev->t10_dev_id_set ? SCST_SYSFS_KEY_MARK "\n" : "");
-	read_unlock(&vdisk_serial_rwlock);
+	pos = sprintf(buf, "%d\n%s", virt_dev->bg_unmap,
+		      virt_dev->bg_unmap ? SCST_SYSFS_KEY_MARK "\n" : "");
 
 	TRACE_EXIT_RES(pos);
 	return pos;
 }
 
-static ssize_t vdev_sysfs_usn_store(struct kobject *kobj,
+static ssize_t vdisk_sysfs_bg_unmap_store(struct kobject *kobj,
 	struct kobj_attribute *attr, const char *buf, size_t count)
 {
-	int res, i;
+	int res;
+	unsigned long val;
 	struct scst_device *dev;
 	struct scst_vdisk_dev *virt_dev;
 
@@ -5346,44 +7480,42 @@ static ssize_t vdev_sysfs_usn_store(struct kobject *kobj,
 	dev = container_of(kobj, struct scst_device, dev_kobj);
 	virt_dev = dev->dh_priv;
 
-	write_lock(&vdisk_serial_rwlock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+	res = kstrtoul(buf, 0, &val);
+#else
+	res = strict_strtoul(buf, 0, &val);
+#endif
+	if (res != 0) {
+		PRINT_ERROR("strtoul() for %s failed: %d (device %s)",
+			    buf, res, virt_dev->name);
+		goto out;
+	}
 
-	if ((count > sizeof(virt_dev->usn)) ||
-	    ((count == sizeof(virt_dev->usn)) &&
-	     (buf[count-1] != '\n'))) {
-		PRINT_ERROR("USN is too long (max %zd "
-			"characters)", sizeof(virt_dev->usn)-1);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
+	if (val) {
+		PRINT_ERROR("Background UNMAP requires kernel 2.6.36 or "
+			"later (device %s)", virt_dev->name);
 		res = -EINVAL;
-		goto out_unlock;
+		goto out;
 	}
+#endif
 
-	memset(virt_dev->usn, 0, sizeof(virt_dev->usn));
-	memcpy(virt_dev->usn, buf, count);
-
-	i = 0;
-	while (i < sizeof(virt_dev->usn)) {
-		if (virt_dev->usn[i] == '\n') {
-			virt_dev->usn[i] = '\0';
-			break;
-		}
-		i++;
-	}
+	/* Already queued ranges are discarded anyway */
+	spin_lock(&virt_dev->flags_lock);
+	virt_dev->bg_unmap = !!val;
+	spin_unlock(&virt_dev->flags_lock);
 
-	virt_dev->usn_set = 1;
+	PRINT_INFO("bg_unmap for device %s changed to %d", virt_dev->name,
+		virt_dev->bg_unmap);
 
 	res = count;
 
-	PRINT_INFO("USN for device %s changed to %s", virt_dev->name,
-		virt_dev->usn);
-
-out_unlock:
-	write_unlock(&vdisk_serial_rwlock);
-
+out:
 	TRACE_EXIT_RES(res);
 	return res;
 }
 
-static ssize_t vdev_sysfs_usn_show(struct kobject *kobj,
+static ssize_t vdisk_sysfs_bg_unmap_rate_mb_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf)
 {
 	int pos = 0;
@@ -5395,19 +7527,18 @@ static ssize_t vdev_sysfs_usn_show(struct kobject *kobj,
 	dev = container_of(kobj, struct scst_device, dev_kobj);
 	virt_dev = dev->dh_priv;
 
-	read_lock(&vdisk_serial_rwlock);
-	pos = sprintf(buf, "%s\n%s", virt_dev->usn,
-		virt_dev->usn_set ? SCST_SYSFS_KEY_MARK "\n" : "");
-	read_unlock(&vdisk_serial_rwlock);
+	pos = sprintf(buf, "%d\n%s", virt_dev->bg_unmap_rate_mb,
+		      virt_dev->bg_unmap_rate_mb ? SCST_SYSFS_KEY_MARK "\n" : "");
 
 	TRACE_EXIT_RES(pos);
 	return pos;
 }
 
-static ssize_t vdev_zero_copy_show(struct kobject *kobj,
-					struct kobj_attribute *attr, char *buf)
+static ssize_t vdisk_sysfs_bg_unmap_rate_mb_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
 {
-	int pos = 0;
+	int res;
+	unsigned long val;
 	struct scst_device *dev;
 	struct scst_vdisk_dev *virt_dev;
 
@@ -5416,11 +7547,48 @@ static ssize_t vdev_zero_copy_show(struct kobject *kobj,
 	dev = container_of(kobj, struct scst_device, dev_kobj);
 	virt_dev = dev->dh_priv;
 
-	pos = sprintf(buf, "%d\n%s", virt_dev->zero_copy,
-		      virt_dev->zero_copy ? SCST_SYSFS_KEY_MARK "\n" : "");
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+	res = kstrtoul(buf, 0, &val);
+#else
+	res = strict_strtoul(buf, 0, &val);
+#endif
+	if (res != 0) {
+		PRINT_ERROR("strtoul() for %s failed: %d (device %s)",
+			    buf, res, virt_dev->name);
+		goto out;
+	}
 
-	TRACE_EXIT_RES(pos);
-	return pos;
+	if (val > INT_MAX) {
+		PRINT_ERROR("Too big bg_unmap_rate_mb %ld (device %s)", val,
+			virt_dev->name);
+		res = -EINVAL;
+		goto out;
+	}
+
+	/* Picked up by the background UNMAP work on its next run */
+	virt_dev->bg_unmap_rate_mb = val;
+
+	PRINT_INFO("bg_unmap_rate_mb for device %s changed to %d",
+		virt_dev->name, virt_dev->bg_unmap_rate_mb);
+
+	res = count;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static ssize_t vdisk_sysfs_bg_unmap_pending_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	return sprintf(buf, "%ld\n",
+		atomic_long_read(&virt_dev->bg_unmap_blocks));
 }
 
 #else /* CONFIG_SCST_PROC */
@@ -5631,15 +7799,8 @@ static int vdisk_write_proc(char *buffer, char **start, off_t offset,
 				TRACE_DBG("%s", "READ_ONLY");
 			} else if (!strncmp("O_DIRECT", p, 8)) {
 				p += 8;
-#if 0
-
 				virt_dev->o_direct_flag = 1;
 				TRACE_DBG("%s", "O_DIRECT");
-#else
-				PRINT_INFO("%s flag doesn't currently"
-					" work, ignoring it, use fileio_tgt "
-					"in O_DIRECT mode instead", "O_DIRECT");
-#endif
 			} else if (!strncmp("NULLIO", p, 6)) {
 				p += 6;
 				virt_dev->nullio = 1;
@@ -6164,9 +8325,37 @@ static int __init init_scst_vdisk_driver(void)
 	vdisk_file_devtype.threads_num = num_threads;
 	vcdrom_devtype.threads_num = num_threads;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+	if (async_max_active < 1) {
+		PRINT_ERROR("async_max_active can not be less than 1, use "
+			"default %d", DEF_ASYNC_MAX_ACTIVE);
+		async_max_active = DEF_ASYNC_MAX_ACTIVE;
+	}
+
+	vdisk_async_wq = alloc_workqueue("vdisk_async", WQ_UNBOUND,
+				async_max_active);
+	if (vdisk_async_wq == NULL) {
+		res = -ENOMEM;
+		goto out_free_slab;
+	}
+
+	if (unmap_max_active < 1) {
+		PRINT_ERROR("unmap_max_active can not be less than 1, use "
+			"default %d", DEF_UNMAP_MAX_ACTIVE);
+		unmap_max_active = DEF_UNMAP_MAX_ACTIVE;
+	}
+
+	vdisk_unmap_wq = alloc_workqueue("vdisk_unmap", WQ_UNBOUND,
+				unmap_max_active);
+	if (vdisk_unmap_wq == NULL) {
+		res = -ENOMEM;
+		goto out_free_async_wq;
+	}
+#endif
+
 	res = init_scst_vdisk(&vdisk_file_devtype);
 	if (res != 0)
-		goto out_free_slab;
+		goto out_free_wq;
 
 	res = init_scst_vdisk(&vdisk_blk_devtype);
 	if (res != 0)
@@ -6192,6 +8381,14 @@ out_free_blk:
 out_free_vdisk:
 	exit_scst_vdisk(&vdisk_file_devtype);
 
+out_free_wq:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+	destroy_workqueue(vdisk_unmap_wq);
+
+out_free_async_wq:
+	destroy_workqueue(vdisk_async_wq);
+#endif
+
 out_free_slab:
 	kmem_cache_destroy(blockio_work_cachep);
 
@@ -6207,6 +8404,10 @@ static void __exit exit_scst_vdisk_driver(void)
 	exit_scst_vdisk(&vdisk_file_devtype);
 	exit_scst_vdisk(&vcdrom_devtype);
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+	destroy_workqueue(vdisk_unmap_wq);
+	destroy_workqueue(vdisk_async_wq);
+#endif
 	kmem_cache_destroy(blockio_work_cachep);
 	kmem_cache_destroy(vdisk_cmd_param_cachep);
 }
@@ -150,6 +150,8 @@ static int get_cdb_info_write_same10(struct scst_cmd *cmd,
 	const struct scst_sdbops *sdbops);
 static int get_cdb_info_write_same16(struct scst_cmd *cmd,
 	const struct scst_sdbops *sdbops);
+static int get_cdb_info_compare_and_write(struct scst_cmd *cmd,
+	const struct scst_sdbops *sdbops);
 static int get_cdb_info_apt(struct scst_cmd *cmd,
 	const struct scst_sdbops *sdbops);
 static int get_cdb_info_min(struct scst_cmd *cmd,
@@ -209,7 +211,15 @@ struct scst_sdbops {
 	int (*get_cdb_info)(struct scst_cmd *cmd, const struct scst_sdbops *sdbops);
 };
 
-static int scst_scsi_op_list[256];
+/* Number of device types, for which devkey[] in scst_sdbops is defined */
+#define SCST_CDB_DEV_TYPES	16
+
+/*
+ * Pre-resolved entries of scst_scsi_op_table, indexed by device type and
+ * opcode, or NULL, if the opcode is not supported for that device type.
+ * Filled once in scst_scsi_op_list_init().
+ */
+static const struct scst_sdbops *scst_scsi_op_list[SCST_CDB_DEV_TYPES][256];
 
 #define FLAG_NONE 0
 
@@ -961,6 +971,13 @@ static const struct scst_sdbops scst_scsi_op_table[] = {
 	 .info_lba_off = 2, .info_lba_len = 8,
 	 .info_len_off = 10, .info_len_len = 4,
 	 .get_cdb_info = get_cdb_info_lba_8_len_4},
+	{.ops = 0x89, .devkey = "O               ",
+	 .info_op_name = "COMPARE AND WRITE",
+	 .info_data_direction = SCST_DATA_WRITE,
+	 .info_op_flags = SCST_TRANSFER_LEN_TYPE_FIXED|SCST_WRITE_MEDIUM,
+	 .info_lba_off = 2, .info_lba_len = 8,
+	 .info_len_off = 13, .info_len_len = 1,
+	 .get_cdb_info = get_cdb_info_compare_and_write},
 	{.ops = 0x8A, .devkey = "O   OO O        ",
 	 .info_op_name = "WRITE(16)",
 	 .info_data_direction = SCST_DATA_WRITE,
@@ -3303,6 +3320,7 @@ int scst_alloc_tgt(struct scst_tgt_template *tgtt, struct scst_tgt **tgt)
 	init_timer(&t->retry_timer);
 	t->retry_timer.data = (unsigned long)t;
 	t->retry_timer.function = scst_tgt_retry_timer_fn;
+	t->tgt_numa_node = NUMA_NO_NODE;
 
 #ifdef CONFIG_SCST_PROC
 	res = gen_relative_target_port_id(&t->rel_tgt_id);
@@ -3390,6 +3408,7 @@ int scst_alloc_device(gfp_t gfp_mask, struct scst_device **out_dev)
 	scst_init_order_data(&dev->dev_order_data);
 
 	scst_init_threads(&dev->dev_cmd_threads);
+	dev->dev_numa_node = NUMA_NO_NODE;
 
 	*out_dev = dev;
 
@@ -3960,6 +3979,7 @@ int scst_tgt_dev_setup_threads(struct scst_tgt_dev *tgt_dev)
 		struct scst_tgt_dev *shared_io_tgt_dev;
 
 		scst_init_threads(&tgt_dev->tgt_dev_cmd_threads);
+		tgt_dev->tgt_dev_cmd_threads.numa_node = dev->dev_numa_node;
 
 		tgt_dev->active_cmd_threads = &tgt_dev->tgt_dev_cmd_threads;
 
@@ -3986,6 +4006,7 @@ int scst_tgt_dev_setup_threads(struct scst_tgt_dev *tgt_dev)
 	case SCST_THREADS_POOL_SHARED:
 	{
 		tgt_dev->active_cmd_threads = &dev->dev_cmd_threads;
+		tgt_dev->active_cmd_threads->numa_node = dev->dev_numa_node;
 
 		res = scst_add_threads(tgt_dev->active_cmd_threads, dev, NULL,
 			tgt_dev->sess->tgt->tgtt->threads_num);
@@ -4183,6 +4204,8 @@ static int scst_alloc_add_tgt_dev(struct scst_session *sess,
 
 	head = &sess->sess_tgt_dev_list[SESS_TGT_DEV_LIST_HASH_FN(tgt_dev->lun)];
 	list_add_tail(&tgt_dev->sess_tgt_dev_list_entry, head);
+	if (tgt_dev->lun < SESS_TGT_DEV_LUN_MAP_SIZE)
+		sess->sess_tgt_dev_lun_map[tgt_dev->lun] = tgt_dev;
 
 	*out_tgt_dev = tgt_dev;
 
@@ -4259,6 +4282,8 @@ static void scst_free_tgt_dev(struct scst_tgt_dev *tgt_dev)
 	spin_unlock_bh(&dev->dev_lock);
 
 	list_del(&tgt_dev->sess_tgt_dev_list_entry);
+	if (tgt_dev->lun < SESS_TGT_DEV_LUN_MAP_SIZE)
+		tgt_dev->sess->sess_tgt_dev_lun_map[tgt_dev->lun] = NULL;
 
 	scst_tgt_dev_sysfs_del(tgt_dev);
 
@@ -4465,9 +4490,15 @@ int scst_acg_remove_name(struct scst_acg *acg, const char *name, bool reassign)
 }
 #endif
 
-static struct scst_cmd *scst_create_prepare_internal_cmd(
-	struct scst_cmd *orig_cmd, const uint8_t *cdb,
-	unsigned int cdb_len, enum scst_cmd_queue_type queue_type)
+/*
+ * Creates internal command for orig_cmd's session, which will be sent to
+ * tgt_dev. If tgt_dev isn't orig_cmd's tgt_dev, the caller must make sure
+ * it stays alive, e.g., by it being in the same session as orig_cmd.
+ */
+static struct scst_cmd *__scst_create_prepare_internal_cmd(
+	struct scst_cmd *orig_cmd, struct scst_tgt_dev *tgt_dev,
+	const uint8_t *cdb, unsigned int cdb_len,
+	enum scst_cmd_queue_type queue_type)
 {
 	struct scst_cmd *res;
 	int rc;
@@ -4480,17 +4511,26 @@ static struct scst_cmd *scst_create_prepare_internal_cmd(
 	if (res == NULL)
 		goto out;
 
-	res->cmd_threads = orig_cmd->cmd_threads;
 	res->sess = orig_cmd->sess;
 	res->atomic = scst_cmd_atomic(orig_cmd);
 	res->internal = 1;
 	res->tgtt = orig_cmd->tgtt;
 	res->tgt = orig_cmd->tgt;
-	res->dev = orig_cmd->dev;
-	res->devt = orig_cmd->devt;
-	res->tgt_dev = orig_cmd->tgt_dev;
-	res->cur_order_data = orig_cmd->tgt_dev->curr_order_data;
-	res->lun = orig_cmd->lun;
+	if (tgt_dev == orig_cmd->tgt_dev) {
+		res->cmd_threads = orig_cmd->cmd_threads;
+		res->dev = orig_cmd->dev;
+		res->devt = orig_cmd->devt;
+		res->lun = orig_cmd->lun;
+	} else {
+		res->cmd_threads = tgt_dev->active_cmd_threads;
+		res->dev = tgt_dev->dev;
+		res->devt = tgt_dev->dev->handler;
+		res->lun = tgt_dev->lun;
+		/* See scst_check_blocked_dev() */
+		res->internal_other_dev = (res->dev != orig_cmd->dev);
+	}
+	res->tgt_dev = tgt_dev;
+	res->cur_order_data = tgt_dev->curr_order_data;
 	res->queue_type = queue_type;
 	res->data_direction = SCST_DATA_UNKNOWN;
 
@@ -4523,6 +4563,14 @@ out:
 	return res;
 }
 
+static struct scst_cmd *scst_create_prepare_internal_cmd(
+	struct scst_cmd *orig_cmd, const uint8_t *cdb,
+	unsigned int cdb_len, enum scst_cmd_queue_type queue_type)
+{
+	return __scst_create_prepare_internal_cmd(orig_cmd, orig_cmd->tgt_dev,
+			cdb, cdb_len, queue_type);
+}
+
 int scst_prepare_request_sense(struct scst_cmd *orig_cmd)
 {
 	int res = 0;
@@ -4557,6 +4605,7 @@ int scst_prepare_request_sense(struct scst_cmd *orig_cmd)
 		"cmd list", rs_cmd);
 	spin_lock_irq(&rs_cmd->cmd_threads->cmd_list_lock);
 	list_add(&rs_cmd->cmd_list_entry, &rs_cmd->cmd_threads->active_cmd_list);
+	rs_cmd->cmd_threads->active_cmd_cnt++;
 	wake_up(&rs_cmd->cmd_threads->cmd_list_waitQ);
 	spin_unlock_irq(&rs_cmd->cmd_threads->cmd_list_lock);
 
@@ -4601,6 +4650,7 @@ static void scst_complete_request_sense(struct scst_cmd *req_cmd)
 		"cmd list", orig_cmd);
 	spin_lock_irq(&orig_cmd->cmd_threads->cmd_list_lock);
 	list_add(&orig_cmd->cmd_list_entry, &orig_cmd->cmd_threads->active_cmd_list);
+	orig_cmd->cmd_threads->active_cmd_cnt++;
 	wake_up(&orig_cmd->cmd_threads->cmd_list_waitQ);
 	spin_unlock_irq(&orig_cmd->cmd_threads->cmd_list_lock);
 
@@ -4718,6 +4768,7 @@ set_add:
 	TRACE_DBG("Adding WRITE(16) cmd %p to active cmd list", cmd);
 	spin_lock_irq(&cmd->cmd_threads->cmd_list_lock);
 	list_add_tail(&cmd->cmd_list_entry, &cmd->cmd_threads->active_cmd_list);
+	cmd->cmd_threads->active_cmd_cnt++;
 	spin_unlock_irq(&cmd->cmd_threads->cmd_list_lock);
 
 	res = 0;
@@ -4934,239 +4985,1552 @@ out_done:
 }
 EXPORT_SYMBOL_GPL(scst_write_same);
 
-int scst_finish_internal_cmd(struct scst_cmd *cmd)
-{
-	int res;
-	unsigned long flags;
+struct scst_xcopy_seg {
+	struct scst_tgt_dev *xs_src_tgt_dev;
+	struct scst_tgt_dev *xs_dst_tgt_dev;
+	int64_t xs_src_lba;
+	int64_t xs_dst_lba;
+	int xs_blocks;
+	int xs_left_to_write; /* in blocks */
 
-	TRACE_ENTRY();
+	/* Set if overlaps with one of the previous segments */
+	unsigned int xs_serial:1;
 
-	sBUG_ON(!cmd->internal);
+	/* Set if source and destination of this segment overlap */
+	unsigned int xs_self_overlap:1;
+};
 
-	if (scst_cmd_atomic(cmd)) {
-		TRACE_DBG("Rescheduling finished internal atomic cmd %p in a "
-			"thread context", cmd);
-		res = SCST_CMD_STATE_RES_NEED_THREAD;
-		goto out;
-	}
+struct scst_xcopy_priv {
+	struct scst_cmd *xp_orig_cmd;
 
-	spin_lock_irqsave(&cmd->sess->sess_list_lock, flags);
-	list_del(&cmd->sess_cmd_list_entry);
-	cmd->done = 1;
-	cmd->finished = 1;
-	spin_unlock_irqrestore(&cmd->sess->sess_list_lock, flags);
+	struct mutex xp_mutex;
 
-	if (unlikely(test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags))) {
-		scst_done_cmd_mgmt(cmd);
-		scst_finish_cmd_mgmt(cmd);
-	}
+	struct scst_xcopy_seg *xp_segs;
+	int xp_segs_cnt;
+	int xp_segs_done;
 
-	if (cmd->cdb[0] == REQUEST_SENSE)
-		scst_complete_request_sense(cmd);
-	else {
-		scst_i_finish_fn_t f = (void *) *((unsigned long long **)cmd->tgt_i_priv);
-		f(cmd);
-	}
+	int xp_cur_seg;
+	int xp_cur_offs; /* in blocks, inside xp_cur_seg */
 
-	__scst_cmd_put(cmd);
+	int xp_cur_in_flight;
 
-	res = SCST_CMD_STATE_RES_CONT_NEXT;
+	/* Set if no more commands should be sent */
+	unsigned int xp_stop:1;
 
-out:
-	TRACE_EXIT_HRES(res);
-	return res;
-}
+	uint8_t xp_list_id;
 
-static void scst_send_release(struct scst_device *dev)
-{
-	struct scsi_device *scsi_dev;
-	unsigned char cdb[6];
-	uint8_t sense[SCSI_SENSE_BUFFERSIZE];
-	int rc, i;
+	uint64_t xp_bytes_done;
+	unsigned long xp_start_time;
+};
 
-	TRACE_ENTRY();
+/* Single piece of data in flight, read from source, then written to dest */
+struct scst_xcopy_chunk {
+	/* Must be the first for scst_finish_internal_cmd()! */
+	scst_i_finish_fn_t xc_finish_fn;
 
-	if (dev->scsi_dev == NULL)
-		goto out;
+	struct scst_xcopy_priv *xc_xp;
+	struct scst_xcopy_seg *xc_seg;
 
-	scsi_dev = dev->scsi_dev;
+	int64_t xc_dst_lba;
+	int xc_blocks;
 
-	for (i = 0; i < 5; i++) {
-		memset(cdb, 0, sizeof(cdb));
-		cdb[0] = RELEASE;
-		cdb[1] = (scsi_dev->scsi_level <= SCSI_2) ?
-		    ((scsi_dev->lun << 5) & 0xe0) : 0;
+	struct scatterlist *xc_sg;
+	int xc_sg_cnt;
+	struct sgv_pool_obj *xc_sgv;
+	struct scst_mem_lim *xc_mem_lim;
+};
 
-		memset(sense, 0, sizeof(sense));
+static void scst_xcopy_read_finished(struct scst_cmd *cmd);
+static void scst_xcopy_write_finished(struct scst_cmd *cmd);
 
-		TRACE(TRACE_DEBUG | TRACE_SCSI, "%s", "Sending RELEASE req to "
-			"SCSI mid-level");
-		rc = scsi_execute(scsi_dev, cdb, SCST_DATA_NONE, NULL, 0,
-				sense, 15, 0, 0
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
-				, NULL
-#endif
-				);
-		TRACE_DBG("MODE_SENSE done: %x", rc);
+/* xp_mutex supposed to be locked */
+static bool scst_xcopy_check_stop(struct scst_xcopy_priv *xp)
+{
+	struct scst_cmd *xc_cmd = xp->xp_orig_cmd;
 
-		if (scsi_status_is_good(rc)) {
-			break;
-		} else {
-			PRINT_ERROR("RELEASE failed: %d", rc);
-			PRINT_BUFFER("RELEASE sense", sense, sizeof(sense));
-			scst_check_internal_sense(dev, rc, sense,
-				sizeof(sense));
-		}
+	if (unlikely(test_bit(SCST_CMD_ABORTED, &xc_cmd->cmd_flags)) ||
+	    unlikely(xc_cmd->completed)) {
+		TRACE_DBG("xcopy cmd %p aborted or completed (%d), aborting "
+			"further copy commands", xc_cmd, xc_cmd->completed);
+		xp->xp_stop = 1;
 	}
 
-out:
-	TRACE_EXIT();
-	return;
+	return xp->xp_stop;
 }
 
-/* scst_mutex supposed to be held */
-static void scst_clear_reservation(struct scst_tgt_dev *tgt_dev)
+/* xp_mutex supposed to be locked */
+static void scst_xcopy_set_error(struct scst_xcopy_priv *xp,
+	struct scst_cmd *cmd)
 {
-	struct scst_device *dev = tgt_dev->dev;
-	int release = 0;
+	struct scst_cmd *xc_cmd = xp->xp_orig_cmd;
+	int rc;
 
-	TRACE_ENTRY();
+	TRACE_DBG("Copy cmd %p (xcopy cmd %p) finished not successfully",
+		cmd, xc_cmd);
 
-	spin_lock_bh(&dev->dev_lock);
-	if (dev->dev_reserved &&
-	    !test_bit(SCST_TGT_DEV_RESERVED, &tgt_dev->tgt_dev_flags)) {
-		/* This is one who holds the reservation */
-		struct scst_tgt_dev *tgt_dev_tmp;
-		list_for_each_entry(tgt_dev_tmp, &dev->dev_tgt_dev_list,
-				    dev_tgt_dev_list_entry) {
-			clear_bit(SCST_TGT_DEV_RESERVED,
-				    &tgt_dev_tmp->tgt_dev_flags);
-		}
-		dev->dev_reserved = 0;
-		release = 1;
+	xp->xp_stop = 1;
+
+	if (cmd->status == 0) {
+		/* Aborted by TM on the copy target device */
+		scst_set_cmd_error(xc_cmd,
+			SCST_LOAD_SENSE(scst_sense_aborted_command));
+		goto out;
 	}
-	spin_unlock_bh(&dev->dev_lock);
 
-	if (release)
-		scst_send_release(dev);
+	if (cmd->status == SAM_STAT_CHECK_CONDITION)
+		rc = scst_set_cmd_error_sense(xc_cmd, cmd->sense,
+			cmd->sense_valid_len);
+	else {
+		sBUG_ON(cmd->sense != NULL);
+		rc = scst_set_cmd_error_status(xc_cmd, cmd->status);
+	}
+	if (rc != 0) {
+		/* Requeue possible UA */
+		if (scst_is_ua_sense(cmd->sense, cmd->sense_valid_len))
+			scst_requeue_ua(cmd, NULL, 0);
+	}
 
-	TRACE_EXIT();
+out:
 	return;
 }
 
-struct scst_session *scst_alloc_session(struct scst_tgt *tgt, gfp_t gfp_mask,
-	const char *initiator_name)
+static void scst_xcopy_queue_cmd(struct scst_cmd *cmd)
 {
-	struct scst_session *sess;
-	int i;
+	spin_lock_irq(&cmd->cmd_threads->cmd_list_lock);
+	list_add_tail(&cmd->cmd_list_entry, &cmd->cmd_threads->active_cmd_list);
+	cmd->cmd_threads->active_cmd_cnt++;
+	wake_up(&cmd->cmd_threads->cmd_list_waitQ);
+	spin_unlock_irq(&cmd->cmd_threads->cmd_list_lock);
+	return;
+}
+
+/* xp_mutex supposed to be locked */
+static int scst_xcopy_push_write(struct scst_xcopy_priv *xp,
+	struct scst_xcopy_chunk *chunk)
+{
+	struct scst_cmd *xc_cmd = xp->xp_orig_cmd;
+	struct scst_tgt_dev *tgt_dev = chunk->xc_seg->xs_dst_tgt_dev;
+	uint8_t write16_cdb[16];
+	struct scst_cmd *cmd;
+	int res;
 
 	TRACE_ENTRY();
 
-	sess = kmem_cache_zalloc(scst_sess_cachep, gfp_mask);
-	if (sess == NULL) {
-		PRINT_ERROR("%s", "Allocation of scst_session failed");
+	if (scst_xcopy_check_stop(xp)) {
+		res = -EPIPE;
 		goto out;
 	}
 
-	sess->init_phase = SCST_SESS_IPH_INITING;
-	sess->shut_phase = SCST_SESS_SPH_READY;
-	atomic_set(&sess->refcnt, 0);
-	for (i = 0; i < SESS_TGT_DEV_LIST_HASH_SIZE; i++) {
-		struct list_head *head = &sess->sess_tgt_dev_list[i];
-		INIT_LIST_HEAD(head);
+	memset(write16_cdb, 0, sizeof(write16_cdb));
+	write16_cdb[0] = WRITE_16;
+	put_unaligned_be64(chunk->xc_dst_lba, &write16_cdb[2]);
+	put_unaligned_be32(chunk->xc_blocks, &write16_cdb[10]);
+
+	cmd = __scst_create_prepare_internal_cmd(xc_cmd, tgt_dev, write16_cdb,
+		sizeof(write16_cdb), SCST_CMD_QUEUE_SIMPLE);
+	if (cmd == NULL) {
+		xp->xp_stop = 1;
+		scst_set_busy(xc_cmd);
+		res = -ENOMEM;
+		goto out;
 	}
-	spin_lock_init(&sess->sess_list_lock);
-	INIT_LIST_HEAD(&sess->sess_cmd_list);
-	sess->tgt = tgt;
-	INIT_LIST_HEAD(&sess->init_deferred_cmd_list);
-	INIT_LIST_HEAD(&sess->init_deferred_mcmd_list);
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20))
-	INIT_DELAYED_WORK(&sess->hw_pending_work,
-		(void (*)(struct work_struct *))scst_hw_pending_work_fn);
-#else
-	INIT_WORK(&sess->hw_pending_work, scst_hw_pending_work_fn, sess);
-#endif
 
-#ifdef CONFIG_SCST_MEASURE_LATENCY
-	spin_lock_init(&sess->lat_lock);
-#endif
+	cmd->expected_data_direction = SCST_DATA_WRITE;
+	cmd->expected_transfer_len = chunk->xc_blocks <<
+					tgt_dev->dev->block_shift;
+	cmd->expected_values_set = 1;
 
-	sess->initiator_name = kstrdup(initiator_name, gfp_mask);
-	if (sess->initiator_name == NULL) {
-		PRINT_ERROR("%s", "Unable to dup sess->initiator_name");
-		goto out_free;
-	}
+	chunk->xc_finish_fn = scst_xcopy_write_finished;
+	cmd->tgt_i_priv = chunk;
 
-out:
-	TRACE_EXIT();
-	return sess;
+	cmd->tgt_i_sg = chunk->xc_sg;
+	cmd->tgt_i_sg_cnt = chunk->xc_sg_cnt;
+	cmd->tgt_i_data_buf_alloced = 1;
 
-out_free:
-	kmem_cache_free(scst_sess_cachep, sess);
-	sess = NULL;
-	goto out;
+	TRACE_DBG("Adding WRITE(16) cmd %p (xcopy cmd %p) to active cmd list",
+		cmd, xc_cmd);
+	scst_xcopy_queue_cmd(cmd);
+
+	res = 0;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
 }
 
-void scst_free_session(struct scst_session *sess)
+/* xp_mutex supposed to be locked */
+static int scst_xcopy_push_read(struct scst_xcopy_priv *xp)
 {
+	struct scst_cmd *xc_cmd = xp->xp_orig_cmd;
+	struct scst_xcopy_seg *seg = &xp->xp_segs[xp->xp_cur_seg];
+	struct scst_tgt_dev *tgt_dev = seg->xs_src_tgt_dev;
+	struct scst_device *dev = tgt_dev->dev;
+	struct scst_xcopy_chunk *chunk;
+	uint8_t read16_cdb[16];
+	struct scst_cmd *cmd;
+	int res, blocks, len;
+
 	TRACE_ENTRY();
 
-	mutex_lock(&scst_mutex);
+	if (scst_xcopy_check_stop(xp)) {
+		res = -EPIPE;
+		goto out;
+	}
 
-	scst_sess_free_tgt_devs(sess);
+	blocks = min_t(int, seg->xs_blocks - xp->xp_cur_offs,
+			SCST_MAX_EACH_INTERNAL_IO_SIZE >> dev->block_shift);
+	len = blocks << dev->block_shift;
 
-	TRACE_DBG("Removing sess %p from the list", sess);
-	list_del(&sess->sess_list_entry);
+	chunk = kzalloc(sizeof(*chunk), GFP_KERNEL);
+	if (chunk == NULL) {
+		PRINT_ERROR("Unable to allocate xcopy chunk (size %zd)",
+			sizeof(*chunk));
+		res = -ENOMEM;
+		goto out_busy;
+	}
 
-	TRACE_DBG("Removing session %p from acg %s", sess, sess->acg->acg_name);
-	list_del(&sess->acg_sess_list_entry);
+	chunk->xc_finish_fn = scst_xcopy_read_finished;
+	chunk->xc_xp = xp;
+	chunk->xc_seg = seg;
+	chunk->xc_dst_lba = seg->xs_dst_lba + xp->xp_cur_offs;
+	chunk->xc_blocks = blocks;
+	chunk->xc_mem_lim = &dev->dev_mem_lim;
 
-	mutex_unlock(&scst_mutex);
+	chunk->xc_sg = sgv_pool_alloc(tgt_dev->pool, len, GFP_KERNEL, 0,
+			&chunk->xc_sg_cnt, &chunk->xc_sgv, chunk->xc_mem_lim,
+			NULL);
+	if (chunk->xc_sg == NULL) {
+		PRINT_ERROR("Unable to alloc sg for %d blocks", blocks);
+		res = -ENOMEM;
+		goto out_free_chunk;
+	}
 
-#ifndef CONFIG_SCST_PROC
-	scst_sess_sysfs_del(sess);
-#endif
-	if (sess->unreg_done_fn) {
-		TRACE_DBG("Calling unreg_done_fn(%p)", sess);
-		sess->unreg_done_fn(sess);
-		TRACE_DBG("%s", "unreg_done_fn() returned");
+	memset(read16_cdb, 0, sizeof(read16_cdb));
+	read16_cdb[0] = READ_16;
+	put_unaligned_be64(seg->xs_src_lba + xp->xp_cur_offs, &read16_cdb[2]);
+	put_unaligned_be32(blocks, &read16_cdb[10]);
+
+	cmd = __scst_create_prepare_internal_cmd(xc_cmd, tgt_dev, read16_cdb,
+		sizeof(read16_cdb), SCST_CMD_QUEUE_SIMPLE);
+	if (cmd == NULL) {
+		res = -ENOMEM;
+		goto out_free_sg;
 	}
 
-	mutex_lock(&scst_mutex);
+	cmd->expected_data_direction = SCST_DATA_READ;
+	cmd->expected_transfer_len = len;
+	cmd->expected_values_set = 1;
 
-	list_del(&sess->sysfs_sess_list_entry);
+	cmd->tgt_i_priv = chunk;
 
-	/* Called under lock to protect from too early tgt release */
-	wake_up_all(&sess->tgt->unreg_waitQ);
+	cmd->tgt_i_sg = chunk->xc_sg;
+	cmd->tgt_i_sg_cnt = chunk->xc_sg_cnt;
+	cmd->tgt_i_data_buf_alloced = 1;
 
-	/*
-	 * NOTE: do not dereference the sess->tgt pointer after scst_mutex
-	 * has been unlocked, because it can be already dead!!
-	 */
-	mutex_unlock(&scst_mutex);
+	xp->xp_cur_offs += blocks;
+	if (xp->xp_cur_offs == seg->xs_blocks) {
+		xp->xp_cur_seg++;
+		xp->xp_cur_offs = 0;
+	}
+	xp->xp_cur_in_flight++;
 
-	kfree(sess->transport_id);
-	kfree(sess->initiator_name);
-	if (sess->sess_name != sess->initiator_name)
-		kfree(sess->sess_name);
+	TRACE_DBG("Adding READ(16) cmd %p (xcopy cmd %p) to active cmd list",
+		cmd, xc_cmd);
+	scst_xcopy_queue_cmd(cmd);
 
-	kmem_cache_free(scst_sess_cachep, sess);
+	res = 0;
 
-	TRACE_EXIT();
-	return;
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_free_sg:
+	sgv_pool_free(chunk->xc_sgv, chunk->xc_mem_lim);
+
+out_free_chunk:
+	kfree(chunk);
+
+out_busy:
+	xp->xp_stop = 1;
+	scst_set_busy(xc_cmd);
+	goto out;
 }
 
-void scst_free_session_callback(struct scst_session *sess)
+/*
+ * Sends as many READs as allowed. Segments overlapping with previous ones
+ * are started only after all previous data written, so the copy is done
+ * in the segments order. xp_mutex supposed to be locked.
+ *
+ * Returns true, if the copy finished.
+ */
+static bool scst_xcopy_gen_reads(struct scst_xcopy_priv *xp)
 {
-	struct completion *c;
-
 	TRACE_ENTRY();
 
-	TRACE_DBG("Freeing session %p", sess);
+	while (!xp->xp_stop && (xp->xp_cur_seg < xp->xp_segs_cnt)) {
+		struct scst_xcopy_seg *seg = &xp->xp_segs[xp->xp_cur_seg];
+		int max_in_flight = SCST_MAX_IN_FLIGHT_INTERNAL_COMMANDS;
 
-	cancel_delayed_work_sync(&sess->hw_pending_work);
+		if (seg->xs_serial && (xp->xp_cur_offs == 0) &&
+		    (xp->xp_cur_in_flight != 0))
+			break;
 
-	c = sess->shutdown_compl;
+		if (seg->xs_self_overlap)
+			max_in_flight = 1;
+
+		if (xp->xp_cur_in_flight >= max_in_flight)
+			break;
+
+		if (scst_xcopy_push_read(xp) != 0)
+			break;
+	}
+
+	TRACE_EXIT();
+	return xp->xp_cur_in_flight == 0;
+}
+
+static void scst_xcopy_finished(struct scst_xcopy_priv *xp)
+{
+	struct scst_cmd *xc_cmd = xp->xp_orig_cmd;
+	struct scst_tgt_dev *tgt_dev = xc_cmd->tgt_dev;
+	struct scst_device *dev = xc_cmd->dev;
+
+	TRACE_ENTRY();
+
+	TRACE_DBG("xcopy cmd %p finished with status %d (%lld bytes copied)",
+		xc_cmd, xc_cmd->status, (long long)xp->xp_bytes_done);
+
+	sBUG_ON(xp->xp_cur_in_flight != 0);
+
+	spin_lock_bh(&dev->dev_lock);
+	dev->xcopy_cmds++;
+	dev->xcopy_bytes += xp->xp_bytes_done;
+	dev->xcopy_time_ms += jiffies_to_msecs(jiffies - xp->xp_start_time);
+	spin_unlock_bh(&dev->dev_lock);
+
+	spin_lock_bh(&tgt_dev->tgt_dev_lock);
+	tgt_dev->xcopy_last_valid = 1;
+	tgt_dev->xcopy_last_list_id = xp->xp_list_id;
+	/* Completed without or with errors */
+	tgt_dev->xcopy_last_status = (!xp->xp_stop && (xc_cmd->status == 0)) ?
+					1 : 2;
+	tgt_dev->xcopy_last_segs_done = xp->xp_segs_done;
+	tgt_dev->xcopy_last_bytes = xp->xp_bytes_done;
+	spin_unlock_bh(&tgt_dev->tgt_dev_lock);
+
+	kfree(xp->xp_segs);
+	kfree(xp);
+
+	xc_cmd->completed = 1; /* for success */
+	xc_cmd->scst_cmd_done(xc_cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_THREAD);
+
+	TRACE_EXIT();
+	return;
+}
+
+/* xp_mutex supposed to be locked */
+static void scst_xcopy_free_chunk(struct scst_xcopy_priv *xp,
+	struct scst_xcopy_chunk *chunk)
+{
+	sgv_pool_free(chunk->xc_sgv, chunk->xc_mem_lim);
+	kfree(chunk);
+	xp->xp_cur_in_flight--;
+	return;
+}
+
+/* Must be called in a thread context and no locks */
+static void scst_xcopy_read_finished(struct scst_cmd *cmd)
+{
+	struct scst_xcopy_chunk *chunk = cmd->tgt_i_priv;
+	struct scst_xcopy_priv *xp = chunk->xc_xp;
+	bool finished = false;
+
+	TRACE_ENTRY();
+
+	TRACE_DBG("Read cmd %p finished (xcopy cmd %p, in flight %d)", cmd,
+		xp->xp_orig_cmd, xp->xp_cur_in_flight);
+
+	cmd->sg = NULL;
+	cmd->sg_cnt = 0;
+
+	mutex_lock(&xp->xp_mutex);
+
+	if ((cmd->status != 0) ||
+	    unlikely(test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags))) {
+		scst_xcopy_set_error(xp, cmd);
+		goto out_free;
+	}
+
+	if (scst_xcopy_push_write(xp, chunk) != 0)
+		goto out_free;
+
+out_unlock:
+	mutex_unlock(&xp->xp_mutex);
+
+	if (finished)
+		scst_xcopy_finished(xp);
+
+	TRACE_EXIT();
+	return;
+
+out_free:
+	scst_xcopy_free_chunk(xp, chunk);
+	finished = scst_xcopy_gen_reads(xp);
+	goto out_unlock;
+}
+
+/* Must be called in a thread context and no locks */
+static void scst_xcopy_write_finished(struct scst_cmd *cmd)
+{
+	struct scst_xcopy_chunk *chunk = cmd->tgt_i_priv;
+	struct scst_xcopy_priv *xp = chunk->xc_xp;
+	struct scst_xcopy_seg *seg = chunk->xc_seg;
+	bool finished;
+
+	TRACE_ENTRY();
+
+	TRACE_DBG("Write cmd %p finished (xcopy cmd %p, in flight %d)", cmd,
+		xp->xp_orig_cmd, xp->xp_cur_in_flight);
+
+	cmd->sg = NULL;
+	cmd->sg_cnt = 0;
+
+	mutex_lock(&xp->xp_mutex);
+
+	if ((cmd->status != 0) ||
+	    unlikely(test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags)))
+		scst_xcopy_set_error(xp, cmd);
+	else {
+		struct scst_device *src_dev = seg->xs_src_tgt_dev->dev;
+		struct scst_device *dst_dev = seg->xs_dst_tgt_dev->dev;
+		int len = chunk->xc_blocks << dst_dev->block_shift;
+
+		xp->xp_bytes_done += len;
+		seg->xs_left_to_write -= chunk->xc_blocks;
+		if (seg->xs_left_to_write == 0)
+			xp->xp_segs_done++;
+
+		spin_lock_bh(&src_dev->dev_lock);
+		src_dev->xcopy_read_bytes += len;
+		spin_unlock_bh(&src_dev->dev_lock);
+
+		spin_lock_bh(&dst_dev->dev_lock);
+		dst_dev->xcopy_written_bytes += len;
+		spin_unlock_bh(&dst_dev->dev_lock);
+	}
+
+	scst_xcopy_free_chunk(xp, chunk);
+	finished = scst_xcopy_gen_reads(xp);
+
+	mutex_unlock(&xp->xp_mutex);
+
+	if (finished)
+		scst_xcopy_finished(xp);
+
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Finds tgt_dev in cmd's session for the device identified by CSCD
+ * designation descriptor desc. Returns NULL, if no device or more than one
+ * device matches, since copy_id_match() callbacks might compare only part
+ * of the devices' identifiers. The session's tgt_devs can't change, because
+ * cmd holds the activity counter, so no locks needed.
+ */
+static struct scst_tgt_dev *scst_xcopy_find_tgt_dev(struct scst_cmd *cmd,
+	const uint8_t *desc)
+{
+	struct scst_session *sess = cmd->sess;
+	struct scst_tgt_dev *res = NULL;
+	int i;
+
+	for (i = 0; i < SESS_TGT_DEV_LIST_HASH_SIZE; i++) {
+		struct list_head *head = &sess->sess_tgt_dev_list[i];
+		struct scst_tgt_dev *tgt_dev;
+
+		list_for_each_entry(tgt_dev, head, sess_tgt_dev_list_entry) {
+			struct scst_device *dev = tgt_dev->dev;
+
+			if ((dev->type != TYPE_DISK) ||
+			    (dev->handler->copy_id_match == NULL))
+				continue;
+			if (!dev->handler->copy_id_match(dev, desc))
+				continue;
+			if (res == NULL) {
+				res = tgt_dev;
+				continue;
+			}
+			/* The same device can be mapped to several LUNs */
+			if (res->dev != dev) {
+				PRINT_WARNING("CSCD descriptor matches more "
+					"than one device (%s and %s, initiator "
+					"%s)", res->dev->virt_name,
+					dev->virt_name, sess->initiator_name);
+				res = NULL;
+				goto out;
+			}
+		}
+	}
+
+out:
+	return res;
+}
+
+/*
+ * Internal commands skip the reservation checks, see
+ * __scst_check_local_events(), so check here, if cmd's initiator is
+ * allowed to read from or write to tgt_dev.
+ */
+static bool scst_xcopy_tgt_dev_allowed(struct scst_tgt_dev *tgt_dev,
+	bool write)
+{
+	if (unlikely(test_bit(SCST_TGT_DEV_RESERVED, &tgt_dev->tgt_dev_flags)))
+		return false;
+
+	/* Same as op_flags of READ(16) and WRITE(16) for PR purposes */
+	return scst_pr_is_tgt_dev_allowed(tgt_dev,
+			write ? 0 : SCST_WRITE_EXCL_ALLOWED);
+}
+
+static bool scst_xcopy_ranges_overlap(struct scst_tgt_dev *tgt_dev1,
+	int64_t lba1, int blocks1, struct scst_tgt_dev *tgt_dev2, int64_t lba2,
+	int blocks2)
+{
+	return (tgt_dev1->dev == tgt_dev2->dev) && (lba1 < lba2 + blocks2) &&
+	       (lba2 < lba1 + blocks1);
+}
+
+/* Returns true, if seg can't be copied concurrently with prev */
+static bool scst_xcopy_segs_overlap(const struct scst_xcopy_seg *seg,
+	const struct scst_xcopy_seg *prev)
+{
+	/* Write after read, write after write and read after write */
+	return scst_xcopy_ranges_overlap(seg->xs_dst_tgt_dev, seg->xs_dst_lba,
+			seg->xs_blocks, prev->xs_src_tgt_dev, prev->xs_src_lba,
+			prev->xs_blocks) ||
+	       scst_xcopy_ranges_overlap(seg->xs_dst_tgt_dev, seg->xs_dst_lba,
+			seg->xs_blocks, prev->xs_dst_tgt_dev, prev->xs_dst_lba,
+			prev->xs_blocks) ||
+	       scst_xcopy_ranges_overlap(seg->xs_src_tgt_dev, seg->xs_src_lba,
+			seg->xs_blocks, prev->xs_dst_tgt_dev, prev->xs_dst_lba,
+			prev->xs_blocks);
+}
+
+/*
+ * Parses EXTENDED COPY (LID1) parameter list in buf. Only Identification
+ * CSCD descriptors (0xE4) of block devices and block device to block device
+ * segment descriptors (0x02) supported. On success returns 0, on error sets
+ * sense in cmd and returns negative error code.
+ */
+static int scst_xcopy_parse(struct scst_cmd *cmd, struct scst_xcopy_priv *xp,
+	const uint8_t *buf, int length)
+{
+	struct scst_tgt_dev *tgt_devs[SCST_XCOPY_MAX_TGT_DESCR_CNT];
+	int res = -EINVAL, tgt_len, seg_len, tgt_cnt, i, offs, end;
+
+	TRACE_ENTRY();
+
+	if (length < 16) {
+		PRINT_ERROR("Too small EXTENDED COPY parameter list (len %d)",
+			length);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_parameter_list_length_invalid));
+		goto out;
+	}
+
+	xp->xp_list_id = buf[0];
+
+	tgt_len = get_unaligned_be16(&buf[2]);
+	seg_len = get_unaligned_be32(&buf[8]);
+
+	if (get_unaligned_be32(&buf[12]) != 0) {
+		TRACE_DBG("%s", "Inline data not supported");
+		scst_set_invalid_field_in_parm_list(cmd, 12, 0);
+		goto out;
+	}
+
+	if ((tgt_len % 32) != 0) {
+		scst_set_invalid_field_in_parm_list(cmd, 2, 0);
+		goto out;
+	}
+
+	tgt_cnt = tgt_len / 32;
+	if (tgt_cnt > SCST_XCOPY_MAX_TGT_DESCR_CNT) {
+		TRACE_DBG("Too many CSCD descriptors (%d)", tgt_cnt);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_too_many_tgt_descr));
+		goto out;
+	}
+
+	if ((seg_len < 0) || (seg_len > length - 16 - tgt_len)) {
+		PRINT_ERROR("EXTENDED COPY descriptors (CSCD len %d, segment "
+			"len %d) don't fit in parameter list (len %d)",
+			tgt_len, seg_len, length);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_parameter_list_length_invalid));
+		goto out;
+	}
+
+	for (i = 0, offs = 16; i < tgt_cnt; i++, offs += 32) {
+		const uint8_t *d = &buf[offs];
+		int block_size;
+
+		if (d[0] != 0xE4) {
+			TRACE_DBG("Unsupported CSCD descriptor type %x", d[0]);
+			scst_set_cmd_error(cmd,
+			    SCST_LOAD_SENSE(scst_sense_unsupported_tgt_descr_type));
+			goto out;
+		}
+
+		/* NUL bit or not a block device */
+		if ((d[1] & 0x3F) != TYPE_DISK) {
+			scst_set_invalid_field_in_parm_list(cmd, offs + 1, 0);
+			goto out;
+		}
+
+		if (d[7] > 20) {
+			scst_set_invalid_field_in_parm_list(cmd, offs + 7, 0);
+			goto out;
+		}
+
+		tgt_devs[i] = scst_xcopy_find_tgt_dev(cmd, &d[4]);
+		if (tgt_devs[i] == NULL) {
+			TRACE(TRACE_MINOR, "Copy target device for CSCD "
+				"descriptor %d not found (initiator %s)", i,
+				cmd->sess->initiator_name);
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_copy_tgt_not_reachable));
+			goto out;
+		}
+
+		block_size = (d[29] << 16) | (d[30] << 8) | d[31];
+		if (block_size != tgt_devs[i]->dev->block_size) {
+			TRACE_DBG("Wrong CSCD %d block size %d (expected %d)",
+				i, block_size, tgt_devs[i]->dev->block_size);
+			scst_set_invalid_field_in_parm_list(cmd, offs + 29, 0);
+			goto out;
+		}
+	}
+
+	xp->xp_segs = kcalloc(max(seg_len / 28, 1), sizeof(*xp->xp_segs),
+				GFP_KERNEL);
+	if (xp->xp_segs == NULL) {
+		PRINT_ERROR("Unable to allocate %d xcopy segments",
+			seg_len / 28);
+		scst_set_busy(cmd);
+		res = -ENOMEM;
+		goto out;
+	}
+
+	end = offs + seg_len;
+	while (offs < end) {
+		const uint8_t *d = &buf[offs];
+		struct scst_xcopy_seg *seg = &xp->xp_segs[xp->xp_segs_cnt];
+		int src, dst;
+
+		if (end - offs < 4) {
+			scst_set_invalid_field_in_parm_list(cmd, offs, 0);
+			goto out;
+		}
+
+		if (d[0] != 0x02) {
+			TRACE_DBG("Unsupported segment descriptor type %x",
+				d[0]);
+			scst_set_cmd_error(cmd,
+			    SCST_LOAD_SENSE(scst_sense_unsupported_seg_descr_type));
+			goto out;
+		}
+
+		if ((get_unaligned_be16(&d[2]) != 0x18) || (end - offs < 28)) {
+			scst_set_invalid_field_in_parm_list(cmd, offs + 2, 0);
+			goto out;
+		}
+
+		if (xp->xp_segs_cnt + xp->xp_segs_done ==
+					SCST_XCOPY_MAX_SEG_DESCR_CNT) {
+			TRACE_DBG("%s", "Too many segment descriptors");
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_too_many_seg_descr));
+			goto out;
+		}
+
+		src = get_unaligned_be16(&d[4]);
+		dst = get_unaligned_be16(&d[6]);
+		if (src >= tgt_cnt) {
+			scst_set_invalid_field_in_parm_list(cmd, offs + 4, 0);
+			goto out;
+		}
+		if (dst >= tgt_cnt) {
+			scst_set_invalid_field_in_parm_list(cmd, offs + 6, 0);
+			goto out;
+		}
+
+		/* Different block sizes would need data reblocking */
+		if (tgt_devs[src]->dev->block_size !=
+					tgt_devs[dst]->dev->block_size) {
+			TRACE_DBG("Different source and destination block "
+				"sizes (segment at offs %d)", offs);
+			scst_set_invalid_field_in_parm_list(cmd, offs + 6, 0);
+			goto out;
+		}
+
+		seg->xs_src_tgt_dev = tgt_devs[src];
+		seg->xs_dst_tgt_dev = tgt_devs[dst];
+		seg->xs_blocks = get_unaligned_be16(&d[10]);
+		seg->xs_src_lba = get_unaligned_be64(&d[12]);
+		seg->xs_dst_lba = get_unaligned_be64(&d[20]);
+		seg->xs_left_to_write = seg->xs_blocks;
+
+		offs += 28;
+
+		if (seg->xs_blocks == 0) {
+			/* Nothing to copy, so it's already processed */
+			xp->xp_segs_done++;
+			continue;
+		}
+
+		if (((int64_t)seg->xs_blocks << tgt_devs[src]->dev->block_shift) >
+					SCST_XCOPY_MAX_SEG_LEN) {
+			scst_set_invalid_field_in_parm_list(cmd,
+				offs - 28 + 10, 0);
+			goto out;
+		}
+
+		seg->xs_self_overlap = scst_xcopy_ranges_overlap(
+			seg->xs_src_tgt_dev, seg->xs_src_lba, seg->xs_blocks,
+			seg->xs_dst_tgt_dev, seg->xs_dst_lba, seg->xs_blocks);
+
+		for (i = 0; i < xp->xp_segs_cnt; i++) {
+			if (scst_xcopy_segs_overlap(seg, &xp->xp_segs[i])) {
+				seg->xs_serial = 1;
+				break;
+			}
+		}
+
+		if (!scst_xcopy_tgt_dev_allowed(seg->xs_src_tgt_dev, false) ||
+		    !scst_xcopy_tgt_dev_allowed(seg->xs_dst_tgt_dev, true)) {
+			TRACE_PR("xcopy cmd %p segment %d rejected due to "
+				"reservation (initiator %s)", cmd,
+				xp->xp_segs_cnt, cmd->sess->initiator_name);
+			scst_set_cmd_error_status(cmd,
+				SAM_STAT_RESERVATION_CONFLICT);
+			goto out;
+		}
+
+		TRACE_DBG("xcopy cmd %p segment %d: %d blocks from lba %lld "
+			"(dev %s) to lba %lld (dev %s), serial %d, self "
+			"overlap %d", cmd, xp->xp_segs_cnt, seg->xs_blocks,
+			(long long)seg->xs_src_lba,
+			seg->xs_src_tgt_dev->dev->virt_name,
+			(long long)seg->xs_dst_lba,
+			seg->xs_dst_tgt_dev->dev->virt_name,
+			seg->xs_serial, seg->xs_self_overlap);
+
+		xp->xp_segs_cnt++;
+	}
+
+	res = 0;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * Library function to perform EXTENDED COPY (LID1) between any devices in
+ * cmd's session using internal READ(16) and WRITE(16) commands. Up to
+ * SCST_MAX_IN_FLIGHT_INTERNAL_COMMANDS chunks are copied simultaneously.
+ * Copy target devices are identified by the dev handlers' copy_id_match()
+ * callbacks. On exit, cmd always completed with sense set, if necessary.
+ */
+void scst_ext_copy(struct scst_cmd *cmd)
+{
+	struct scst_xcopy_priv *xp;
+	uint8_t *buf;
+	int length, rc;
+	bool finished;
+
+	TRACE_ENTRY();
+
+	if ((cmd->cdb[1] & 0x1F) != 0) {
+		TRACE_DBG("Unsupported EXTENDED COPY service action %x",
+			cmd->cdb[1] & 0x1F);
+		scst_set_invalid_field_in_cdb(cmd, 1,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
+		goto out_done;
+	}
+
+	if (cmd->data_len == 0) {
+		TRACE_DBG("%s", "Zero parameter list length, nothing to copy");
+		goto out_done;
+	}
+
+	xp = kzalloc(sizeof(*xp), GFP_KERNEL);
+	if (xp == NULL) {
+		PRINT_ERROR("Unable to allocate xcopy_priv (size %zd, cmd %p)",
+			sizeof(*xp), cmd);
+		goto out_busy;
+	}
+
+	mutex_init(&xp->xp_mutex);
+	xp->xp_orig_cmd = cmd;
+	xp->xp_start_time = jiffies;
+
+	length = scst_get_buf_full_sense(cmd, &buf);
+	if (unlikely(length <= 0))
+		goto out_free;
+
+	rc = scst_xcopy_parse(cmd, xp, buf, length);
+
+	scst_put_buf_full(cmd, buf);
+
+	if (rc != 0)
+		goto out_free;
+
+	mutex_lock(&xp->xp_mutex);
+	finished = scst_xcopy_gen_reads(xp);
+	mutex_unlock(&xp->xp_mutex);
+
+	if (finished)
+		scst_xcopy_finished(xp);
+
+out:
+	TRACE_EXIT();
+	return;
+
+out_free:
+	kfree(xp->xp_segs);
+	kfree(xp);
+	goto out_done;
+
+out_busy:
+	scst_set_busy(cmd);
+
+out_done:
+	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_THREAD);
+	goto out;
+}
+EXPORT_SYMBOL_GPL(scst_ext_copy);
+
+/*
+ * Library function to perform RECEIVE COPY RESULTS for EXTENDED COPY done
+ * by scst_ext_copy(). Supports COPY STATUS and OPERATING PARAMETERS service
+ * actions. The caller is responsible to complete cmd.
+ */
+void scst_receive_copy_results(struct scst_cmd *cmd)
+{
+	struct scst_tgt_dev *tgt_dev = cmd->tgt_dev;
+	uint8_t buffer[48];
+	uint8_t *address;
+	int length, resp_len;
+
+	TRACE_ENTRY();
+
+	memset(buffer, 0, sizeof(buffer));
+
+	switch (cmd->cdb[1] & 0x1F) {
+	case 0x00: /* COPY STATUS */
+	{
+		uint64_t bytes;
+
+		spin_lock_bh(&tgt_dev->tgt_dev_lock);
+		if (!tgt_dev->xcopy_last_valid ||
+		    (tgt_dev->xcopy_last_list_id != cmd->cdb[2])) {
+			spin_unlock_bh(&tgt_dev->tgt_dev_lock);
+			TRACE_DBG("Unknown list id %d", cmd->cdb[2]);
+			scst_set_invalid_field_in_cdb(cmd, 2, 0);
+			goto out;
+		}
+		buffer[4] = tgt_dev->xcopy_last_status;
+		put_unaligned_be16(tgt_dev->xcopy_last_segs_done, &buffer[5]);
+		bytes = tgt_dev->xcopy_last_bytes;
+		spin_unlock_bh(&tgt_dev->tgt_dev_lock);
+
+		if (bytes > 0xFFFFFFFFULL) {
+			buffer[7] = 1; /* KiB */
+			bytes >>= 10;
+		}
+		put_unaligned_be32(min_t(uint64_t, bytes, 0xFFFFFFFFULL),
+			&buffer[8]);
+
+		resp_len = 12;
+		break;
+	}
+	case 0x03: /* OPERATING PARAMETERS */
+		put_unaligned_be16(SCST_XCOPY_MAX_TGT_DESCR_CNT, &buffer[8]);
+		put_unaligned_be16(SCST_XCOPY_MAX_SEG_DESCR_CNT, &buffer[10]);
+		put_unaligned_be32(SCST_XCOPY_MAX_TGT_DESCR_CNT * 32 +
+			SCST_XCOPY_MAX_SEG_DESCR_CNT * 28, &buffer[12]);
+		put_unaligned_be32(SCST_XCOPY_MAX_SEG_LEN, &buffer[16]);
+		/* No inline, held or stream data */
+		put_unaligned_be16(1, &buffer[34]); /* total concurrent copies */
+		buffer[36] = 1; /* maximum concurrent copies */
+		buffer[37] = PAGE_SHIFT; /* data segment granularity */
+		buffer[43] = 2;	/* implemented descriptor list length */
+		buffer[44] = 0x02; /* block device to block device */
+		buffer[45] = 0xE4; /* identification CSCD */
+		resp_len = 46;
+		break;
+	default:
+		TRACE_DBG("Unsupported RECEIVE COPY RESULTS service action %x",
+			cmd->cdb[1] & 0x1F);
+		scst_set_invalid_field_in_cdb(cmd, 1,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 0);
+		goto out;
+	}
+
+	put_unaligned_be32(resp_len - 4, &buffer[0]);
+
+	length = scst_get_buf_full_sense(cmd, &address);
+	if (unlikely(length <= 0))
+		goto out;
+
+	length = min_t(int, length, resp_len);
+
+	memcpy(address, buffer, length);
+
+	scst_put_buf_full(cmd, address);
+
+	if (length < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, length);
+
+out:
+	TRACE_EXIT();
+	return;
+}
+EXPORT_SYMBOL_GPL(scst_receive_copy_results);
+
+struct scst_cmp_wr_priv {
+	/* Must be the first for scst_finish_internal_cmd()! */
+	scst_i_finish_fn_t cwr_finish_fn;
+
+	struct scst_cmd *cwr_orig_cmd;
+	scst_cmp_wr_done_fn_t cwr_done;
+
+	int cwr_len; /* in bytes, of each, compare and write, parts */
+
+	struct scatterlist *cwr_sg;
+	int cwr_sg_cnt;
+	struct sgv_pool_obj *cwr_sgv;
+};
+
+static void scst_cmp_wr_read_finished(struct scst_cmd *cmd);
+static void scst_cmp_wr_write_finished(struct scst_cmd *cmd);
+
+/*
+ * Compares (copy false) cmd's data starting from offset offs with len bytes
+ * in sg or copies (copy true) them into sg. Returns offset of the first
+ * miscompared byte or -1.
+ */
+static int scst_cmp_wr_data(struct scst_cmd *cmd, int offs,
+	struct scatterlist *sg, int len, bool copy)
+{
+	int res = -1, pos = 0, sg_i = 0, sg_offs = 0, length;
+	uint8_t *address;
+
+	TRACE_ENTRY();
+
+	length = scst_get_buf_first(cmd, &address);
+	while (length > 0) {
+		int i = max(offs - pos, 0);
+
+		while ((i < length) && (pos + i < offs + len)) {
+			uint8_t *p = (uint8_t *)page_address(sg_page(&sg[sg_i])) +
+					sg[sg_i].offset + sg_offs;
+			int n = min_t(int, min(length - i, offs + len - pos - i),
+					sg[sg_i].length - sg_offs);
+
+			if (copy)
+				memcpy(p, &address[i], n);
+			else if (memcmp(p, &address[i], n) != 0) {
+				int j = 0;
+
+				while (p[j] == address[i + j])
+					j++;
+				res = pos + i + j - offs;
+				scst_put_buf(cmd, address);
+				goto out;
+			}
+
+			i += n;
+			sg_offs += n;
+			if (sg_offs == sg[sg_i].length) {
+				sg_i++;
+				sg_offs = 0;
+			}
+		}
+
+		pos += length;
+		scst_put_buf(cmd, address);
+		if (pos >= offs + len)
+			break;
+		length = scst_get_buf_next(cmd, &address);
+	}
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* Sets MISCOMPARE sense with offset of the first miscompared byte */
+static void scst_cmp_wr_set_miscompare(struct scst_cmd *cmd, int offs)
+{
+	TRACE_ENTRY();
+
+	if (scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_miscompare_error)) != 0)
+		goto out;
+
+	if (cmd->sense == NULL)
+		goto out;
+
+	/* INFORMATION field */
+	if (scst_get_cmd_dev_d_sense(cmd)) {
+		uint8_t *d = &cmd->sense[cmd->sense_valid_len];
+
+		if (cmd->sense_buflen < cmd->sense_valid_len + 12)
+			goto out;
+		d[0] = 0; /* information descriptor */
+		d[1] = 0xA;
+		d[2] = 0x80; /* VALID */
+		put_unaligned_be64(offs, &d[4]);
+		cmd->sense[7] += 12;
+		cmd->sense_valid_len += 12;
+	} else {
+		cmd->sense[0] |= 0x80; /* VALID */
+		put_unaligned_be32(offs, &cmd->sense[3]);
+	}
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+static void scst_cmp_wr_finished(struct scst_cmp_wr_priv *cwrp)
+{
+	struct scst_cmd *cwr_cmd = cwrp->cwr_orig_cmd;
+	scst_cmp_wr_done_fn_t done = cwrp->cwr_done;
+
+	TRACE_ENTRY();
+
+	TRACE_DBG("cmp_wr cmd %p finished with status %d", cwr_cmd,
+		cwr_cmd->status);
+
+	sgv_pool_free(cwrp->cwr_sgv, &cwr_cmd->dev->dev_mem_lim);
+	kfree(cwrp);
+
+	if (done != NULL)
+		done(cwr_cmd);
+
+	cwr_cmd->completed = 1; /* for success */
+	cwr_cmd->scst_cmd_done(cwr_cmd, SCST_CMD_STATE_DEFAULT,
+		SCST_CONTEXT_THREAD);
+
+	TRACE_EXIT();
+	return;
+}
+
+/* Propagates error of internal cmd to cwr_cmd */
+static void scst_cmp_wr_set_error(struct scst_cmd *cwr_cmd,
+	struct scst_cmd *cmd)
+{
+	int rc;
+
+	TRACE_DBG("cmp_wr internal cmd %p (cmp_wr cmd %p) finished not "
+		"successfully", cmd, cwr_cmd);
+
+	if (cmd->status == 0) {
+		/* Aborted by TM */
+		scst_set_cmd_error(cwr_cmd,
+			SCST_LOAD_SENSE(scst_sense_aborted_command));
+		goto out;
+	}
+
+	if (cmd->status == SAM_STAT_CHECK_CONDITION)
+		rc = scst_set_cmd_error_sense(cwr_cmd, cmd->sense,
+			cmd->sense_valid_len);
+	else {
+		sBUG_ON(cmd->sense != NULL);
+		rc = scst_set_cmd_error_status(cwr_cmd, cmd->status);
+	}
+	if (rc != 0) {
+		/* Requeue possible UA */
+		if (scst_is_ua_sense(cmd->sense, cmd->sense_valid_len))
+			scst_requeue_ua(cmd, NULL, 0);
+	}
+
+out:
+	return;
+}
+
+static int scst_cmp_wr_push(struct scst_cmp_wr_priv *cwrp, bool write)
+{
+	struct scst_cmd *cwr_cmd = cwrp->cwr_orig_cmd;
+	uint8_t cdb[16];
+	struct scst_cmd *cmd;
+	int res;
+
+	TRACE_ENTRY();
+
+	if (unlikely(test_bit(SCST_CMD_ABORTED, &cwr_cmd->cmd_flags))) {
+		TRACE_MGMT_DBG("cmp_wr cmd %p aborted", cwr_cmd);
+		res = -EPIPE;
+		goto out;
+	}
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = write ? WRITE_16 : READ_16;
+	if (write)
+		cdb[1] = cwr_cmd->cdb[1] & 0x8; /* FUA */
+	put_unaligned_be64(cwr_cmd->lba, &cdb[2]);
+	put_unaligned_be32(cwrp->cwr_len >> cwr_cmd->dev->block_shift,
+		&cdb[10]);
+
+	cmd = scst_create_prepare_internal_cmd(cwr_cmd, cdb, sizeof(cdb),
+		SCST_CMD_QUEUE_SIMPLE);
+	if (cmd == NULL) {
+		scst_set_busy(cwr_cmd);
+		res = -ENOMEM;
+		goto out;
+	}
+
+	cmd->expected_data_direction = write ? SCST_DATA_WRITE :
+					       SCST_DATA_READ;
+	cmd->expected_transfer_len = cwrp->cwr_len;
+	cmd->expected_values_set = 1;
+
+	cwrp->cwr_finish_fn = write ? scst_cmp_wr_write_finished :
+				      scst_cmp_wr_read_finished;
+	cmd->tgt_i_priv = cwrp;
+
+	cmd->tgt_i_sg = cwrp->cwr_sg;
+	cmd->tgt_i_sg_cnt = cwrp->cwr_sg_cnt;
+	cmd->tgt_i_data_buf_alloced = 1;
+
+	TRACE_DBG("Adding %s cmd %p (cmp_wr cmd %p) to active cmd list",
+		write ? "WRITE(16)" : "READ(16)", cmd, cwr_cmd);
+	spin_lock_irq(&cmd->cmd_threads->cmd_list_lock);
+	list_add_tail(&cmd->cmd_list_entry, &cmd->cmd_threads->active_cmd_list);
+	cmd->cmd_threads->active_cmd_cnt++;
+	wake_up(&cmd->cmd_threads->cmd_list_waitQ);
+	spin_unlock_irq(&cmd->cmd_threads->cmd_list_lock);
+
+	res = 0;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* Must be called in a thread context and no locks */
+static void scst_cmp_wr_read_finished(struct scst_cmd *cmd)
+{
+	struct scst_cmp_wr_priv *cwrp = cmd->tgt_i_priv;
+	struct scst_cmd *cwr_cmd = cwrp->cwr_orig_cmd;
+	int offs;
+
+	TRACE_ENTRY();
+
+	cmd->sg = NULL;
+	cmd->sg_cnt = 0;
+
+	if ((cmd->status != 0) ||
+	    test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags)) {
+		scst_cmp_wr_set_error(cwr_cmd, cmd);
+		goto out_finished;
+	}
+
+	offs = scst_cmp_wr_data(cwr_cmd, 0, cwrp->cwr_sg, cwrp->cwr_len,
+			false);
+	if (offs >= 0) {
+		TRACE_DBG("cmp_wr cmd %p miscompare at offset %d", cwr_cmd,
+			offs);
+		scst_cmp_wr_set_miscompare(cwr_cmd, offs);
+		goto out_finished;
+	}
+
+	/* The read data aren't needed anymore, so reuse the buffer */
+	scst_cmp_wr_data(cwr_cmd, cwrp->cwr_len, cwrp->cwr_sg, cwrp->cwr_len,
+		true);
+
+	if (scst_cmp_wr_push(cwrp, true) != 0)
+		goto out_finished;
+
+out:
+	TRACE_EXIT();
+	return;
+
+out_finished:
+	scst_cmp_wr_finished(cwrp);
+	goto out;
+}
+
+/* Must be called in a thread context and no locks */
+static void scst_cmp_wr_write_finished(struct scst_cmd *cmd)
+{
+	struct scst_cmp_wr_priv *cwrp = cmd->tgt_i_priv;
+
+	TRACE_ENTRY();
+
+	cmd->sg = NULL;
+	cmd->sg_cnt = 0;
+
+	if ((cmd->status != 0) ||
+	    test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags))
+		scst_cmp_wr_set_error(cwrp->cwr_orig_cmd, cmd);
+
+	scst_cmp_wr_finished(cwrp);
+
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Library function to perform COMPARE AND WRITE in a generic manner using
+ * internal READ(16) and WRITE(16) commands. Atomicity is the caller's
+ * responsibility: no other COMPARE AND WRITE overlapping with cmd's LBA
+ * range should be started until done() called. Done() called in a thread
+ * context just before cmd completion. On exit, cmd always completed with
+ * sense set, if necessary.
+ */
+void scst_cmp_wr(struct scst_cmd *cmd, scst_cmp_wr_done_fn_t done)
+{
+	struct scst_cmp_wr_priv *cwrp;
+	int blocks = cmd->cdb[13];
+
+	TRACE_ENTRY();
+
+	if (unlikely(cmd->cdb[1] & 0xE0)) {
+		TRACE_DBG("%s", "WRPROTECT not supported");
+		scst_set_invalid_field_in_cdb(cmd, 1,
+			SCST_INVAL_FIELD_BIT_OFFS_VALID | 5);
+		goto out_done;
+	}
+
+	if (blocks == 0) {
+		TRACE_DBG("Zero blocks COMPARE AND WRITE (cmd %p)", cmd);
+		goto out_done;
+	}
+
+	if ((blocks << cmd->dev->block_shift) > SCST_MAX_CMP_WR_SIZE) {
+		TRACE_DBG("Too big COMPARE AND WRITE (%d blocks)", blocks);
+		scst_set_invalid_field_in_cdb(cmd, 13, 0);
+		goto out_done;
+	}
+
+	cwrp = kzalloc(sizeof(*cwrp), GFP_KERNEL);
+	if (cwrp == NULL) {
+		PRINT_ERROR("Unable to allocate cmp_wr_priv (size %zd, cmd %p)",
+			sizeof(*cwrp), cmd);
+		goto out_busy;
+	}
+
+	cwrp->cwr_orig_cmd = cmd;
+	cwrp->cwr_done = done;
+	cwrp->cwr_len = blocks << cmd->dev->block_shift;
+
+	cwrp->cwr_sg = sgv_pool_alloc(cmd->tgt_dev->pool, cwrp->cwr_len,
+			GFP_KERNEL, 0, &cwrp->cwr_sg_cnt, &cwrp->cwr_sgv,
+			&cmd->dev->dev_mem_lim, NULL);
+	if (cwrp->cwr_sg == NULL) {
+		PRINT_ERROR("Unable to alloc sg for %d blocks", blocks);
+		goto out_free;
+	}
+
+	if (scst_cmp_wr_push(cwrp, false) != 0)
+		scst_cmp_wr_finished(cwrp);
+
+out:
+	TRACE_EXIT();
+	return;
+
+out_free:
+	kfree(cwrp);
+
+out_busy:
+	scst_set_busy(cmd);
+
+out_done:
+	if (done != NULL)
+		done(cmd);
+	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_THREAD);
+	goto out;
+}
+EXPORT_SYMBOL_GPL(scst_cmp_wr);
+
+int scst_finish_internal_cmd(struct scst_cmd *cmd)
+{
+	int res;
+	unsigned long flags;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(!cmd->internal);
+
+	if (scst_cmd_atomic(cmd)) {
+		TRACE_DBG("Rescheduling finished internal atomic cmd %p in a "
+			"thread context", cmd);
+		res = SCST_CMD_STATE_RES_NEED_THREAD;
+		goto out;
+	}
+
+	spin_lock_irqsave(&cmd->sess->sess_list_lock, flags);
+	list_del(&cmd->sess_cmd_list_entry);
+	cmd->done = 1;
+	cmd->finished = 1;
+	spin_unlock_irqrestore(&cmd->sess->sess_list_lock, flags);
+
+	if (unlikely(test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags))) {
+		scst_done_cmd_mgmt(cmd);
+		scst_finish_cmd_mgmt(cmd);
+	}
+
+	if (cmd->cdb[0] == REQUEST_SENSE)
+		scst_complete_request_sense(cmd);
+	else {
+		scst_i_finish_fn_t f = (void *) *((unsigned long long **)cmd->tgt_i_priv);
+		f(cmd);
+	}
+
+	__scst_cmd_put(cmd);
+
+	res = SCST_CMD_STATE_RES_CONT_NEXT;
+
+out:
+	TRACE_EXIT_HRES(res);
+	return res;
+}
+
+static void scst_send_release(struct scst_device *dev)
+{
+	struct scsi_device *scsi_dev;
+	unsigned char cdb[6];
+	uint8_t sense[SCSI_SENSE_BUFFERSIZE];
+	int rc, i;
+
+	TRACE_ENTRY();
+
+	if (dev->scsi_dev == NULL)
+		goto out;
+
+	scsi_dev = dev->scsi_dev;
+
+	for (i = 0; i < 5; i++) {
+		memset(cdb, 0, sizeof(cdb));
+		cdb[0] = RELEASE;
+		cdb[1] = (scsi_dev->scsi_level <= SCSI_2) ?
+		    ((scsi_dev->lun << 5) & 0xe0) : 0;
+
+		memset(sense, 0, sizeof(sense));
+
+		TRACE(TRACE_DEBUG | TRACE_SCSI, "%s", "Sending RELEASE req to "
+			"SCSI mid-level");
+		rc = scsi_execute(scsi_dev, cdb, SCST_DATA_NONE, NULL, 0,
+				sense, 15, 0, 0
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+				, NULL
+#endif
+				);
+		TRACE_DBG("MODE_SENSE done: %x", rc);
+
+		if (scsi_status_is_good(rc)) {
+			break;
+		} else {
+			PRINT_ERROR("RELEASE failed: %d", rc);
+			PRINT_BUFFER("RELEASE sense", sense, sizeof(sense));
+			scst_check_internal_sense(dev, rc, sense,
+				sizeof(sense));
+		}
+	}
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+/* scst_mutex supposed to be held */
+static void scst_clear_reservation(struct scst_tgt_dev *tgt_dev)
+{
+	struct scst_device *dev = tgt_dev->dev;
+	int release = 0;
+
+	TRACE_ENTRY();
+
+	spin_lock_bh(&dev->dev_lock);
+	if (dev->dev_reserved &&
+	    !test_bit(SCST_TGT_DEV_RESERVED, &tgt_dev->tgt_dev_flags)) {
+		/* This is one who holds the reservation */
+		struct scst_tgt_dev *tgt_dev_tmp;
+		list_for_each_entry(tgt_dev_tmp, &dev->dev_tgt_dev_list,
+				    dev_tgt_dev_list_entry) {
+			clear_bit(SCST_TGT_DEV_RESERVED,
+				    &tgt_dev_tmp->tgt_dev_flags);
+		}
+		dev->dev_reserved = 0;
+		release = 1;
+	}
+	spin_unlock_bh(&dev->dev_lock);
+
+	if (release)
+		scst_send_release(dev);
+
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Slow path of scst_lookup_tgt_dev() for LUNs not covered by
+ * sess_tgt_dev_lun_map.
+ *
+ * No locks, protection is done by the suspended activity or scst_mutex.
+ */
+struct scst_tgt_dev *__scst_lookup_tgt_dev(struct scst_session *sess,
+	uint64_t lun)
+{
+	struct scst_tgt_dev *tgt_dev;
+	struct list_head *head;
+	long steps = 0;
+
+	head = &sess->sess_tgt_dev_list[SESS_TGT_DEV_LIST_HASH_FN(lun)];
+	list_for_each_entry(tgt_dev, head, sess_tgt_dev_list_entry) {
+		steps++;
+		if (tgt_dev->lun == lun)
+			goto out;
+	}
+	tgt_dev = NULL;
+
+out:
+	atomic_long_inc(&sess->tgt_dev_hash_lookups);
+	atomic_long_add(steps, &sess->tgt_dev_hash_lookup_steps);
+	return tgt_dev;
+}
+
+struct scst_session *scst_alloc_session(struct scst_tgt *tgt, gfp_t gfp_mask,
+	const char *initiator_name)
+{
+	struct scst_session *sess;
+	int i;
+
+	TRACE_ENTRY();
+
+	sess = kmem_cache_zalloc(scst_sess_cachep, gfp_mask);
+	if (sess == NULL) {
+		PRINT_ERROR("%s", "Allocation of scst_session failed");
+		goto out;
+	}
+
+	sess->init_phase = SCST_SESS_IPH_INITING;
+	sess->shut_phase = SCST_SESS_SPH_READY;
+	atomic_set(&sess->refcnt, 0);
+	for (i = 0; i < SESS_TGT_DEV_LIST_HASH_SIZE; i++) {
+		struct list_head *head = &sess->sess_tgt_dev_list[i];
+		INIT_LIST_HEAD(head);
+	}
+	spin_lock_init(&sess->sess_list_lock);
+	INIT_LIST_HEAD(&sess->sess_cmd_list);
+	for (i = 0; i < SESS_CMD_TAG_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&sess->sess_cmd_tag_hash[i]);
+	sess->sess_tgt_dev_lun_map = kcalloc(SESS_TGT_DEV_LUN_MAP_SIZE,
+		sizeof(*sess->sess_tgt_dev_lun_map), gfp_mask);
+	if (sess->sess_tgt_dev_lun_map == NULL) {
+		PRINT_ERROR("%s", "Allocation of sess_tgt_dev_lun_map failed");
+		goto out_free;
+	}
+	atomic_long_set(&sess->tgt_dev_hash_lookups, 0);
+	atomic_long_set(&sess->tgt_dev_hash_lookup_steps, 0);
+	sess->tgt = tgt;
+	INIT_LIST_HEAD(&sess->init_deferred_cmd_list);
+	INIT_LIST_HEAD(&sess->init_deferred_mcmd_list);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20))
+	INIT_DELAYED_WORK(&sess->hw_pending_work,
+		(void (*)(struct work_struct *))scst_hw_pending_work_fn);
+#else
+	INIT_WORK(&sess->hw_pending_work, scst_hw_pending_work_fn, sess);
+#endif
+
+#ifdef CONFIG_SCST_MEASURE_LATENCY
+	spin_lock_init(&sess->lat_lock);
+#endif
+
+	sess->initiator_name = kstrdup(initiator_name, gfp_mask);
+	if (sess->initiator_name == NULL) {
+		PRINT_ERROR("%s", "Unable to dup sess->initiator_name");
+		goto out_free;
+	}
+
+out:
+	TRACE_EXIT();
+	return sess;
+
+out_free:
+	kfree(sess->sess_tgt_dev_lun_map);
+	kmem_cache_free(scst_sess_cachep, sess);
+	sess = NULL;
+	goto out;
+}
+
+void scst_free_session(struct scst_session *sess)
+{
+	TRACE_ENTRY();
+
+	mutex_lock(&scst_mutex);
+
+	scst_sess_free_tgt_devs(sess);
+
+	TRACE_DBG("Removing sess %p from the list", sess);
+	list_del(&sess->sess_list_entry);
+
+	TRACE_DBG("Removing session %p from acg %s", sess, sess->acg->acg_name);
+	list_del(&sess->acg_sess_list_entry);
+
+	mutex_unlock(&scst_mutex);
+
+#ifndef CONFIG_SCST_PROC
+	scst_sess_sysfs_del(sess);
+#endif
+	if (sess->unreg_done_fn) {
+		TRACE_DBG("Calling unreg_done_fn(%p)", sess);
+		sess->unreg_done_fn(sess);
+		TRACE_DBG("%s", "unreg_done_fn() returned");
+	}
+
+	mutex_lock(&scst_mutex);
+
+	list_del(&sess->sysfs_sess_list_entry);
+
+	/* Called under lock to protect from too early tgt release */
+	wake_up_all(&sess->tgt->unreg_waitQ);
+
+	/*
+	 * NOTE: do not dereference the sess->tgt pointer after scst_mutex
+	 * has been unlocked, because it can be already dead!!
+	 */
+	mutex_unlock(&scst_mutex);
+
+	kfree(sess->transport_id);
+	kfree(sess->initiator_name);
+	if (sess->sess_name != sess->initiator_name)
+		kfree(sess->sess_name);
+	kfree(sess->sess_tgt_dev_lun_map);
+
+	kmem_cache_free(scst_sess_cachep, sess);
+
+	TRACE_EXIT();
+	return;
+}
+
+void scst_free_session_callback(struct scst_session *sess)
+{
+	struct completion *c;
+
+	TRACE_ENTRY();
+
+	TRACE_DBG("Freeing session %p", sess);
+
+	cancel_delayed_work_sync(&sess->hw_pending_work);
+
+	c = sess->shutdown_compl;
 
 	mutex_lock(&scst_mutex);
 	/*
@@ -5458,6 +6822,7 @@ void scst_check_retries(struct scst_tgt *tgt)
 			spin_lock(&c->cmd_threads->cmd_list_lock);
 			list_move(&c->cmd_list_entry,
 				  &c->cmd_threads->active_cmd_list);
+			c->cmd_threads->active_cmd_cnt++;
 			wake_up(&c->cmd_threads->cmd_list_waitQ);
 			spin_unlock(&c->cmd_threads->cmd_list_lock);
 
@@ -6221,7 +7586,9 @@ static int get_cdb_info_serv_act_in(struct scst_cmd *cmd,
 		if (unlikely(cmd->bufflen & SCST_MAX_VALID_BUFFLEN_MASK))
 			goto out_inval_bufflen10;
 		cmd->op_flags |= SCST_WRITE_EXCL_ALLOWED;
-		break;
+		/* No medium data transferred */
+		cmd->data_len = 0;
+		goto out;
 	default:
 		cmd->op_flags |= SCST_UNKNOWN_LENGTH | SCST_LBA_NOT_VALID;
 		break;
@@ -6620,6 +7987,16 @@ static int get_cdb_info_write_same16(struct scst_cmd *cmd,
 	return 0;
 }
 
+/* Data-out contains both, compare and write, parts */
+static int get_cdb_info_compare_and_write(struct scst_cmd *cmd,
+	const struct scst_sdbops *sdbops)
+{
+	cmd->lba = get_unaligned_be64(cmd->cdb + sdbops->info_lba_off);
+	cmd->data_len = cmd->cdb[sdbops->info_len_off];
+	cmd->bufflen = 2 * cmd->data_len;
+	return 0;
+}
+
 /**
  * scst_get_cdb_info_apt() - Parse ATA PASS-THROUGH CDB.
  *
@@ -6757,7 +8134,7 @@ static int get_cdb_info_min(struct scst_cmd *cmd,
 int scst_get_cdb_info(struct scst_cmd *cmd)
 {
 	int dev_type = cmd->dev->type;
-	int i, res = 0;
+	int res = 0;
 	uint8_t op;
 	const struct scst_sdbops *ptr = NULL;
 
@@ -6768,31 +8145,8 @@ int scst_get_cdb_info(struct scst_cmd *cmd)
 	TRACE_DBG("opcode=%02x, cdblen=%d bytes, dev_type=%d", op,
 		SCST_GET_CDB_LEN(op), dev_type);
 
-	i = scst_scsi_op_list[op];
-	while (i < SCST_CDB_TBL_SIZE && scst_scsi_op_table[i].ops == op) {
-		if (scst_scsi_op_table[i].devkey[dev_type] != SCST_CDB_NOTSUPP) {
-			ptr = &scst_scsi_op_table[i];
-			TRACE_DBG("op = 0x%02x+'%c%c%c%c%c%c%c%c%c%c'+<%s>",
-			      ptr->ops, ptr->devkey[0],	/* disk     */
-			      ptr->devkey[1],	/* tape     */
-			      ptr->devkey[2],	/* printer */
-			      ptr->devkey[3],	/* cpu      */
-			      ptr->devkey[4],	/* cdr      */
-			      ptr->devkey[5],	/* cdrom    */
-			      ptr->devkey[6],	/* scanner */
-			      ptr->devkey[7],	/* worm     */
-			      ptr->devkey[8],	/* changer */
-			      ptr->devkey[9],	/* commdev */
-			      ptr->info_op_name);
-			TRACE_DBG("data direction %d, op flags 0x%x, lba off %d, "
-				"lba len %d, len off %d, len len %d",
-				ptr->info_data_direction, ptr->info_op_flags,
-				ptr->info_lba_off, ptr->info_lba_len,
-				ptr->info_len_off, ptr->info_len_len);
-			break;
-		}
-		i++;
-	}
+	if (likely((unsigned int)dev_type < SCST_CDB_DEV_TYPES))
+		ptr = scst_scsi_op_list[dev_type][op];
 
 	if (unlikely(ptr == NULL)) {
 		/* opcode not found or now not used */
@@ -6810,7 +8164,36 @@ int scst_get_cdb_info(struct scst_cmd *cmd)
 	cmd->lba_len = ptr->info_lba_len;
 	cmd->len_off = ptr->info_len_off;
 	cmd->len_len = ptr->info_len_len;
-	res = (*ptr->get_cdb_info)(cmd, ptr);
+
+	TRACE_DBG("op = 0x%02x+'%c%c%c%c%c%c%c%c%c%c'+<%s>",
+	      ptr->ops, ptr->devkey[0],	/* disk     */
+	      ptr->devkey[1],	/* tape     */
+	      ptr->devkey[2],	/* printer */
+	      ptr->devkey[3],	/* cpu      */
+	      ptr->devkey[4],	/* cdr      */
+	      ptr->devkey[5],	/* cdrom    */
+	      ptr->devkey[6],	/* scanner */
+	      ptr->devkey[7],	/* worm     */
+	      ptr->devkey[8],	/* changer */
+	      ptr->devkey[9],	/* commdev */
+	      ptr->info_op_name);
+	TRACE_DBG("data direction %d, op flags 0x%x, lba off %d, "
+		"lba len %d, len off %d, len len %d",
+		ptr->info_data_direction, ptr->info_op_flags,
+		ptr->info_lba_off, ptr->info_lba_len,
+		ptr->info_len_off, ptr->info_len_len);
+
+	/*
+	 * Direct calls for READ/WRITE(10) and READ/WRITE(16) decoders,
+	 * which the compiler can inline, to not go via the function pointer
+	 * for the most common commands.
+	 */
+	if (likely(ptr->get_cdb_info == get_cdb_info_lba_4_len_2))
+		res = get_cdb_info_lba_4_len_2(cmd, ptr);
+	else if (likely(ptr->get_cdb_info == get_cdb_info_lba_8_len_4))
+		res = get_cdb_info_lba_8_len_4(cmd, ptr);
+	else
+		res = (*ptr->get_cdb_info)(cmd, ptr);
 
 out:
 	TRACE_EXIT_RES(res);
@@ -7641,6 +9024,7 @@ void scst_process_reset(struct scst_device *dev,
 			spin_lock_irq(&cmd->cmd_threads->cmd_list_lock);
 			list_add_tail(&cmd->cmd_list_entry,
 				&cmd->cmd_threads->active_cmd_list);
+			cmd->cmd_threads->active_cmd_cnt++;
 			wake_up(&cmd->cmd_threads->cmd_list_waitQ);
 			spin_unlock_irq(&cmd->cmd_threads->cmd_list_lock);
 		}
@@ -7991,6 +9375,7 @@ restart:
 					cmd);
 				list_add_tail(&cmd->cmd_list_entry,
 					&cmd->cmd_threads->active_cmd_list);
+				cmd->cmd_threads->active_cmd_cnt++;
 				wake_up(&cmd->cmd_threads->cmd_list_waitQ);
 				spin_unlock(&cmd->cmd_threads->cmd_list_lock);
 			}
@@ -8092,7 +9477,7 @@ bool __scst_check_blocked_dev(struct scst_cmd *cmd)
 	TRACE_ENTRY();
 
 	EXTRACHECKS_BUG_ON(cmd->unblock_dev);
-	EXTRACHECKS_BUG_ON(cmd->internal);
+	EXTRACHECKS_BUG_ON(cmd->internal && !cmd->internal_other_dev);
 
 	if (unlikely(test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags)))
 		goto out;
@@ -8171,6 +9556,7 @@ void scst_unblock_dev(struct scst_device *dev)
 			else
 				list_add_tail(&cmd->cmd_list_entry,
 					&cmd->cmd_threads->active_cmd_list);
+			cmd->cmd_threads->active_cmd_cnt++;
 			strictly_serialized = ((cmd->op_flags & SCST_STRICTLY_SERIALIZED) == SCST_STRICTLY_SERIALIZED);
 			wake_up(&cmd->cmd_threads->cmd_list_waitQ);
 			spin_unlock(&cmd->cmd_threads->cmd_list_lock);
@@ -8925,26 +10311,27 @@ int scst_remove_file(const char *name)
 
 static void __init scst_scsi_op_list_init(void)
 {
-	int i;
-	uint8_t op = 0xff;
+	int i, t;
 
 	TRACE_ENTRY();
 
 	TRACE_DBG("tblsize=%d", SCST_CDB_TBL_SIZE);
 
-	for (i = 0; i < 256; i++)
-		scst_scsi_op_list[i] = SCST_CDB_TBL_SIZE;
-
+	/*
+	 * The first entry for the opcode supported by the device type wins,
+	 * as it used to be with the linear search in scst_get_cdb_info().
+	 */
 	for (i = 0; i < SCST_CDB_TBL_SIZE; i++) {
-		if (scst_scsi_op_table[i].ops != op) {
-			op = scst_scsi_op_table[i].ops;
-			scst_scsi_op_list[op] = i;
+		const struct scst_sdbops *ptr = &scst_scsi_op_table[i];
+
+		for (t = 0; t < SCST_CDB_DEV_TYPES; t++) {
+			if (ptr->devkey[t] == SCST_CDB_NOTSUPP)
+				continue;
+			if (scst_scsi_op_list[t][ptr->ops] == NULL)
+				scst_scsi_op_list[t][ptr->ops] = ptr;
 		}
 	}
 
-	TRACE_BUFFER("scst_scsi_op_list", scst_scsi_op_list,
-		sizeof(scst_scsi_op_list));
-
 	TRACE_EXIT();
 	return;
 }
@@ -9150,6 +10537,7 @@ void tm_dbg_check_released_cmds(void)
 			spin_lock(&cmd->cmd_threads->cmd_list_lock);
 			list_move(&cmd->cmd_list_entry,
 				&cmd->cmd_threads->active_cmd_list);
+			cmd->cmd_threads->active_cmd_cnt++;
 			spin_unlock(&cmd->cmd_threads->cmd_list_lock);
 		}
 		tm_dbg_flags.tm_dbg_release = 0;
@@ -9264,6 +10652,7 @@ void tm_dbg_release_cmd(struct scst_cmd *cmd)
 			spin_lock(&cmd->cmd_threads->cmd_list_lock);
 			list_move(&c->cmd_list_entry,
 				&c->cmd_threads->active_cmd_list);
+			c->cmd_threads->active_cmd_cnt++;
 			wake_up(&c->cmd_threads->cmd_list_waitQ);
 			spin_unlock(&cmd->cmd_threads->cmd_list_lock);
 			break;
@@ -130,6 +130,8 @@ unsigned long scst_trace_flag;
 
 int scst_max_tasklet_cmd = SCST_DEF_MAX_TASKLET_CMD;
 
+int scst_cmd_batch_size = SCST_DEF_CMD_BATCH_SIZE;
+
 unsigned long scst_flags;
 
 struct scst_cmd_threads scst_main_cmd_threads;
@@ -1639,6 +1641,7 @@ int scst_add_threads(struct scst_cmd_threads *cmd_threads,
 	int res = 0, i;
 	struct scst_cmd_thread_t *thr;
 	int n = 0, tgt_dev_num = 0;
+	bool use_node_mask;
 
 	TRACE_ENTRY();
 
@@ -1664,6 +1667,12 @@ int scst_add_threads(struct scst_cmd_threads *cmd_threads,
 		}
 	}
 
+	/* A non-default ACG cpu_mask takes precedence over the NUMA node */
+	use_node_mask = (cmd_threads->numa_node != NUMA_NO_NODE) &&
+		((tgt_dev == NULL) ||
+		 cpus_equal(tgt_dev->acg_dev->acg->acg_cpu_mask,
+			default_cpu_mask));
+
 	for (i = 0; i < num; i++) {
 		thr = kmalloc(sizeof(*thr), GFP_KERNEL);
 		if (!thr) {
@@ -1690,7 +1699,17 @@ int scst_add_threads(struct scst_cmd_threads *cmd_threads,
 			goto out_wait;
 		}
 
-		if (tgt_dev != NULL) {
+		if (use_node_mask) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 29)
+			int rc;
+
+			rc = set_cpus_allowed_ptr(thr->cmd_thread,
+				cpumask_of_node(cmd_threads->numa_node));
+			if (rc != 0)
+				PRINT_ERROR("Setting NUMA node %d CPU affinity "
+					"failed: %d", cmd_threads->numa_node, rc);
+#endif
+		} else if (tgt_dev != NULL) {
 			int rc;
 			/*
 			 * sess->acg can be NULL here, if called from
@@ -1813,6 +1832,7 @@ int scst_create_dev_threads(struct scst_device *dev)
 
 	if ((dev->threads_num > 0) &&
 	    (dev->threads_pool_type == SCST_THREADS_POOL_SHARED)) {
+		dev->dev_cmd_threads.numa_node = dev->dev_numa_node;
 		res = scst_add_threads(&dev->dev_cmd_threads, dev, NULL,
 			dev->threads_num);
 		if (res != 0)
@@ -1960,6 +1980,7 @@ void scst_init_threads(struct scst_cmd_threads *cmd_threads)
 	init_waitqueue_head(&cmd_threads->cmd_list_waitQ);
 	INIT_LIST_HEAD(&cmd_threads->threads_list);
 	mutex_init(&cmd_threads->io_context_mutex);
+	cmd_threads->numa_node = NUMA_NO_NODE;
 
 	mutex_lock(&scst_cmd_threads_mutex);
 	list_add_tail(&cmd_threads->lists_list_entry,
@@ -26,6 +26,7 @@
 #include <linux/mm.h>
 #include <linux/unistd.h>
 #include <linux/string.h>
+#include <linux/percpu.h>
 
 #ifdef INSIDE_KERNEL_TREE
 #include <scst/scst.h>
@@ -43,6 +44,10 @@
 
 static struct sgv_pool *sgv_norm_clust_pool, *sgv_norm_pool, *sgv_dma_pool;
 
+/* Per-NUMA node pools, created only on multi-node systems */
+static struct sgv_pool *sgv_norm_node_pools[MAX_NUMNODES];
+static struct sgv_pool *sgv_norm_clust_node_pools[MAX_NUMNODES];
+
 static atomic_t sgv_pages_total = ATOMIC_INIT(0);
 
 /* Both read-only */
@@ -81,23 +86,47 @@ static int scst_sgv_sysfs_create(struct sgv_pool *pool);
 static void scst_sgv_sysfs_del(struct sgv_pool *pool);
 #endif
 
+static void sgv_pool_drain_mags(struct sgv_pool *pool);
+
 static inline bool sgv_pool_clustered(const struct sgv_pool *pool)
 {
 	return pool->clustering_type != sgv_no_clustering;
 }
 
+static int sgv_tgt_dev_numa_node(const struct scst_tgt_dev *tgt_dev)
+{
+	int node = tgt_dev->sess->tgt->tgt_numa_node;
+
+	if ((node < 0) || (node >= MAX_NUMNODES))
+		node = NUMA_NO_NODE;
+	return node;
+}
+
 void scst_sgv_pool_use_norm(struct scst_tgt_dev *tgt_dev)
 {
+	int node = sgv_tgt_dev_numa_node(tgt_dev);
+
 	tgt_dev->gfp_mask = __GFP_NOWARN;
-	tgt_dev->pool = sgv_norm_pool;
+	if ((node != NUMA_NO_NODE) && (sgv_norm_node_pools[node] != NULL)) {
+		TRACE_MEM("Use NUMA node %d", node);
+		tgt_dev->pool = sgv_norm_node_pools[node];
+	} else
+		tgt_dev->pool = sgv_norm_pool;
 	clear_bit(SCST_TGT_DEV_CLUST_POOL, &tgt_dev->tgt_dev_flags);
 }
 
 void scst_sgv_pool_use_norm_clust(struct scst_tgt_dev *tgt_dev)
 {
+	int node = sgv_tgt_dev_numa_node(tgt_dev);
+
 	TRACE_MEM("%s", "Use clustering");
 	tgt_dev->gfp_mask = __GFP_NOWARN;
-	tgt_dev->pool = sgv_norm_clust_pool;
+	if ((node != NUMA_NO_NODE) &&
+	    (sgv_norm_clust_node_pools[node] != NULL)) {
+		TRACE_MEM("Use NUMA node %d", node);
+		tgt_dev->pool = sgv_norm_clust_node_pools[node];
+	} else
+		tgt_dev->pool = sgv_norm_clust_pool;
 	set_bit(SCST_TGT_DEV_CLUST_POOL, &tgt_dev->tgt_dev_flags);
 }
 
@@ -167,6 +196,25 @@ static inline void sgv_del_from_active(struct sgv_pool *pool)
 	return;
 }
 
+/* Must be called under sgv_pool_lock held */
+static void sgv_inc_cached_entries(struct sgv_pool *pool, int pages)
+{
+	if (pool->cached_entries == 0) {
+		TRACE_MEM("Adding pool %p to the active list", pool);
+		spin_lock_bh(&sgv_pools_lock);
+		list_add_tail(&pool->sgv_active_pools_list_entry,
+			&sgv_active_pools_list);
+		spin_unlock_bh(&sgv_pools_lock);
+	}
+
+	pool->cached_entries++;
+	pool->cached_pages += pages;
+
+	TRACE_MEM("New cached entries %d (pool %p)", pool->cached_entries,
+		pool);
+	return;
+}
+
 /* Must be called under sgv_pool_lock held */
 static void sgv_dec_cached_entries(struct sgv_pool *pool, int pages)
 {
@@ -232,6 +280,8 @@ static int sgv_shrink_pool(struct sgv_pool *pool, int nr, int min_interval,
 		goto out;
 	}
 
+	sgv_pool_drain_mags(pool);
+
 	spin_lock_bh(&pool->sgv_pool_lock);
 
 	while (!list_empty(&pool->sorted_recycling_list) &&
@@ -339,6 +389,20 @@ out_unlock_put:
 	goto out;
 }
 
+/*
+ * No locks. Returns number of pages of the objects in all the magazines of
+ * the pool. The result can be slightly off, which is fine for its users.
+ */
+static int sgv_pool_mag_pages(struct sgv_pool *pool)
+{
+	int cpu, pages = 0;
+
+	for_each_possible_cpu(cpu)
+		pages += per_cpu_ptr(pool->mags, cpu)->mag_pages;
+
+	return pages;
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 35) && (!defined(RHEL_MAJOR) || RHEL_MAJOR -0 < 6)
 static int sgv_shrink(int nr, gfp_t gfpm)
 #elif LINUX_VERSION_CODE < KERNEL_VERSION(3, 0, 0)
@@ -363,8 +427,13 @@ static int sgv_shrink(struct shrinker *shrinker, struct shrink_control *sc)
 		spin_lock_bh(&sgv_pools_lock);
 		list_for_each_entry(pool, &sgv_active_pools_list,
 				sgv_active_pools_list_entry) {
+			/*
+			 * Pages in the magazines are reclaimable as well,
+			 * because sgv_shrink_pool() drains them first.
+			 */
 			if (pool->purge_interval > 0)
-				inactive_pages += pool->inactive_cached_pages;
+				inactive_pages += pool->inactive_cached_pages +
+					sgv_pool_mag_pages(pool);
 		}
 		spin_unlock_bh(&sgv_pools_lock);
 
@@ -395,6 +464,12 @@ static void sgv_purge_work_fn(struct delayed_work *work)
 
 	TRACE_MEM("Purge work for pool %p", pool);
 
+	/*
+	 * purge_work_scheduled is still set here, so draining can't
+	 * reschedule us.
+	 */
+	sgv_pool_drain_mags(pool);
+
 	spin_lock_bh(&pool->sgv_pool_lock);
 
 	pool->purge_work_scheduled = false;
@@ -577,10 +652,24 @@ static struct page *sgv_alloc_sys_pages(struct scatterlist *sg,
 	return page;
 }
 
+static struct page *sgv_alloc_sys_node_pages(struct scatterlist *sg,
+	gfp_t gfp_mask, int numa_node)
+{
+	struct page *page = alloc_pages_node(numa_node, gfp_mask, 0);
+
+	sg_set_page(sg, page, PAGE_SIZE, 0);
+	TRACE_MEM("page=%p, sg=%p, node=%d", page, sg, numa_node);
+	if (page == NULL) {
+		TRACE(TRACE_OUT_OF_MEM, "Allocation of sg page on node %d "
+			"failed", numa_node);
+	}
+	return page;
+}
+
 static int sgv_alloc_sg_entries(struct scatterlist *sg, int pages,
 	gfp_t gfp_mask, enum sgv_clustering_types clustering_type,
 	struct trans_tbl_ent *trans_tbl,
-	const struct sgv_pool_alloc_fns *alloc_fns, void *priv)
+	const struct sgv_pool_alloc_fns *alloc_fns, int numa_node, void *priv)
 {
 	int sg_count = 0;
 	int pg, i, j;
@@ -603,8 +692,12 @@ static int sgv_alloc_sg_entries(struct scatterlist *sg, int pages,
 			rc = NULL;
 		else
 #endif
-			rc = alloc_fns->alloc_pages_fn(&sg[sg_count], gfp_mask,
-				priv);
+		if (numa_node != NUMA_NO_NODE)
+			rc = sgv_alloc_sys_node_pages(&sg[sg_count],
+				gfp_mask, numa_node);
+		else
+			rc = alloc_fns->alloc_pages_fn(&sg[sg_count],
+				gfp_mask, priv);
 		if (rc == NULL)
 			goto out_no_mem;
 
@@ -704,50 +797,135 @@ out_free:
 	goto out;
 }
 
+/* Must be called under sgv_pool_lock held */
+static struct sgv_pool_obj *__sgv_get_cached_obj(struct sgv_pool *pool,
+	int cache_num)
+{
+	struct sgv_pool_obj *obj;
+
+	if (list_empty(&pool->recycling_lists[cache_num]))
+		return NULL;
+
+	obj = list_first_entry(&pool->recycling_lists[cache_num],
+		 struct sgv_pool_obj, recycling_list_entry);
+
+	list_del(&obj->sorted_recycling_list_entry);
+	list_del(&obj->recycling_list_entry);
+
+	pool->inactive_cached_pages -= obj->pages;
+
+	return obj;
+}
+
+/*
+ * Must be called under mag_lock held. Moves up to half of the magazine
+ * worth of objects from the shared recycling list to the magazine at once,
+ * so sgv_pool_lock is taken once per several allocations. If the shared
+ * list is empty, accounts the new object of the given number of pages,
+ * which the caller is going to allocate, under the same sgv_pool_lock.
+ */
+static int sgv_mag_refill(struct sgv_pool *pool, struct sgv_pool_mag *mag,
+	int cache_num, int pages)
+{
+	int n = 0;
+
+	spin_lock(&pool->sgv_pool_lock);
+	while (n < SGV_POOL_MAG_SIZE/2) {
+		struct sgv_pool_obj *obj = __sgv_get_cached_obj(pool, cache_num);
+		if (obj == NULL)
+			break;
+		mag->mag_pages += obj->pages;
+		mag->mag_objs[cache_num][n++] = obj;
+	}
+	if (n == 0)
+		sgv_inc_cached_entries(pool, pages);
+	spin_unlock(&pool->sgv_pool_lock);
+
+	TRACE_MEM("Refilled %d objs in magazine %p (pool %p, cache num %d)",
+		n, mag, pool, cache_num);
+
+	mag->mag_count[cache_num] = n;
+	return n;
+}
+
+/*
+ * No locks. Returns NULL, if there is no cached object, in which case a
+ * new object of the given number of pages is already accounted.
+ */
+static struct sgv_pool_obj *sgv_mag_get(struct sgv_pool *pool, int cache_num,
+	int pages)
+{
+	struct sgv_pool_mag *mag;
+	struct sgv_pool_obj *obj = NULL;
+	int n;
+
+	local_bh_disable();
+	mag = per_cpu_ptr(pool->mags, smp_processor_id());
+	spin_lock(&mag->mag_lock);
+
+	mag->mag_allocs++;
+
+	n = mag->mag_count[cache_num];
+	if (likely(n > 0))
+		mag->mag_hits++;
+	else {
+		n = sgv_mag_refill(pool, mag, cache_num, pages);
+		if (n == 0)
+			goto out_unlock;
+	}
+
+	n--;
+	obj = mag->mag_objs[cache_num][n];
+	mag->mag_count[cache_num] = n;
+	mag->mag_pages -= obj->pages;
+
+	TRACE_MEM("Got obj %p from magazine %p (cache num %d)", obj, mag,
+		cache_num);
+
+out_unlock:
+	spin_unlock(&mag->mag_lock);
+	local_bh_enable();
+	return obj;
+}
+
 static struct sgv_pool_obj *sgv_get_obj(struct sgv_pool *pool, int cache_num,
 	int pages, gfp_t gfp_mask, bool get_new)
 {
 	struct sgv_pool_obj *obj;
 
-	spin_lock_bh(&pool->sgv_pool_lock);
-
 	if (unlikely(get_new)) {
 		/* Used only for buffers preallocation */
+		spin_lock_bh(&pool->sgv_pool_lock);
 		goto get_new;
 	}
 
-	if (likely(!list_empty(&pool->recycling_lists[cache_num]))) {
-		obj = list_first_entry(&pool->recycling_lists[cache_num],
-			 struct sgv_pool_obj, recycling_list_entry);
-
-		list_del(&obj->sorted_recycling_list_entry);
-		list_del(&obj->recycling_list_entry);
+	if (likely(cache_num < SGV_POOL_MAG_ELEMENTS)) {
+		obj = sgv_mag_get(pool, cache_num, pages);
+		if (likely(obj != NULL))
+			goto out;
+		/* The shared list is empty and the new obj already accounted */
+		goto alloc_new;
+	}
 
-		pool->inactive_cached_pages -= pages;
+	spin_lock_bh(&pool->sgv_pool_lock);
 
+	obj = __sgv_get_cached_obj(pool, cache_num);
+	if (likely(obj != NULL)) {
 		spin_unlock_bh(&pool->sgv_pool_lock);
 		goto out;
 	}
 
 get_new:
-	if (pool->cached_entries == 0) {
-		TRACE_MEM("Adding pool %p to the active list", pool);
-		spin_lock_bh(&sgv_pools_lock);
-		list_add_tail(&pool->sgv_active_pools_list_entry,
-			&sgv_active_pools_list);
-		spin_unlock_bh(&sgv_pools_lock);
-	}
-
-	pool->cached_entries++;
-	pool->cached_pages += pages;
-
+	sgv_inc_cached_entries(pool, pages);
 	spin_unlock_bh(&pool->sgv_pool_lock);
 
-	TRACE_MEM("New cached entries %d (pool %p)", pool->cached_entries,
-		pool);
-
-	obj = kmem_cache_alloc(pool->caches[cache_num],
-		gfp_mask & ~(__GFP_HIGHMEM|GFP_DMA));
+alloc_new:
+	if (pool->numa_node != NUMA_NO_NODE)
+		obj = kmem_cache_alloc_node(pool->caches[cache_num],
+			gfp_mask & ~(__GFP_HIGHMEM|GFP_DMA), pool->numa_node);
+	else
+		obj = kmem_cache_alloc(pool->caches[cache_num],
+			gfp_mask & ~(__GFP_HIGHMEM|GFP_DMA));
 	if (likely(obj)) {
 		memset(obj, 0, sizeof(*obj));
 		obj->cache_num = cache_num;
@@ -763,15 +941,14 @@ out:
 	return obj;
 }
 
-static void sgv_put_obj(struct sgv_pool_obj *obj)
+/* Must be called under sgv_pool_lock held */
+static void __sgv_put_obj(struct sgv_pool_obj *obj)
 {
 	struct sgv_pool *pool = obj->owner_pool;
 	struct list_head *entry;
 	struct list_head *list = &pool->recycling_lists[obj->cache_num];
 	int pages = obj->pages;
 
-	spin_lock_bh(&pool->sgv_pool_lock);
-
 	TRACE_MEM("sgv %p, cache num %d, pages %d, sg_count %d", obj,
 		obj->cache_num, pages, obj->sg_count);
 
@@ -808,7 +985,100 @@ static void sgv_put_obj(struct sgv_pool_obj *obj)
 			pool->purge_interval);
 	}
 
+	return;
+}
+
+/*
+ * No locks. If the magazine is full, the older half of it is spilled to
+ * the shared recycling lists under a single sgv_pool_lock acquisition.
+ */
+static void sgv_mag_put(struct sgv_pool_obj *obj)
+{
+	struct sgv_pool *pool = obj->owner_pool;
+	int cache_num = obj->cache_num;
+	struct sgv_pool_mag *mag;
+	int n;
+
+	local_bh_disable();
+	mag = per_cpu_ptr(pool->mags, smp_processor_id());
+	spin_lock(&mag->mag_lock);
+
+	n = mag->mag_count[cache_num];
+	if (unlikely(n == SGV_POOL_MAG_SIZE)) {
+		struct sgv_pool_obj **objs = mag->mag_objs[cache_num];
+		int i, half = SGV_POOL_MAG_SIZE/2;
+
+		TRACE_MEM("Spilling %d objs from magazine %p (pool %p, "
+			"cache num %d)", half, mag, pool, cache_num);
+
+		spin_lock(&pool->sgv_pool_lock);
+		for (i = 0; i < half; i++) {
+			mag->mag_pages -= objs[i]->pages;
+			__sgv_put_obj(objs[i]);
+		}
+		spin_unlock(&pool->sgv_pool_lock);
+
+		memmove(&objs[0], &objs[half], (n - half) * sizeof(objs[0]));
+		n -= half;
+	}
+
+	mag->mag_objs[cache_num][n] = obj;
+	mag->mag_count[cache_num] = n + 1;
+	mag->mag_pages += obj->pages;
+
+	spin_unlock(&mag->mag_lock);
+	local_bh_enable();
+	return;
+}
+
+static void sgv_put_obj(struct sgv_pool_obj *obj)
+{
+	struct sgv_pool *pool = obj->owner_pool;
+
+	if (likely(obj->cache_num < SGV_POOL_MAG_ELEMENTS)) {
+		sgv_mag_put(obj);
+		goto out;
+	}
+
+	spin_lock_bh(&pool->sgv_pool_lock);
+	__sgv_put_obj(obj);
 	spin_unlock_bh(&pool->sgv_pool_lock);
+
+out:
+	return;
+}
+
+/*
+ * No locks. Returns all objects from the per-CPU magazines to the shared
+ * recycling lists, so they become visible to the purge work, shrinker and
+ * flush.
+ */
+static void sgv_pool_drain_mags(struct sgv_pool *pool)
+{
+	int cpu, i;
+
+	TRACE_ENTRY();
+
+	for_each_possible_cpu(cpu) {
+		struct sgv_pool_mag *mag = per_cpu_ptr(pool->mags, cpu);
+
+		spin_lock_bh(&mag->mag_lock);
+		spin_lock(&pool->sgv_pool_lock);
+		for (i = 0; i < SGV_POOL_MAG_ELEMENTS; i++) {
+			while (mag->mag_count[i] > 0) {
+				struct sgv_pool_obj *obj;
+
+				mag->mag_count[i]--;
+				obj = mag->mag_objs[i][mag->mag_count[i]];
+				mag->mag_pages -= obj->pages;
+				__sgv_put_obj(obj);
+			}
+		}
+		spin_unlock(&pool->sgv_pool_lock);
+		spin_unlock_bh(&mag->mag_lock);
+	}
+
+	TRACE_EXIT();
 	return;
 }
 
@@ -1047,7 +1317,7 @@ struct scatterlist *sgv_pool_alloc(struct sgv_pool *pool, unsigned int size,
 
 	obj->sg_count = sgv_alloc_sg_entries(obj->sg_entries,
 		pages_to_alloc, gfp_mask, pool->clustering_type,
-		obj->trans_tbl, &pool->alloc_fns, priv);
+		obj->trans_tbl, &pool->alloc_fns, pool->numa_node, priv);
 	if (unlikely(obj->sg_count <= 0)) {
 		obj->sg_count = 0;
 		if ((flags & SGV_POOL_RETURN_OBJ_ON_ALLOC_FAIL) &&
@@ -1291,7 +1561,7 @@ struct scatterlist *scst_alloc_sg(int size, gfp_t gfp_mask, int *count)
 	 * So, let's always don't use clustering.
 	 */
 	cnt = sgv_alloc_sg_entries(res, pages, gfp_mask, sgv_no_clustering,
-			NULL, &sys_alloc_fns, NULL);
+			NULL, &sys_alloc_fns, NUMA_NO_NODE, NULL);
 	if (cnt <= 0)
 		goto out_free;
 
@@ -1388,7 +1658,7 @@ static int sgv_pool_init(struct sgv_pool *pool, const char *name,
 	int purge_interval)
 {
 	int res = -ENOMEM;
-	int i;
+	int i, cpu;
 
 	TRACE_ENTRY();
 
@@ -1401,6 +1671,8 @@ static int sgv_pool_init(struct sgv_pool *pool, const char *name,
 
 	memset(pool, 0, sizeof(*pool));
 
+	pool->numa_node = NUMA_NO_NODE;
+
 	atomic_set(&pool->big_alloc, 0);
 	atomic_set(&pool->big_pages, 0);
 	atomic_set(&pool->big_merged, 0);
@@ -1446,6 +1718,15 @@ static int sgv_pool_init(struct sgv_pool *pool, const char *name,
 		}
 	}
 
+	pool->mags = alloc_percpu(struct sgv_pool_mag);
+	if (pool->mags == NULL) {
+		PRINT_ERROR("Allocation of sgv_pool %s per-CPU magazines "
+			"failed", name);
+		goto out_free;
+	}
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(pool->mags, cpu)->mag_lock);
+
 	atomic_set(&pool->sgv_pool_ref, 1);
 	spin_lock_init(&pool->sgv_pool_lock);
 	INIT_LIST_HEAD(&pool->sorted_recycling_list);
@@ -1483,6 +1764,10 @@ out_del:
 #endif
 
 out_free:
+	if (pool->mags != NULL) {
+		free_percpu(pool->mags);
+		pool->mags = NULL;
+	}
 	for (i = 0; i < pool->max_caches; i++) {
 		if (pool->caches[i]) {
 			kmem_cache_destroy(pool->caches[i]);
@@ -1518,6 +1803,8 @@ void sgv_pool_flush(struct sgv_pool *pool)
 
 	TRACE_ENTRY();
 
+	sgv_pool_drain_mags(pool);
+
 	for (i = 0; i < pool->max_caches; i++) {
 		struct sgv_pool_obj *obj;
 
@@ -1550,6 +1837,13 @@ static void sgv_pool_destroy(struct sgv_pool *pool)
 
 	TRACE_ENTRY();
 
+	/*
+	 * Draining the magazines can schedule the purge work, so it must be
+	 * done before the work is cancelled. Then the magazines are empty
+	 * and sgv_pool_flush() can't schedule it again.
+	 */
+	sgv_pool_drain_mags(pool);
+
 	cancel_delayed_work_sync(&pool->sgv_purge_work);
 
 	sgv_pool_flush(pool);
@@ -1570,6 +1864,7 @@ static void sgv_pool_destroy(struct sgv_pool *pool)
 		pool->caches[i] = NULL;
 	}
 
+	free_percpu(pool->mags);
 	kfree(pool);
 
 	TRACE_EXIT();
@@ -1592,6 +1887,8 @@ void sgv_pool_set_allocator(struct sgv_pool *pool,
 {
 	pool->alloc_fns.alloc_pages_fn = alloc_pages_fn;
 	pool->alloc_fns.free_pages_fn = free_pages_fn;
+	/* Custom allocators are responsible for the pages placement */
+	pool->numa_node = NUMA_NO_NODE;
 	return;
 }
 EXPORT_SYMBOL_GPL(sgv_pool_set_allocator);
@@ -1723,6 +2020,70 @@ void sgv_pool_del(struct sgv_pool *pool)
 }
 EXPORT_SYMBOL_GPL(sgv_pool_del);
 
+static void sgv_destroy_node_pools(void)
+{
+	int node;
+
+	TRACE_ENTRY();
+
+	for (node = 0; node < MAX_NUMNODES; node++) {
+		if (sgv_norm_node_pools[node] != NULL) {
+			sgv_pool_destroy(sgv_norm_node_pools[node]);
+			sgv_norm_node_pools[node] = NULL;
+		}
+		if (sgv_norm_clust_node_pools[node] != NULL) {
+			sgv_pool_destroy(sgv_norm_clust_node_pools[node]);
+			sgv_norm_clust_node_pools[node] = NULL;
+		}
+	}
+
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Creates normal and clustered pools, which allocate their pages and
+ * objects on the corresponding NUMA node, for each online node. Not
+ * needed, hence not created, on single node systems.
+ */
+static int sgv_create_node_pools(void)
+{
+	int res = 0, node;
+	char name[SCST_MAX_NAME];
+
+	TRACE_ENTRY();
+
+	if (num_online_nodes() <= 1)
+		goto out;
+
+	for_each_online_node(node) {
+		struct sgv_pool *pool;
+
+		snprintf(name, sizeof(name), "sgv-n%d", node);
+		pool = sgv_pool_create(name, sgv_no_clustering, 0, false, 0);
+		if (pool == NULL)
+			goto out_err;
+		pool->numa_node = node;
+		sgv_norm_node_pools[node] = pool;
+
+		snprintf(name, sizeof(name), "sgv-clust-n%d", node);
+		pool = sgv_pool_create(name, sgv_full_clustering, 0, false, 0);
+		if (pool == NULL)
+			goto out_err;
+		pool->numa_node = node;
+		sgv_norm_clust_node_pools[node] = pool;
+	}
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_err:
+	sgv_destroy_node_pools();
+	res = -ENOMEM;
+	goto out;
+}
+
 /* Both parameters in pages */
 int scst_sgv_pools_init(unsigned long mem_hwmark, unsigned long mem_lwmark)
 {
@@ -1749,6 +2110,9 @@ int scst_sgv_pools_init(unsigned long mem_hwmark, unsigned long mem_lwmark)
 	if (sgv_dma_pool == NULL)
 		goto out_free_clust;
 
+	if (sgv_create_node_pools() != 0)
+		goto out_free_dma;
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 23))
 	sgv_shrinker = set_shrinker(DEFAULT_SEEKS, sgv_shrink);
 #else
@@ -1761,6 +2125,9 @@ out:
 	TRACE_EXIT_RES(res);
 	return res;
 
+out_free_dma:
+	sgv_pool_destroy(sgv_dma_pool);
+
 out_free_clust:
 	sgv_pool_destroy(sgv_norm_clust_pool);
 
@@ -1782,6 +2149,7 @@ void scst_sgv_pools_deinit(void)
 	unregister_shrinker(&sgv_shrinker);
 #endif
 
+	sgv_destroy_node_pools();
 	sgv_pool_destroy(sgv_dma_pool);
 	sgv_pool_destroy(sgv_norm_pool);
 	sgv_pool_destroy(sgv_norm_clust_pool);
@@ -1892,7 +2260,7 @@ static ssize_t sgv_sysfs_stat_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf)
 {
 	struct sgv_pool *pool;
-	int i, total = 0, hit = 0, merged = 0, allocated = 0;
+	int i, cpu, total = 0, hit = 0, merged = 0, allocated = 0;
 	int oa, om, res;
 
 	pool = container_of(kobj, struct sgv_pool, sgv_kobj);
@@ -1941,6 +2309,27 @@ static ssize_t sgv_sysfs_stat_show(struct kobject *kobj,
 		(allocated != 0) ? merged*100/allocated : 0,
 		(oa != 0) ? om/oa : 0);
 
+	res += scnprintf(&buf[res], PAGE_SIZE - res,
+		"\n  %-28s %-11s %-11s %-11s %s\n", "Per-CPU magazines",
+		"Hit", "Total", "% hit", "Pages");
+
+	for_each_possible_cpu(cpu) {
+		struct sgv_pool_mag *mag = per_cpu_ptr(pool->mags, cpu);
+		unsigned long h = mag->mag_hits, t = mag->mag_allocs;
+		char name[16];
+
+		if (t == 0)
+			continue;
+
+		snprintf(name, sizeof(name), "cpu%d", cpu);
+		res += scnprintf(&buf[res], PAGE_SIZE - res,
+			"  %-28s %-11lu %-11lu %-11lu %d\n", name, h, t,
+			h*100/t, mag->mag_pages);
+	}
+
+	res += scnprintf(&buf[res], PAGE_SIZE - res,
+		"  %-28s %d\n", "Pages in magazines", sgv_pool_mag_pages(pool));
+
 	return res;
 }
 
@@ -1948,12 +2337,21 @@ static ssize_t sgv_sysfs_stat_reset(struct kobject *kobj,
 	struct kobj_attribute *attr, const char *buf, size_t count)
 {
 	struct sgv_pool *pool;
-	int i;
+	int i, cpu;
 
 	TRACE_ENTRY();
 
 	pool = container_of(kobj, struct sgv_pool, sgv_kobj);
 
+	for_each_possible_cpu(cpu) {
+		struct sgv_pool_mag *mag = per_cpu_ptr(pool->mags, cpu);
+
+		spin_lock_bh(&mag->mag_lock);
+		mag->mag_hits = 0;
+		mag->mag_allocs = 0;
+		spin_unlock_bh(&mag->mag_lock);
+	}
+
 	for (i = 0; i < SGV_POOL_ELEMENTS; i++) {
 		atomic_set(&pool->cache_acc[i].hit_alloc, 0);
 		atomic_set(&pool->cache_acc[i].total_alloc, 0);
@@ -21,6 +21,14 @@
 
 #define SGV_POOL_ELEMENTS	11
 
+/*
+ * Per-CPU magazines are kept only for the first SGV_POOL_MAG_ELEMENTS
+ * caches (<= 32K), each able to hold up to SGV_POOL_MAG_SIZE objects.
+ * Bigger objects are too expensive to be kept idle on every CPU.
+ */
+#define SGV_POOL_MAG_ELEMENTS	4
+#define SGV_POOL_MAG_SIZE	8
+
 /*
  * sg_num is indexed by the page number, pg_count is indexed by the sg number.
  * Made in one entry to simplify the code (eg all sizeof(*) parts) and save
@@ -62,6 +70,25 @@ struct sgv_pool_cache_acc {
 	atomic_t merged;
 };
 
+/*
+ * Per-CPU magazine of recently freed SGV objects. Objects in a magazine
+ * are neither on recycling_lists nor on sorted_recycling_list and not
+ * counted in inactive_cached_pages, but in mag_pages.
+ */
+struct sgv_pool_mag {
+	/*
+	 * Taken only by the owning CPU with BHs disabled, so contended only
+	 * by sgv_pool_drain_mags(). Outer lock for sgv_pool_lock.
+	 */
+	spinlock_t mag_lock;
+
+	/* All protected by mag_lock */
+	int mag_count[SGV_POOL_MAG_ELEMENTS];
+	struct sgv_pool_obj *mag_objs[SGV_POOL_MAG_ELEMENTS][SGV_POOL_MAG_SIZE];
+	unsigned long mag_allocs, mag_hits;
+	int mag_pages; /* of all objects in the magazine */
+};
+
 /*
  * SGV pool allocation functions
  */
@@ -82,11 +109,20 @@ struct sgv_pool {
 
 	struct sgv_pool_alloc_fns alloc_fns;
 
+	/*
+	 * NUMA node, on which pages and objects of this pool are allocated,
+	 * or NUMA_NO_NODE. Used only with the default pages allocator.
+	 */
+	int numa_node;
+
 	/* <=4K, <=8, <=16, <=32, <=64, <=128, <=256, <=512, <=1024, <=2048 */
 	struct kmem_cache *caches[SGV_POOL_ELEMENTS];
 
 	spinlock_t sgv_pool_lock; /* outer lock for sgv_pools_lock! */
 
+	/* Per-CPU, allocated by alloc_percpu() */
+	struct sgv_pool_mag *mags;
+
 	int purge_interval;
 
 	/* Protected by sgv_pool_lock, if necessary */
@@ -2305,45 +2305,31 @@ out:
 
 }
 
-/* Check if command allowed in presence of reservation */
-bool scst_pr_is_cmd_allowed(struct scst_cmd *cmd)
+/*
+ * Returns true, if a command with op_flags from tgt_dev's initiator is
+ * allowed by the persistent reservation of tgt_dev's device. Called with
+ * the PR read lock or dev_pr_mutex held and pr_is_set.
+ */
+static bool __scst_pr_is_allowed(struct scst_tgt_dev *tgt_dev, int op_flags)
 {
 	bool allowed;
-	struct scst_device *dev = cmd->dev;
-	struct scst_tgt_dev *tgt_dev = cmd->tgt_dev;
-	struct scst_dev_registrant *reg;
-	uint8_t type;
-	bool unlock;
-
-	TRACE_ENTRY();
-
-	unlock = scst_pr_read_lock(cmd);
-
-	TRACE_DBG("Testing if command %s (0x%x) from %s allowed to execute",
-		cmd->op_name, cmd->cdb[0], cmd->sess->initiator_name);
-
-	/* Recheck, because it can change while we were waiting for the lock */
-	if (unlikely(!dev->pr_is_set)) {
-		allowed = true;
-		goto out_unlock;
-	}
-
-	reg = tgt_dev->registrant;
-	type = dev->pr_type;
+	struct scst_device *dev = tgt_dev->dev;
+	struct scst_dev_registrant *reg = tgt_dev->registrant;
+	uint8_t type = dev->pr_type;
 
 	switch (type) {
 	case TYPE_WRITE_EXCLUSIVE:
 		if (reg && reg == dev->pr_holder)
 			allowed = true;
 		else
-			allowed = (cmd->op_flags & SCST_WRITE_EXCL_ALLOWED) != 0;
+			allowed = (op_flags & SCST_WRITE_EXCL_ALLOWED) != 0;
 		break;
 
 	case TYPE_EXCLUSIVE_ACCESS:
 		if (reg && reg == dev->pr_holder)
 			allowed = true;
 		else
-			allowed = (cmd->op_flags & SCST_EXCL_ACCESS_ALLOWED) != 0;
+			allowed = (op_flags & SCST_EXCL_ACCESS_ALLOWED) != 0;
 		break;
 
 	case TYPE_WRITE_EXCLUSIVE_REGONLY:
@@ -2351,7 +2337,7 @@ bool scst_pr_is_cmd_allowed(struct scst_cmd *cmd)
 		if (reg)
 			allowed = true;
 		else
-			allowed = (cmd->op_flags & SCST_WRITE_EXCL_ALLOWED) != 0;
+			allowed = (op_flags & SCST_WRITE_EXCL_ALLOWED) != 0;
 		break;
 
 	case TYPE_EXCLUSIVE_ACCESS_REGONLY:
@@ -2359,7 +2345,7 @@ bool scst_pr_is_cmd_allowed(struct scst_cmd *cmd)
 		if (reg)
 			allowed = true;
 		else
-			allowed = (cmd->op_flags & SCST_EXCL_ACCESS_ALLOWED) != 0;
+			allowed = (op_flags & SCST_EXCL_ACCESS_ALLOWED) != 0;
 		break;
 
 	default:
@@ -2368,6 +2354,31 @@ bool scst_pr_is_cmd_allowed(struct scst_cmd *cmd)
 		break;
 	}
 
+	return allowed;
+}
+
+/* Check if command allowed in presence of reservation */
+bool scst_pr_is_cmd_allowed(struct scst_cmd *cmd)
+{
+	bool allowed;
+	struct scst_device *dev = cmd->dev;
+	bool unlock;
+
+	TRACE_ENTRY();
+
+	unlock = scst_pr_read_lock(cmd);
+
+	TRACE_DBG("Testing if command %s (0x%x) from %s allowed to execute",
+		cmd->op_name, cmd->cdb[0], cmd->sess->initiator_name);
+
+	/* Recheck, because it can change while we were waiting for the lock */
+	if (unlikely(!dev->pr_is_set)) {
+		allowed = true;
+		goto out_unlock;
+	}
+
+	allowed = __scst_pr_is_allowed(cmd->tgt_dev, cmd->op_flags);
+
 	if (!allowed)
 		TRACE_PR("Command %s (0x%x) from %s rejected due "
 			"to PR", cmd->op_name, cmd->cdb[0],
@@ -2383,6 +2394,32 @@ out_unlock:
 	return allowed;
 }
 
+/*
+ * Check if commands with op_flags from tgt_dev's initiator are allowed in
+ * presence of reservation. For callers without a command, which went
+ * through scst_pr_is_cmd_allowed(). No locks, might sleep.
+ */
+bool scst_pr_is_tgt_dev_allowed(struct scst_tgt_dev *tgt_dev, int op_flags)
+{
+	bool allowed;
+	struct scst_device *dev = tgt_dev->dev;
+
+	TRACE_ENTRY();
+
+	if (!dev->pr_is_set) {
+		allowed = true;
+		goto out;
+	}
+
+	mutex_lock(&dev->dev_pr_mutex);
+	allowed = !dev->pr_is_set || __scst_pr_is_allowed(tgt_dev, op_flags);
+	mutex_unlock(&dev->dev_pr_mutex);
+
+out:
+	TRACE_EXIT_RES(allowed);
+	return allowed;
+}
+
 /* Called with dev_pr_mutex locked, no IRQ */
 void scst_pr_read_keys(struct scst_cmd *cmd, uint8_t *buffer, int buffer_size)
 {
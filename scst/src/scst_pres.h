@@ -194,6 +194,7 @@ void scst_pr_clear_tgt_dev(struct scst_tgt_dev *tgt_dev);
 
 bool scst_pr_crh_case(struct scst_cmd *cmd);
 bool scst_pr_is_cmd_allowed(struct scst_cmd *cmd);
+bool scst_pr_is_tgt_dev_allowed(struct scst_tgt_dev *tgt_dev, int op_flags);
 
 void scst_pr_register(struct scst_cmd *cmd, uint8_t *buffer, int buffer_size);
 void scst_pr_register_and_ignore(struct scst_cmd *cmd, uint8_t *buffer,
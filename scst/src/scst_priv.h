@@ -117,6 +117,11 @@ extern unsigned long scst_trace_flag;
 #define SCST_MAX_EACH_INTERNAL_IO_SIZE	     (128*1024)
 #define SCST_MAX_IN_FLIGHT_INTERNAL_COMMANDS 32
 
+/* EXTENDED COPY limits, reported by RECEIVE COPY RESULTS */
+#define SCST_XCOPY_MAX_TGT_DESCR_CNT	     16
+#define SCST_XCOPY_MAX_SEG_DESCR_CNT	     128
+#define SCST_XCOPY_MAX_SEG_LEN		     (256*1024*1024)
+
 typedef void (*scst_i_finish_fn_t) (struct scst_cmd *cmd);
 
 extern struct mutex scst_mutex2;
@@ -155,6 +160,14 @@ extern unsigned int scst_setup_id;
 #define SCST_DEF_MAX_TASKLET_CMD 10
 extern int scst_max_tasklet_cmd;
 
+/*
+ * Max number of commands a processing thread or tasklet takes from the
+ * active commands list at once
+ */
+#define SCST_DEF_CMD_BATCH_SIZE 8
+#define SCST_MAX_CMD_BATCH_SIZE 256
+extern int scst_cmd_batch_size;
+
 extern spinlock_t scst_init_lock;
 extern struct list_head scst_init_cmd_list;
 extern wait_queue_head_t scst_init_cmd_list_waitQ;
@@ -272,6 +285,7 @@ static inline void scst_make_deferred_commands_active(
 		spin_lock_irq(&c->cmd_threads->cmd_list_lock);
 		list_add_tail(&c->cmd_list_entry,
 			&c->cmd_threads->active_cmd_list);
+		c->cmd_threads->active_cmd_cnt++;
 		wake_up(&c->cmd_threads->cmd_list_waitQ);
 		spin_unlock_irq(&c->cmd_threads->cmd_list_lock);
 	}
@@ -606,6 +620,23 @@ extern void scst_unblock_dev(struct scst_device *dev);
 
 bool __scst_check_blocked_dev(struct scst_cmd *cmd);
 
+struct scst_tgt_dev *__scst_lookup_tgt_dev(struct scst_session *sess,
+	uint64_t lun);
+
+/*
+ * Returns tgt_dev for lun in sess or NULL, if there is no such LUN.
+ *
+ * No locks, protection is done by the suspended activity or scst_mutex.
+ */
+static inline struct scst_tgt_dev *scst_lookup_tgt_dev(
+	struct scst_session *sess, uint64_t lun)
+{
+	if (likely(lun < SESS_TGT_DEV_LUN_MAP_SIZE))
+		return sess->sess_tgt_dev_lun_map[lun];
+	else
+		return __scst_lookup_tgt_dev(sess, lun);
+}
+
 /*
  * Increases global SCST ref counters which prevent from entering into suspended
  * activities stage, so protects from any global management operations.
@@ -1832,6 +1832,84 @@ static struct kobj_attribute scst_tgt_cpu_mask =
 	       scst_tgt_cpu_mask_show,
 	       scst_tgt_cpu_mask_store);
 
+/*
+ * Parses a NUMA node number for a numa_node attribute. -1 means no
+ * NUMA node affinity.
+ */
+static int scst_sysfs_parse_numa_node(const char *buf, int *numa_node)
+{
+	int res;
+	long node;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+	res = kstrtol(buf, 0, &node);
+#else
+	res = strict_strtol(buf, 0, &node);
+#endif
+	if (res != 0) {
+		PRINT_ERROR("strict_strtol() for %s failed: %d ", buf, res);
+		goto out;
+	}
+
+	if (node == NUMA_NO_NODE)
+		goto out_set;
+
+	if ((node < 0) || (node >= MAX_NUMNODES) || !node_online(node)) {
+		PRINT_ERROR("Illegal or offline NUMA node %ld", node);
+		res = -EINVAL;
+		goto out;
+	}
+
+out_set:
+	*numa_node = node;
+
+out:
+	return res;
+}
+
+static ssize_t scst_tgt_numa_node_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_tgt *tgt;
+
+	tgt = container_of(kobj, struct scst_tgt, tgt_kobj);
+
+	return sprintf(buf, "%d\n%s", tgt->tgt_numa_node,
+		(tgt->tgt_numa_node != NUMA_NO_NODE) ?
+			SCST_SYSFS_KEY_MARK "\n" : "");
+}
+
+static ssize_t scst_tgt_numa_node_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res, node;
+	struct scst_tgt *tgt;
+
+	TRACE_ENTRY();
+
+	tgt = container_of(kobj, struct scst_tgt, tgt_kobj);
+
+	res = scst_sysfs_parse_numa_node(buf, &node);
+	if (res != 0)
+		goto out;
+
+	/* Takes effect for new sessions and LUNs */
+	tgt->tgt_numa_node = node;
+
+	PRINT_INFO("Set NUMA node of target %s to %d", tgt->tgt_name, node);
+
+	res = count;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute scst_tgt_numa_node =
+	__ATTR(numa_node, S_IRUGO | S_IWUSR,
+	       scst_tgt_numa_node_show,
+	       scst_tgt_numa_node_store);
+
 static ssize_t scst_ini_group_mgmt_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf)
 {
@@ -2386,6 +2464,13 @@ int scst_tgt_sysfs_create(struct scst_tgt *tgt)
 		goto out_err;
 	}
 
+	res = sysfs_create_file(&tgt->tgt_kobj, &scst_tgt_numa_node.attr);
+	if (res != 0) {
+		PRINT_ERROR("Can't add attribute %s for tgt %s",
+			scst_tgt_numa_node.attr.name, tgt->tgt_name);
+		goto out_err;
+	}
+
 	if (tgt->tgtt->tgt_attrs) {
 		res = sysfs_create_files(&tgt->tgt_kobj, tgt->tgtt->tgt_attrs);
 		if (res != 0) {
@@ -2503,16 +2588,17 @@ static struct kobj_attribute dev_dump_prs_attr =
 
 static int scst_process_dev_sysfs_threads_data_store(
 	struct scst_device *dev, int threads_num,
-	enum scst_dev_type_threads_pool_type threads_pool_type)
+	enum scst_dev_type_threads_pool_type threads_pool_type, int numa_node)
 {
 	int res = 0;
 	int oldtn = dev->threads_num;
 	enum scst_dev_type_threads_pool_type oldtt = dev->threads_pool_type;
+	int oldnode = dev->dev_numa_node;
 
 	TRACE_ENTRY();
 
-	TRACE_DBG("dev %p, threads_num %d, threads_pool_type %d", dev,
-		threads_num, threads_pool_type);
+	TRACE_DBG("dev %p, threads_num %d, threads_pool_type %d, "
+		"numa_node %d", dev, threads_num, threads_pool_type, numa_node);
 
 	res = scst_suspend_activity(SCST_SUSPEND_TIMEOUT_USER);
 	if (res != 0)
@@ -2530,6 +2616,7 @@ static int scst_process_dev_sysfs_threads_data_store(
 
 	dev->threads_num = threads_num;
 	dev->threads_pool_type = threads_pool_type;
+	dev->dev_numa_node = numa_node;
 
 	res = scst_create_dev_threads(dev);
 	if (res != 0)
@@ -2540,6 +2627,9 @@ static int scst_process_dev_sysfs_threads_data_store(
 	else if (oldtt != dev->threads_pool_type)
 		PRINT_INFO("Changed cmd threads pool type to %d",
 			dev->threads_pool_type);
+	else if (oldnode != dev->dev_numa_node)
+		PRINT_INFO("Changed cmd threads NUMA node to %d",
+			dev->dev_numa_node);
 
 out_unlock:
 	mutex_unlock(&scst_mutex);
@@ -2556,12 +2646,14 @@ static int scst_dev_sysfs_threads_data_store_work_fn(
 	struct scst_sysfs_work_item *work)
 {
 	return scst_process_dev_sysfs_threads_data_store(work->dev,
-		work->new_threads_num, work->new_threads_pool_type);
+		work->new_threads_num, work->new_threads_pool_type,
+		work->new_numa_node);
 }
 
 static ssize_t scst_dev_sysfs_check_threads_data(
 	struct scst_device *dev, int threads_num,
-	enum scst_dev_type_threads_pool_type threads_pool_type, bool *stop)
+	enum scst_dev_type_threads_pool_type threads_pool_type, int numa_node,
+	bool *stop)
 {
 	int res = 0;
 
@@ -2577,7 +2669,8 @@ static ssize_t scst_dev_sysfs_check_threads_data(
 	}
 
 	if ((threads_num == dev->threads_num) &&
-	    (threads_pool_type == dev->threads_pool_type)) {
+	    (threads_pool_type == dev->threads_pool_type) &&
+	    (numa_node == dev->dev_numa_node)) {
 		*stop = true;
 		goto out;
 	}
@@ -2634,7 +2727,7 @@ static ssize_t scst_dev_sysfs_threads_num_store(struct kobject *kobj,
 	}
 
 	res = scst_dev_sysfs_check_threads_data(dev, newtn,
-		dev->threads_pool_type, &stop);
+		dev->threads_pool_type, dev->dev_numa_node, &stop);
 	if ((res != 0) || stop)
 		goto out;
 
@@ -2646,6 +2739,7 @@ static ssize_t scst_dev_sysfs_threads_num_store(struct kobject *kobj,
 	work->dev = dev;
 	work->new_threads_num = newtn;
 	work->new_threads_pool_type = dev->threads_pool_type;
+	work->new_numa_node = dev->dev_numa_node;
 
 	res = scst_sysfs_queue_wait_work(work);
 
@@ -2724,7 +2818,7 @@ static ssize_t scst_dev_sysfs_threads_pool_type_store(struct kobject *kobj,
 	TRACE_DBG("buf %s, count %zd, newtpt %d", buf, count, newtpt);
 
 	res = scst_dev_sysfs_check_threads_data(dev, dev->threads_num,
-		newtpt, &stop);
+		newtpt, dev->dev_numa_node, &stop);
 	if ((res != 0) || stop)
 		goto out;
 
@@ -2736,6 +2830,7 @@ static ssize_t scst_dev_sysfs_threads_pool_type_store(struct kobject *kobj,
 	work->dev = dev;
 	work->new_threads_num = dev->threads_num;
 	work->new_threads_pool_type = newtpt;
+	work->new_numa_node = dev->dev_numa_node;
 
 	res = scst_sysfs_queue_wait_work(work);
 
@@ -2752,8 +2847,130 @@ static struct kobj_attribute dev_threads_pool_type_attr =
 		scst_dev_sysfs_threads_pool_type_show,
 		scst_dev_sysfs_threads_pool_type_store);
 
+static ssize_t scst_dev_sysfs_numa_node_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	pos = sprintf(buf, "%d\n%s", dev->dev_numa_node,
+		(dev->dev_numa_node != NUMA_NO_NODE) ?
+			SCST_SYSFS_KEY_MARK "\n" : "");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t scst_dev_sysfs_numa_node_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	struct scst_device *dev;
+	int newnode;
+	bool stop;
+	struct scst_sysfs_work_item *work;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	res = scst_sysfs_parse_numa_node(buf, &newnode);
+	if (res != 0)
+		goto out;
+
+	res = scst_dev_sysfs_check_threads_data(dev, dev->threads_num,
+		dev->threads_pool_type, newnode, &stop);
+	if ((res != 0) || stop)
+		goto out;
+
+	res = scst_alloc_sysfs_work(scst_dev_sysfs_threads_data_store_work_fn,
+					false, &work);
+	if (res != 0)
+		goto out;
+
+	work->dev = dev;
+	work->new_threads_num = dev->threads_num;
+	work->new_threads_pool_type = dev->threads_pool_type;
+	work->new_numa_node = newnode;
+
+	res = scst_sysfs_queue_wait_work(work);
+
+out:
+	if (res == 0)
+		res = count;
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute dev_numa_node_attr =
+	__ATTR(numa_node, S_IRUGO | S_IWUSR,
+		scst_dev_sysfs_numa_node_show,
+		scst_dev_sysfs_numa_node_store);
+
+static ssize_t scst_dev_sysfs_xcopy_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos;
+	struct scst_device *dev;
+	uint64_t cmds, bytes, time_ms, read_bytes, written_bytes;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	spin_lock_bh(&dev->dev_lock);
+	cmds = dev->xcopy_cmds;
+	bytes = dev->xcopy_bytes;
+	time_ms = dev->xcopy_time_ms;
+	read_bytes = dev->xcopy_read_bytes;
+	written_bytes = dev->xcopy_written_bytes;
+	spin_unlock_bh(&dev->dev_lock);
+
+	pos = sprintf(buf, "EXTENDED COPY commands %llu\n"
+		"Copied bytes %llu\nCopy time %llu ms\n"
+		"Read as source bytes %llu\nWritten as destination bytes %llu\n",
+		(unsigned long long)cmds, (unsigned long long)bytes,
+		(unsigned long long)time_ms, (unsigned long long)read_bytes,
+		(unsigned long long)written_bytes);
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t scst_dev_sysfs_xcopy_stats_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct scst_device *dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	spin_lock_bh(&dev->dev_lock);
+	dev->xcopy_cmds = 0;
+	dev->xcopy_bytes = 0;
+	dev->xcopy_time_ms = 0;
+	dev->xcopy_read_bytes = 0;
+	dev->xcopy_written_bytes = 0;
+	spin_unlock_bh(&dev->dev_lock);
+
+	TRACE_EXIT_RES(count);
+	return count;
+}
+
+static struct kobj_attribute dev_xcopy_stats_attr =
+	__ATTR(xcopy_stats, S_IRUGO | S_IWUSR,
+		scst_dev_sysfs_xcopy_stats_show,
+		scst_dev_sysfs_xcopy_stats_store);
+
 static struct attribute *scst_dev_attrs[] = {
 	&dev_type_attr.attr,
+	&dev_xcopy_stats_attr.attr,
 	NULL,
 };
 
@@ -2813,6 +3030,14 @@ int scst_devt_dev_sysfs_create(struct scst_device *dev)
 				dev->virt_name);
 			goto out_err;
 		}
+		res = sysfs_create_file(&dev->dev_kobj,
+				&dev_numa_node_attr.attr);
+		if (res != 0) {
+			PRINT_ERROR("Can't add dev attr %s for dev %s",
+				dev_numa_node_attr.attr.name,
+				dev->virt_name);
+			goto out_err;
+		}
 	}
 
 	if (dev->handler->dev_attrs) {
@@ -2852,6 +3077,8 @@ void scst_devt_dev_sysfs_del(struct scst_device *dev)
 			&dev_threads_num_attr.attr);
 		sysfs_remove_file(&dev->dev_kobj,
 			&dev_threads_pool_type_attr.attr);
+		sysfs_remove_file(&dev->dev_kobj,
+			&dev_numa_node_attr.attr);
 	}
 
 out:
@@ -3501,6 +3728,36 @@ static struct kobj_attribute session_initiator_name_attr =
 	__ATTR(initiator_name, S_IRUGO, scst_sess_sysfs_initiator_name_show,
 	       NULL);
 
+static ssize_t scst_sess_sysfs_lun_hash_lookups_show(struct kobject *kobj,
+			    struct kobj_attribute *attr, char *buf)
+{
+	struct scst_session *sess;
+
+	sess = container_of(kobj, struct scst_session, sess_kobj);
+
+	return sprintf(buf, "%ld\n",
+		atomic_long_read(&sess->tgt_dev_hash_lookups));
+}
+
+static struct kobj_attribute session_lun_hash_lookups_attr =
+	__ATTR(lun_hash_lookups, S_IRUGO,
+	       scst_sess_sysfs_lun_hash_lookups_show, NULL);
+
+static ssize_t scst_sess_sysfs_lun_hash_lookup_steps_show(
+	struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct scst_session *sess;
+
+	sess = container_of(kobj, struct scst_session, sess_kobj);
+
+	return sprintf(buf, "%ld\n",
+		atomic_long_read(&sess->tgt_dev_hash_lookup_steps));
+}
+
+static struct kobj_attribute session_lun_hash_lookup_steps_attr =
+	__ATTR(lun_hash_lookup_steps, S_IRUGO,
+	       scst_sess_sysfs_lun_hash_lookup_steps_show, NULL);
+
 #define SCST_SESS_SYSFS_STAT_ATTR(name, exported_name, dir, kb)		\
 static ssize_t scst_sess_sysfs_##exported_name##_show(struct kobject *kobj,	\
 	struct kobj_attribute *attr, char *buf)					\
@@ -3556,6 +3813,8 @@ static struct attribute *scst_session_attrs[] = {
 	&session_commands_attr.attr,
 	&session_active_commands_attr.attr,
 	&session_initiator_name_attr.attr,
+	&session_lun_hash_lookups_attr.attr,
+	&session_lun_hash_lookup_steps_attr.attr,
 	&session_unknown_cmd_count_attr.attr,
 	&session_write_cmd_count_attr.attr,
 	&session_write_io_count_kb_attr.attr,
@@ -5710,6 +5969,60 @@ static struct kobj_attribute scst_max_tasklet_cmd_attr =
 	__ATTR(max_tasklet_cmd, S_IRUGO | S_IWUSR, scst_max_tasklet_cmd_show,
 	       scst_max_tasklet_cmd_store);
 
+static ssize_t scst_cmd_batch_size_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	int count;
+
+	TRACE_ENTRY();
+
+	count = sprintf(buf, "%d\n%s\n", scst_cmd_batch_size,
+		(scst_cmd_batch_size == SCST_DEF_CMD_BATCH_SIZE)
+			? "" : SCST_SYSFS_KEY_MARK);
+
+	TRACE_EXIT();
+	return count;
+}
+
+static ssize_t scst_cmd_batch_size_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	unsigned long val;
+
+	TRACE_ENTRY();
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+	res = kstrtoul(buf, 0, &val);
+#else
+	res = strict_strtoul(buf, 0, &val);
+#endif
+	if (res != 0) {
+		PRINT_ERROR("strict_strtoul() for %s failed: %d ", buf, res);
+		goto out;
+	}
+
+	if ((val < 1) || (val > SCST_MAX_CMD_BATCH_SIZE)) {
+		PRINT_ERROR("Illegal cmd batch size %lu (allowed 1 - %d)", val,
+			SCST_MAX_CMD_BATCH_SIZE);
+		res = -EINVAL;
+		goto out;
+	}
+
+	scst_cmd_batch_size = val;
+	PRINT_INFO("Changed scst_cmd_batch_size to %d", scst_cmd_batch_size);
+
+	res = count;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute scst_cmd_batch_size_attr =
+	__ATTR(cmd_batch_size, S_IRUGO | S_IWUSR, scst_cmd_batch_size_show,
+	       scst_cmd_batch_size_store);
+
 #if defined(CONFIG_SCST_DEBUG) || defined(CONFIG_SCST_TRACING)
 
 static ssize_t scst_main_trace_level_show(struct kobject *kobj,
@@ -5832,6 +6145,7 @@ static struct attribute *scst_sysfs_root_default_attrs[] = {
 	&scst_threads_attr.attr,
 	&scst_setup_id_attr.attr,
 	&scst_max_tasklet_cmd_attr.attr,
+	&scst_cmd_batch_size_attr.attr,
 #if defined(CONFIG_SCST_DEBUG) || defined(CONFIG_SCST_TRACING)
 	&scst_main_trace_level_attr.attr,
 #endif
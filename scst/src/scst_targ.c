@@ -94,6 +94,7 @@ static inline void scst_schedule_tasklet(struct scst_cmd *cmd)
 			"active cmd list", atomic_read(&i->cpu_cmd_count), cmd);
 		list_add_tail(&cmd->cmd_list_entry,
 			&cmd->cmd_threads->active_cmd_list);
+		cmd->cmd_threads->active_cmd_cnt++;
 		wake_up(&cmd->cmd_threads->cmd_list_waitQ);
 		spin_unlock_irqrestore(&cmd->cmd_threads->cmd_list_lock, flags);
 	}
@@ -108,7 +109,7 @@ static bool scst_check_blocked_dev(struct scst_cmd *cmd)
 
 	TRACE_ENTRY();
 
-	if (unlikely(cmd->internal)) {
+	if (unlikely(cmd->internal) && !cmd->internal_other_dev) {
 		/*
 		 * The original command can already block the device and must
 		 * hold reference to it, so internal command should always pass.
@@ -124,7 +125,9 @@ static bool scst_check_blocked_dev(struct scst_cmd *cmd)
 	cmd->dec_on_dev_needed = 1;
 	TRACE_DBG("New inc on_dev_count %d (cmd %p)", dev->on_dev_cmd_count, cmd);
 
-	scst_inc_pr_readers_count(cmd, true);
+	/* Reservations of internal cmds are checked by their creators */
+	if (likely(!cmd->internal))
+		scst_inc_pr_readers_count(cmd, true);
 
 	if (unlikely(dev->block_count > 0) ||
 	    unlikely(dev->dev_double_ua_possible) ||
@@ -140,7 +143,8 @@ static bool scst_check_blocked_dev(struct scst_cmd *cmd)
 		TRACE_DBG("New dec on_dev_count %d (cmd %p)",
 			dev->on_dev_cmd_count, cmd);
 
-		scst_dec_pr_readers_count(cmd, true);
+		if (likely(!cmd->internal))
+			scst_dec_pr_readers_count(cmd, true);
 	}
 
 	spin_unlock_bh(&dev->dev_lock);
@@ -389,9 +393,13 @@ void scst_cmd_init_done(struct scst_cmd *cmd,
 		 * TM processing. This check is needed because there might be
 		 * old, i.e. deferred, commands and new, i.e. just coming, ones.
 		 */
-		if (cmd->sess_cmd_list_entry.next == NULL)
+		if (cmd->sess_cmd_list_entry.next == NULL) {
 			list_add_tail(&cmd->sess_cmd_list_entry,
 				&sess->sess_cmd_list);
+			list_add_tail(&cmd->sess_cmd_tag_hash_entry,
+				&sess->sess_cmd_tag_hash[
+					SESS_CMD_TAG_HASH_FN(cmd->tag)]);
+		}
 		switch (sess->init_phase) {
 		case SCST_SESS_IPH_SUCCESS:
 			break;
@@ -409,9 +417,12 @@ void scst_cmd_init_done(struct scst_cmd *cmd,
 		default:
 			sBUG();
 		}
-	} else
+	} else {
 		list_add_tail(&cmd->sess_cmd_list_entry,
 			      &sess->sess_cmd_list);
+		list_add_tail(&cmd->sess_cmd_tag_hash_entry,
+			&sess->sess_cmd_tag_hash[SESS_CMD_TAG_HASH_FN(cmd->tag)]);
+	}
 
 	spin_unlock_irqrestore(&sess->sess_list_lock, flags);
 
@@ -457,6 +468,7 @@ active:
 		else
 			list_add_tail(&cmd->cmd_list_entry,
 				&cmd->cmd_threads->active_cmd_list);
+		cmd->cmd_threads->active_cmd_cnt++;
 		wake_up(&cmd->cmd_threads->cmd_list_waitQ);
 		spin_unlock_irqrestore(&cmd->cmd_threads->cmd_list_lock, flags);
 		break;
@@ -1398,6 +1410,7 @@ static void scst_process_redirect_cmd(struct scst_cmd *cmd,
 		else
 			list_add_tail(&cmd->cmd_list_entry,
 				&cmd->cmd_threads->active_cmd_list);
+		cmd->cmd_threads->active_cmd_cnt++;
 		wake_up(&cmd->cmd_threads->cmd_list_waitQ);
 		spin_unlock_irqrestore(&cmd->cmd_threads->cmd_list_lock, flags);
 		break;
@@ -3744,6 +3757,7 @@ static int scst_finish_cmd(struct scst_cmd *cmd)
 	stat->io_byte_count += cmd->bufflen + cmd->out_bufflen;
 
 	list_del(&cmd->sess_cmd_list_entry);
+	list_del(&cmd->sess_cmd_tag_hash_entry);
 
 	/*
 	 * Done under sess_list_lock to sync with scst_abort_cmd() without
@@ -3901,24 +3915,20 @@ static int scst_translate_lun(struct scst_cmd *cmd)
 	cmd->cpu_cmd_counter = scst_get();
 
 	if (likely(!test_bit(SCST_FLAG_SUSPENDED, &scst_flags))) {
-		struct list_head *head =
-			&cmd->sess->sess_tgt_dev_list[SESS_TGT_DEV_LIST_HASH_FN(cmd->lun)];
 		TRACE_DBG("Finding tgt_dev for cmd %p (lun %lld)", cmd,
 			(long long unsigned int)cmd->lun);
 		res = -1;
-		list_for_each_entry(tgt_dev, head, sess_tgt_dev_list_entry) {
-			if (tgt_dev->lun == cmd->lun) {
-				TRACE_DBG("tgt_dev %p found", tgt_dev);
-
-				if (unlikely(tgt_dev->dev->handler ==
-						&scst_null_devtype)) {
-					PRINT_INFO("Dev handler for device "
-					  "%lld is NULL, the device will not "
-					  "be visible remotely",
-					   (long long unsigned int)cmd->lun);
-					break;
-				}
+		tgt_dev = scst_lookup_tgt_dev(cmd->sess, cmd->lun);
+		if (likely(tgt_dev != NULL)) {
+			TRACE_DBG("tgt_dev %p found", tgt_dev);
 
+			if (unlikely(tgt_dev->dev->handler ==
+					&scst_null_devtype)) {
+				PRINT_INFO("Dev handler for device "
+				  "%lld is NULL, the device will not "
+				  "be visible remotely",
+				   (long long unsigned int)cmd->lun);
+			} else {
 				cmd->cmd_threads = tgt_dev->active_cmd_threads;
 				cmd->tgt_dev = tgt_dev;
 				cmd->cur_order_data = tgt_dev->curr_order_data;
@@ -3926,7 +3936,6 @@ static int scst_translate_lun(struct scst_cmd *cmd)
 				cmd->devt = tgt_dev->dev->handler;
 
 				res = 0;
-				break;
 			}
 		}
 		if (res != 0) {
@@ -4098,6 +4107,7 @@ restart:
 		else
 			list_add_tail(&cmd->cmd_list_entry,
 				&cmd->cmd_threads->active_cmd_list);
+		cmd->cmd_threads->active_cmd_cnt++;
 		wake_up(&cmd->cmd_threads->cmd_list_waitQ);
 		spin_unlock(&cmd->cmd_threads->cmd_list_lock);
 
@@ -4394,6 +4404,7 @@ void scst_process_active_cmd(struct scst_cmd *cmd, bool atomic)
 				  cmd);
 			list_add(&cmd->cmd_list_entry,
 				&cmd->cmd_threads->active_cmd_list);
+			cmd->cmd_threads->active_cmd_cnt++;
 #ifdef CONFIG_SCST_EXTRACHECKS
 			break;
 		default:
@@ -4415,21 +4426,65 @@ void scst_process_active_cmd(struct scst_cmd *cmd, bool atomic)
 }
 EXPORT_SYMBOL_GPL(scst_process_active_cmd);
 
-/* Called under cmd_list_lock and IRQs disabled */
+/*
+ * Called under cmd_list_lock and IRQs disabled. Moves up to
+ * scst_cmd_batch_size commands from cmd_list to batch. If cmd_list is
+ * active_cmd_list of cmd_threads, to not starve other threads of the
+ * pool, no more than their fair share of the queued commands is taken.
+ */
+static void scst_get_cmd_batch(struct list_head *cmd_list,
+	struct list_head *batch, struct scst_cmd_threads *cmd_threads)
+{
+	int max = scst_cmd_batch_size, n;
+
+	if ((cmd_threads != NULL) && (cmd_threads->nr_threads > 1))
+		max = min(max, DIV_ROUND_UP(cmd_threads->active_cmd_cnt,
+					    cmd_threads->nr_threads));
+
+	n = 0;
+	do {
+		struct scst_cmd *cmd = list_first_entry(cmd_list, typeof(*cmd),
+					cmd_list_entry);
+		TRACE_DBG("Moving cmd %p from active cmd list to batch", cmd);
+		list_move_tail(&cmd->cmd_list_entry, batch);
+		n++;
+	} while ((n < max) && !list_empty(cmd_list));
+
+	if (cmd_threads != NULL) {
+		cmd_threads->active_cmd_cnt -= n;
+		EXTRACHECKS_WARN_ON(list_empty(cmd_list) !=
+				    (cmd_threads->active_cmd_cnt == 0));
+	}
+
+	return;
+}
+
+/*
+ * Called under cmd_list_lock and IRQs disabled. cmd_threads is the owner
+ * of cmd_list or NULL, if cmd_list is a tasklet's list.
+ */
 static void scst_do_job_active(struct list_head *cmd_list,
-	spinlock_t *cmd_list_lock, bool atomic)
+	spinlock_t *cmd_list_lock, bool atomic,
+	struct scst_cmd_threads *cmd_threads)
 	__releases(cmd_list_lock)
 	__acquires(cmd_list_lock)
 {
 	TRACE_ENTRY();
 
 	while (!list_empty(cmd_list)) {
-		struct scst_cmd *cmd = list_first_entry(cmd_list, typeof(*cmd),
-					cmd_list_entry);
-		TRACE_DBG("Deleting cmd %p from active cmd list", cmd);
-		list_del(&cmd->cmd_list_entry);
+		LIST_HEAD(batch);
+
+		scst_get_cmd_batch(cmd_list, &batch, cmd_threads);
 		spin_unlock_irq(cmd_list_lock);
-		scst_process_active_cmd(cmd, atomic);
+
+		while (!list_empty(&batch)) {
+			struct scst_cmd *cmd = list_first_entry(&batch,
+					typeof(*cmd), cmd_list_entry);
+			/* cmd_list_entry can be reused during processing */
+			list_del(&cmd->cmd_list_entry);
+			scst_process_active_cmd(cmd, atomic);
+		}
+
 		spin_lock_irq(cmd_list_lock);
 	}
 
@@ -4474,7 +4529,7 @@ int scst_cmd_thread(void *arg)
 		}
 
 		scst_do_job_active(&p_cmd_threads->active_cmd_list,
-			&p_cmd_threads->cmd_list_lock, false);
+			&p_cmd_threads->cmd_list_lock, false, p_cmd_threads);
 	}
 	spin_unlock_irq(&p_cmd_threads->cmd_list_lock);
 
@@ -4494,7 +4549,7 @@ void scst_cmd_tasklet(long p)
 	TRACE_ENTRY();
 
 	spin_lock_irq(&i->tasklet_lock);
-	scst_do_job_active(&i->tasklet_cmd_list, &i->tasklet_lock, true);
+	scst_do_job_active(&i->tasklet_cmd_list, &i->tasklet_lock, true, NULL);
 	spin_unlock_irq(&i->tasklet_lock);
 
 	TRACE_EXIT();
@@ -4509,7 +4564,6 @@ void scst_cmd_tasklet(long p)
 static int scst_mgmt_translate_lun(struct scst_mgmt_cmd *mcmd)
 {
 	struct scst_tgt_dev *tgt_dev;
-	struct list_head *head;
 	int res = -1;
 
 	TRACE_ENTRY();
@@ -4527,14 +4581,11 @@ static int scst_mgmt_translate_lun(struct scst_mgmt_cmd *mcmd)
 		goto out;
 	}
 
-	head = &mcmd->sess->sess_tgt_dev_list[SESS_TGT_DEV_LIST_HASH_FN(mcmd->lun)];
-	list_for_each_entry(tgt_dev, head, sess_tgt_dev_list_entry) {
-		if (tgt_dev->lun == mcmd->lun) {
-			TRACE_DBG("tgt_dev %p found", tgt_dev);
-			mcmd->mcmd_tgt_dev = tgt_dev;
-			res = 0;
-			break;
-		}
+	tgt_dev = scst_lookup_tgt_dev(mcmd->sess, mcmd->lun);
+	if (tgt_dev != NULL) {
+		TRACE_DBG("tgt_dev %p found", tgt_dev);
+		mcmd->mcmd_tgt_dev = tgt_dev;
+		res = 0;
 	}
 	if (mcmd->mcmd_tgt_dev == NULL)
 		scst_put(mcmd->cpu_cmd_counter);
@@ -5003,6 +5054,7 @@ static bool __scst_check_unblock_aborted_cmd(struct scst_cmd *cmd,
 		spin_lock(&cmd->cmd_threads->cmd_list_lock);
 		list_add_tail(&cmd->cmd_list_entry,
 			&cmd->cmd_threads->active_cmd_list);
+		cmd->cmd_threads->active_cmd_cnt++;
 		wake_up(&cmd->cmd_threads->cmd_list_waitQ);
 		spin_unlock(&cmd->cmd_threads->cmd_list_lock);
 		res = 1;
@@ -5138,8 +5190,7 @@ static int scst_abort_task_set(struct scst_mgmt_cmd *mcmd)
 static int scst_is_cmd_belongs_to_dev(struct scst_cmd *cmd,
 	struct scst_device *dev)
 {
-	struct scst_tgt_dev *tgt_dev = NULL;
-	struct list_head *head;
+	struct scst_tgt_dev *tgt_dev;
 	int res = 0;
 
 	TRACE_ENTRY();
@@ -5147,16 +5198,12 @@ static int scst_is_cmd_belongs_to_dev(struct scst_cmd *cmd,
 	TRACE_DBG("Finding match for dev %s and cmd %p (lun %lld)", dev->virt_name,
 		cmd, (long long unsigned int)cmd->lun);
 
-	head = &cmd->sess->sess_tgt_dev_list[SESS_TGT_DEV_LIST_HASH_FN(cmd->lun)];
-	list_for_each_entry(tgt_dev, head, sess_tgt_dev_list_entry) {
-		if (tgt_dev->lun == cmd->lun) {
-			TRACE_DBG("dev %s found", tgt_dev->dev->virt_name);
-			res = (tgt_dev->dev == dev);
-			goto out;
-		}
+	tgt_dev = scst_lookup_tgt_dev(cmd->sess, cmd->lun);
+	if (tgt_dev != NULL) {
+		TRACE_DBG("dev %s found", tgt_dev->dev->virt_name);
+		res = (tgt_dev->dev == dev);
 	}
 
-out:
 	TRACE_EXIT_HRES(res);
 	return res;
 }
@@ -6884,17 +6931,16 @@ static struct scst_cmd *__scst_find_cmd_by_tag(struct scst_session *sess,
 	uint64_t tag, bool to_abort)
 {
 	struct scst_cmd *cmd, *res = NULL;
+	struct list_head *head;
 
 	TRACE_ENTRY();
 
-	/* ToDo: hash list */
-
-	TRACE_DBG("%s (sess=%p, tag=%llu)", "Searching in sess cmd list",
+	TRACE_DBG("%s (sess=%p, tag=%llu)", "Searching in sess cmd tag hash",
 		  sess, (long long unsigned int)tag);
 
-	list_for_each_entry(cmd, &sess->sess_cmd_list,
-			sess_cmd_list_entry) {
-		if ((cmd->tag == tag) && likely(!cmd->internal)) {
+	head = &sess->sess_cmd_tag_hash[SESS_CMD_TAG_HASH_FN(tag)];
+	list_for_each_entry(cmd, head, sess_cmd_tag_hash_entry) {
+		if (cmd->tag == tag) {
 			/*
 			 * We must not count done commands, because
 			 * they were submitted for transmission.
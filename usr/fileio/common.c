@@ -620,6 +620,82 @@ static int open_dev_fd(struct vdisk_dev *dev)
 	return res;
 }
 
+/*
+ * Processes subcommand vcmd->cmd and prepares its reply in vcmd->reply.
+ * Returns 0 on success, 150 if the reply must not be sent (DEBUG_TM_IGNORE)
+ * or an error code otherwise.
+ */
+static int process_cmd(struct vdisk_cmd *vcmd)
+{
+	struct scst_user_get_cmd *cmd = vcmd->cmd;
+	struct scst_user_reply_cmd *reply = vcmd->reply;
+	int res;
+
+	TRACE_BUFFER("Received cmd", cmd, sizeof(*cmd));
+
+	switch(cmd->subcode) {
+	case SCST_USER_EXEC:
+		if (cmd->exec_cmd.data_direction & SCST_DATA_WRITE) {
+			TRACE_BUFFER("Received cmd data",
+				(void *)(unsigned long)cmd->exec_cmd.pbuf,
+				cmd->exec_cmd.bufflen);
+		}
+		res = do_exec(vcmd);
+#ifdef DEBUG_TM_IGNORE
+		if (res == 150)
+			break;
+#endif
+		if (reply->exec_reply.resp_data_len != 0) {
+			TRACE_BUFFER("Reply data",
+				(void *)(unsigned long)reply->exec_reply.pbuf,
+				reply->exec_reply.resp_data_len);
+		}
+		break;
+
+	case SCST_USER_ALLOC_MEM:
+		res = do_alloc_mem(vcmd);
+		break;
+
+	case SCST_USER_PARSE:
+		res = do_parse(vcmd);
+		break;
+
+	case SCST_USER_ON_CACHED_MEM_FREE:
+		res = do_cached_mem_free(vcmd);
+		break;
+
+	case SCST_USER_ON_FREE_CMD:
+		res = do_on_free_cmd(vcmd);
+		break;
+
+	case SCST_USER_TASK_MGMT_RECEIVED:
+		res = do_tm(vcmd, 0);
+		break;
+
+	case SCST_USER_TASK_MGMT_DONE:
+		res = do_tm(vcmd, 1);
+#if DEBUG_TM_FN_IGNORE
+		if (vcmd->dev->debug_tm_ignore) {
+			sleep(15);
+		}
+#endif
+		break;
+
+	case SCST_USER_ATTACH_SESS:
+	case SCST_USER_DETACH_SESS:
+		res = do_sess(vcmd);
+		break;
+
+	default:
+		PRINT_ERROR("Unknown or wrong cmd subcode %x",
+			cmd->subcode);
+		res = EINVAL;
+		break;
+	}
+
+	return res;
+}
+
 void *main_loop(void *arg)
 {
 	int res = 0;
@@ -716,74 +792,258 @@ again_poll:
 			}
 		}
 
-		TRACE_BUFFER("Received cmd", &cmd, sizeof(cmd));
+		res = process_cmd(&vcmd);
+#ifdef DEBUG_TM_IGNORE
+		if (res == 150) {
+			cmd.preply = 0;
+			continue;
+		}
+#endif
+
+		if (res != 0)
+			goto out_close;
+
+		cmd.preply = (unsigned long)&reply;
+		TRACE_BUFFER("Sending reply", &reply, sizeof(reply));
+	}
+
+out_close:
+	close(vcmd.fd);
+
+out:
+	PRINT_INFO("Thread %d exiting (res=%d)", gettid(), res);
+
+	TRACE_EXIT_RES(res);
+	return (void *)(long)res;
+}
+
+/*
+ * Same as main_loop(), but gets and replies up to dev->multi_cnt commands
+ * per SCST_USER_REPLY_AND_GET_MULTI call.
+ */
+void *multi_loop(void *arg)
+{
+	int res = 0;
+	struct vdisk_dev *dev = (struct vdisk_dev *)arg;
+	struct scst_user_get_multi *multi;
+	struct scst_user_reply_cmd *replies;
+	struct vdisk_cmd vcmd = { -1, NULL, dev, NULL, {0}};
+	int scst_usr_fd = dev->scst_usr_fd;
+	int i, replies_cnt = 0;
+	struct pollfd pl;
+
+	TRACE_ENTRY();
+
+	multi = malloc(sizeof(*multi) + dev->multi_cnt * sizeof(multi->cmds[0]));
+	replies = malloc(dev->multi_cnt * sizeof(*replies));
+	if ((multi == NULL) || (replies == NULL)) {
+		res = ENOMEM;
+		PRINT_ERROR("%s", "Unable to allocate multi buffers");
+		goto out_free;
+	}
+
+	vcmd.fd = open_dev_fd(dev);
+	if (vcmd.fd < 0) {
+		res = -errno;
+		PRINT_ERROR("Unable to open file %s (%s)", dev->file_name,
+			strerror(-res));
+		goto out_free;
+	}
+
+	memset(&pl, 0, sizeof(pl));
+	pl.fd = scst_usr_fd;
+	pl.events = POLLIN;
 
-		switch(cmd.subcode) {
-		case SCST_USER_EXEC:
-			if (cmd.exec_cmd.data_direction & SCST_DATA_WRITE) {
-				TRACE_BUFFER("Received cmd data",
-					(void *)(unsigned long)cmd.exec_cmd.pbuf,
-					cmd.exec_cmd.bufflen);
+	while(1) {
+		multi->preplies = (unsigned long)replies;
+		multi->replies_cnt = replies_cnt;
+		multi->replies_done = 0;
+		multi->cmds_cnt = dev->multi_cnt;
+
+		res = ioctl(scst_usr_fd, SCST_USER_REPLY_AND_GET_MULTI, multi);
+		if (res != 0) {
+			res = errno;
+			i = multi->replies_done;
+			if (i < replies_cnt) {
+				/* Drop the failed reply, as main_loop() does */
+				TRACE_MGMT_DBG("SCST_USER_REPLY_AND_GET_MULTI "
+					"failed on reply %d: %s (%d)", i,
+					strerror(res), res);
+				i++;
 			}
-			res = do_exec(&vcmd);
-#ifdef DEBUG_TM_IGNORE
-			if (res == 150) {
-				cmd.preply = 0;
+			replies_cnt -= i;
+			memmove(replies, &replies[i],
+				replies_cnt * sizeof(*replies));
+			switch(res) {
+			case ESRCH:
+			case EBUSY:
+			case EINTR:
+				continue;
+			case EAGAIN:
+				TRACE_DBG("SCST_USER_REPLY_AND_GET_MULTI returned "
+					"EAGAIN (%d)", res);
+				if (dev->non_blocking)
+					break;
+				else
+					continue;
+			default:
+				PRINT_ERROR("SCST_USER_REPLY_AND_GET_MULTI failed: "
+					"%s (%d)", strerror(res), res);
 				continue;
 			}
-#endif
-			if (reply.exec_reply.resp_data_len != 0) {
-				TRACE_BUFFER("Reply data",
-					(void *)(unsigned long)reply.exec_reply.pbuf,
-					reply.exec_reply.resp_data_len);
+again_poll:
+			res = poll(&pl, 1, 2000);
+			if (res > 0)
+				continue;
+			else if (res == 0)
+				goto again_poll;
+			else {
+				res = errno;
+				if (res != EINTR)
+					PRINT_ERROR("poll() failed: %s",
+						strerror(res));
+				goto again_poll;
 			}
-			break;
+		}
 
-		case SCST_USER_ALLOC_MEM:
-			res = do_alloc_mem(&vcmd);
-			break;
+		replies_cnt = 0;
+		for (i = 0; i < multi->cmds_cnt; i++) {
+			vcmd.cmd = &multi->cmds[i];
+			vcmd.reply = &replies[replies_cnt];
 
-		case SCST_USER_PARSE:
-			res = do_parse(&vcmd);
-			break;
+			res = process_cmd(&vcmd);
+#ifdef DEBUG_TM_IGNORE
+			if (res == 150)
+				continue;
+#endif
+			if (res != 0)
+				goto out_close;
 
-		case SCST_USER_ON_CACHED_MEM_FREE:
-			res = do_cached_mem_free(&vcmd);
-			break;
+			TRACE_BUFFER("Sending reply", vcmd.reply,
+				sizeof(*vcmd.reply));
+			replies_cnt++;
+		}
+	}
 
-		case SCST_USER_ON_FREE_CMD:
-			res = do_on_free_cmd(&vcmd);
-			break;
+out_close:
+	close(vcmd.fd);
 
-		case SCST_USER_TASK_MGMT_RECEIVED:
-			res = do_tm(&vcmd, 0);
-			break;
+out_free:
+	free(multi);
+	free(replies);
 
-		case SCST_USER_TASK_MGMT_DONE:
-			res = do_tm(&vcmd, 1);
-#if DEBUG_TM_FN_IGNORE
-			if (dev->debug_tm_ignore) {
-				sleep(15);
-			}
-#endif
-			break;
+	PRINT_INFO("Thread %d exiting (res=%d)", gettid(), res);
 
-		case SCST_USER_ATTACH_SESS:
-		case SCST_USER_DETACH_SESS:
-			res = do_sess(&vcmd);
-			break;
+	TRACE_EXIT_RES(res);
+	return (void *)(long)res;
+}
 
-		default:
-			PRINT_ERROR("Unknown or wrong cmd subcode %x",
-				cmd.subcode);
-			goto out_close;
+/*
+ * Serves all commands of the device by a single thread through the shared
+ * with SCST commands and replies rings, see SCST_USER_SETUP_RING.
+ */
+void *ring_loop(void *arg)
+{
+	int res = 0;
+	struct vdisk_dev *dev = (struct vdisk_dev *)arg;
+	struct scst_user_get_cmd cmd;
+	struct scst_user_reply_cmd reply;
+	struct vdisk_cmd vcmd = { -1, &cmd, dev, &reply, {0}};
+	int scst_usr_fd = dev->scst_usr_fd;
+	volatile struct scst_user_ring_hdr *hdr = dev->ring;
+	struct scst_user_get_cmd *cmds;
+	struct scst_user_reply_cmd *replies;
+	uint32_t mask, cmd_head, cmd_tail, reply_tail;
+	struct pollfd pl;
+
+	TRACE_ENTRY();
+
+	vcmd.fd = open_dev_fd(dev);
+	if (vcmd.fd < 0) {
+		res = -errno;
+		PRINT_ERROR("Unable to open file %s (%s)", dev->file_name,
+			strerror(-res));
+		goto out;
+	}
+
+	memset(&pl, 0, sizeof(pl));
+	pl.fd = scst_usr_fd;
+	pl.events = POLLIN;
+
+	cmds = (struct scst_user_get_cmd *)((char *)dev->ring + hdr->cmd_offs);
+	replies = (struct scst_user_reply_cmd *)((char *)dev->ring +
+			hdr->reply_offs);
+	mask = hdr->entries - 1;
+	cmd_head = hdr->cmd_head;
+	reply_tail = hdr->reply_tail;
+
+	while (1) {
+		res = ioctl(scst_usr_fd, SCST_USER_RING_KICK, NULL);
+		if (res < 0) {
+			res = errno;
+			switch (res) {
+			case EINTR:
+				continue;
+			case EAGAIN:
+				TRACE_DBG("SCST_USER_RING_KICK returned "
+					"EAGAIN (%d)", res);
+				if (dev->non_blocking)
+					break;
+				else
+					continue;
+			default:
+				PRINT_ERROR("SCST_USER_RING_KICK failed: "
+					"%s (%d)", strerror(res), res);
+				continue;
+			}
+again_poll:
+			res = poll(&pl, 1, 2000);
+			if (res > 0)
+				continue;
+			else if (res == 0)
+				goto again_poll;
+			else {
+				res = errno;
+				if (res != EINTR)
+					PRINT_ERROR("poll() failed: %s",
+						strerror(res));
+				goto again_poll;
+			}
 		}
 
-		if (res != 0)
-			goto out_close;
+		cmd_tail = hdr->cmd_tail;
+		/* Read the entries only after the tail */
+		__sync_synchronize();
 
-		cmd.preply = (unsigned long)&reply;
-		TRACE_BUFFER("Sending reply", &reply, sizeof(reply));
+		while (cmd_head != cmd_tail) {
+			/* Each command gets at most one reply */
+			if (reply_tail - hdr->reply_head > mask) {
+				PRINT_ERROR("Replies ring overflow (tail %u, "
+					"head %u)", reply_tail, hdr->reply_head);
+				res = EINVAL;
+				goto out_close;
+			}
+
+			cmd = cmds[cmd_head & mask];
+			cmd_head++;
+
+			res = process_cmd(&vcmd);
+#ifdef DEBUG_TM_IGNORE
+			if (res == 150)
+				continue;
+#endif
+			if (res != 0)
+				goto out_close;
+
+			TRACE_BUFFER("Sending reply", &reply, sizeof(reply));
+			replies[reply_tail & mask] = reply;
+			reply_tail++;
+		}
+
+		/* Write the replies before the indexes */
+		__sync_synchronize();
+		hdr->cmd_head = cmd_head;
+		hdr->reply_tail = reply_tail;
 	}
 
 out_close:
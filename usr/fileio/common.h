@@ -62,6 +62,12 @@ struct vdisk_dev {
 
 	pthread_mutex_t dev_mutex;
 
+	/* Max commands per SCST_USER_REPLY_AND_GET_MULTI, see multi_loop() */
+	int multi_cnt;
+
+	/* Shared with SCST rings, if used, see ring_loop() */
+	struct scst_user_ring_hdr *ring;
+
 	/* Below flags and are protected by dev_mutex */
 	unsigned int rd_only_flag:1;
 	unsigned int wt_flag:1;
@@ -122,3 +128,5 @@ uint32_t crc32buf(const char *buf, size_t len);
 
 uint64_t gen_dev_id_num(const struct vdisk_dev *dev);
 void *main_loop(void *arg);
+void *multi_loop(void *arg);
+void *ring_loop(void *arg);
@@ -32,6 +32,7 @@
 #include <sys/user.h>
 #include <sys/poll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #include <pthread.h>
 
@@ -94,6 +95,7 @@ static int debug_tm_ignore;
 #endif
 static int non_blocking, sgv_shared, sgv_single_alloc_pages, sgv_purge_interval;
 static int sgv_disable_clustered_pool, prealloc_buffers_num, prealloc_buffer_size;
+static int ring_entries, multi_cnt;
 
 static void *(*alloc_fn)(size_t size) = align_alloc;
 
@@ -119,6 +121,8 @@ static struct option const long_options[] =
 	{"sgv_disable_clustered_pool", no_argument, 0, 'D'},
 	{"prealloc_buffers", required_argument, 0, 'R'},
 	{"prealloc_buffer_size", required_argument, 0, 'Z'},
+	{"ring", required_argument, 0, 'q'},
+	{"multi", required_argument, 0, 'M'},
 #if defined(DEBUG) || defined(TRACING)
 	{"debug", required_argument, 0, 'd'},
 #endif
@@ -157,6 +161,8 @@ static void usage(void)
 	printf("  -D, --sgv_disable_clustered_pool Disable clustered SGV pool\n");
 	printf("  -R, --prealloc_buffers=n Prealloc n buffers\n");
 	printf("  -Z, --prealloc_buffer_size=n Sets the size in KB of each prealloced buffer\n");
+	printf("  -q, --ring=n		Serve each device by a single thread using rings with n entries\n");
+	printf("  -M, --multi=n		Get and reply up to n commands per call\n");
 #if defined(DEBUG) || defined(TRACING)
 	printf("  -d, --debug=level	Debug tracing level\n");
 #endif
@@ -294,6 +300,36 @@ out:
 	return res;
 }
 
+static int setup_ring(struct vdisk_dev *dev)
+{
+	int res;
+	struct scst_user_ring_desc desc;
+	void *ring;
+
+	memset(&desc, 0, sizeof(desc));
+	desc.entries = ring_entries;
+
+	res = ioctl(dev->scst_usr_fd, SCST_USER_SETUP_RING, &desc);
+	if (res != 0) {
+		res = errno;
+		PRINT_ERROR("Unable to set up ring: %s", strerror(res));
+		goto out;
+	}
+
+	ring = mmap(NULL, desc.ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			dev->scst_usr_fd, 0);
+	if (ring == MAP_FAILED) {
+		res = errno;
+		PRINT_ERROR("Unable to map ring: %s", strerror(res));
+		goto out;
+	}
+
+	dev->ring = ring;
+
+out:
+	return res;
+}
+
 int start(int argc, char **argv)
 {
 	int res = 0;
@@ -324,6 +360,7 @@ int start(int argc, char **argv)
 		devs[i].o_direct_flag = o_direct_flag;
 		devs[i].nullio = nullio;
 		devs[i].non_blocking = non_blocking;
+		devs[i].multi_cnt = multi_cnt;
 #if defined(DEBUG_TM_IGNORE) || defined(DEBUG_TM_IGNORE_ALL)
 		devs[i].debug_tm_ignore = debug_tm_ignore;
 #endif
@@ -433,13 +470,28 @@ int start(int argc, char **argv)
 			goto out_unreg;
 		}
 
-		for (j = 0; j < threads; j++) {
-			rc = pthread_create(&thread[i][j], NULL, main_loop, &devs[i]);
+		if (ring_entries > 0) {
+			res = setup_ring(&devs[i]);
+			if (res != 0)
+				goto out_unreg;
+
+			rc = pthread_create(&thread[i][0], NULL, ring_loop, &devs[i]);
 			if (rc != 0) {
 				res = errno;
 				PRINT_ERROR("pthread_create() failed: %s",
 					strerror(res));
-				break;
+			}
+		} else {
+			for (j = 0; j < threads; j++) {
+				rc = pthread_create(&thread[i][j], NULL,
+					(multi_cnt > 0) ? multi_loop : main_loop,
+					&devs[i]);
+				if (rc != 0) {
+					res = errno;
+					PRINT_ERROR("pthread_create() failed: %s",
+						strerror(res));
+					break;
+				}
 			}
 		}
 
@@ -505,7 +557,7 @@ int main(int argc, char **argv)
 
 	memset(devs, 0, sizeof(devs));
 
-	while ((ch = getopt_long(argc, argv, "+b:e:trongluF:I:cp:f:m:d:vsS:P:hDR:Z:",
+	while ((ch = getopt_long(argc, argv, "+b:e:trongluF:I:cp:f:m:d:vsS:P:hDR:Z:q:M:",
 			long_options, &longindex)) >= 0) {
 		switch (ch) {
 		case 'b':
@@ -577,6 +629,16 @@ int main(int argc, char **argv)
 		case 'Z':
 			prealloc_buffer_size = atoi(optarg) * 1024;
 			break;
+		case 'q':
+			ring_entries = atoi(optarg);
+			break;
+		case 'M':
+			multi_cnt = atoi(optarg);
+			if ((multi_cnt < 0) || (multi_cnt > INT16_MAX)) {
+				PRINT_ERROR("Wrong multi count %d", multi_cnt);
+				goto out_usage;
+			}
+			break;
 		case 'm':
 			if (strncmp(optarg, "all", 3) == 0)
 				memory_reuse_type = SCST_USER_MEM_REUSE_ALL;
@@ -705,6 +767,13 @@ int main(int argc, char **argv)
 		PRINT_INFO("	Prealloc %d buffers of %dKB",
 			prealloc_buffers_num, prealloc_buffer_size / 1024);
 
+	if (ring_entries > 0)
+		PRINT_INFO("	Use rings with %d entries, single thread per "
+			"device", ring_entries);
+	else if (multi_cnt > 0)
+		PRINT_INFO("	Get and reply up to %d commands per call",
+			multi_cnt);
+
 	if (!o_direct_flag && (memory_reuse_type == SCST_USER_MEM_NO_REUSE)) {
 		PRINT_INFO("	%s", "Using unaligned buffers");
 		alloc_fn = malloc;